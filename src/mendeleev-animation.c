@@ -0,0 +1,239 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-animation.h"
+
+/* Entries of a queued frame are packed as 0x01RRGGBB, 0 for a slave not set
+   by the frame */
+#define ANIM_VALID 0x01000000
+
+/* Weight of a new interval in the average frame rate */
+#define ANIM_FPS_ALPHA 0.125
+
+typedef struct _anim_frame {
+    uint32_t colors[MENDELEEV_FRAMEBUFFER_SIZE];
+} anim_frame_t;
+
+struct _mendeleev_animation {
+    mendeleev_framebuffer_t *fb;
+    int flags;
+    /* Period in microseconds */
+    int64_t period;
+    /* Due time of frame 0, 0 until the first push */
+    int64_t start;
+    /* Number of the next frame to push */
+    unsigned long next_number;
+    /* Circular queue of frames, the oldest is number next_number - nb_queued */
+    anim_frame_t queue[MENDELEEV_ANIMATION_QUEUE_LENGTH];
+    int first;
+    int nb_queued;
+    int64_t last_commit;
+    double interval;
+    mendeleev_animation_stats_t stats;
+};
+
+static void _sleep_until(int64_t deadline)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int64_t _due_time(const mendeleev_animation_t *anim, unsigned long number)
+{
+    return anim->start + (int64_t)number * anim->period;
+}
+
+/* Writes the slaves set by frame in the framebuffer */
+static void _apply(mendeleev_animation_t *anim, const anim_frame_t *frame)
+{
+    int i;
+
+    for (i = 1; i < MENDELEEV_GROUP_ADDRESS_BASE; i++) {
+        uint32_t value = frame->colors[i];
+
+        if (value & ANIM_VALID) {
+            mendeleev_color_t color;
+
+            color.r = (value >> 16) & 0xFF;
+            color.g = (value >> 8) & 0xFF;
+            color.b = value & 0xFF;
+            mendeleev_framebuffer_set_color(anim->fb, i, &color);
+        }
+    }
+}
+
+/* Removes the oldest frame of the queue, the stale frames are applied to the
+   framebuffer before the next one unless they are dropped */
+static void _pop(mendeleev_animation_t *anim, int stale)
+{
+    if (!stale || !(anim->flags & MENDELEEV_ANIMATION_DROP_STALE))
+        _apply(anim, &anim->queue[anim->first]);
+
+    if (stale) {
+        if (anim->flags & MENDELEEV_ANIMATION_DROP_STALE)
+            anim->stats.frames_dropped++;
+        else
+            anim->stats.frames_merged++;
+    }
+
+    anim->first = (anim->first + 1) % MENDELEEV_ANIMATION_QUEUE_LENGTH;
+    anim->nb_queued--;
+}
+
+mendeleev_animation_t* mendeleev_animation_new(mendeleev_framebuffer_t *fb, double fps, int flags)
+{
+    mendeleev_animation_t *anim;
+
+    if (fb == NULL || fps <= 0 || fps > 1000000 ||
+        (flags & ~MENDELEEV_ANIMATION_DROP_STALE)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    anim = (mendeleev_animation_t *)calloc(1, sizeof(mendeleev_animation_t));
+    if (anim == NULL)
+        return NULL;
+
+    anim->fb = fb;
+    anim->flags = flags;
+    anim->period = (int64_t)(1000000 / fps);
+
+    return anim;
+}
+
+void mendeleev_animation_free(mendeleev_animation_t *anim)
+{
+    free(anim);
+}
+
+/* Queues the next frame of the stream, made of the colours of nb consecutive
+   slaves starting at first_slave. The slaves not given keep their colour.
+   Fails with EAGAIN when the queue is full, mendeleev_animation_run_once()
+   must be called first. */
+int mendeleev_animation_push(mendeleev_animation_t *anim, int first_slave,
+                             const mendeleev_color_t *colors, int nb)
+{
+    anim_frame_t *frame;
+    int i;
+
+    if (anim == NULL || colors == NULL || nb < 1 || first_slave < 1 ||
+        first_slave + nb - 1 >= MENDELEEV_GROUP_ADDRESS_BASE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (anim->nb_queued == MENDELEEV_ANIMATION_QUEUE_LENGTH) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* The stream starts with its first frame */
+    if (anim->start == 0)
+        anim->start = _time_us();
+
+    frame = &anim->queue[(anim->first + anim->nb_queued) % MENDELEEV_ANIMATION_QUEUE_LENGTH];
+    memset(frame, 0, sizeof(anim_frame_t));
+    for (i = 0; i < nb; i++) {
+        frame->colors[first_slave + i] = ANIM_VALID |
+            (colors[i].r << 16) | (colors[i].g << 8) | colors[i].b;
+    }
+    anim->nb_queued++;
+    anim->next_number++;
+    anim->stats.frames_pushed++;
+
+    return 0;
+}
+
+/* Waits until the oldest queued frame is due and sends the most recent due
+   frame, the older ones being stale. Returns the number of messages sent, 0
+   when the queue is empty, or -1 if the commit failed (the slaves not
+   acknowledged are sent with the next frame). */
+int mendeleev_animation_run_once(mendeleev_animation_t *anim)
+{
+    unsigned long number;
+    int64_t now;
+    int64_t end;
+    int64_t wire_time;
+    int rc;
+
+    if (anim == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (anim->nb_queued == 0)
+        return 0;
+
+    number = anim->next_number - anim->nb_queued;
+    _sleep_until(_due_time(anim, number));
+    now = _time_us();
+
+    /* Frames followed by a due frame are stale */
+    while (anim->nb_queued > 1 && _due_time(anim, number + 1) <= now) {
+        _pop(anim, TRUE);
+        number++;
+    }
+    _pop(anim, FALSE);
+
+    wire_time = mendeleev_framebuffer_get_wire_time(anim->fb);
+    if (wire_time != -1) {
+        anim->stats.wire_time = wire_time;
+        anim->stats.load = (double)wire_time / anim->period;
+        if (wire_time > anim->stats.max_wire_time)
+            anim->stats.max_wire_time = wire_time;
+    }
+
+    rc = mendeleev_framebuffer_commit(anim->fb);
+    end = _time_us();
+
+    if (rc == -1) {
+        anim->stats.errors++;
+    } else {
+        anim->stats.frames_sent++;
+    }
+
+    anim->stats.commit_time = end - now;
+    if (anim->stats.commit_time > anim->stats.max_commit_time)
+        anim->stats.max_commit_time = anim->stats.commit_time;
+
+    /* The frame must be on the line before the next one is due */
+    if (end > _due_time(anim, number + 1))
+        anim->stats.deadline_misses++;
+
+    if (anim->last_commit != 0) {
+        double interval = now - anim->last_commit;
+
+        if (anim->interval == 0)
+            anim->interval = interval;
+        else
+            anim->interval += ANIM_FPS_ALPHA * (interval - anim->interval);
+        if (anim->interval > 0)
+            anim->stats.fps = 1000000 / anim->interval;
+    }
+    anim->last_commit = now;
+
+    return rc;
+}
+
+int mendeleev_animation_get_stats(mendeleev_animation_t *anim,
+                                  mendeleev_animation_stats_t *stats)
+{
+    if (anim == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = anim->stats;
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_ANIMATION_H
+#define MENDELEEV_ANIMATION_H
+
+#include "mendeleev.h"
+#include "mendeleev-color.h"
+#include "mendeleev-framebuffer.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* Plays a stream of frames at a fixed rate through a framebuffer.
+ *
+ * Frame n of the stream is due at the start of the animation plus n periods.
+ * When the bus can't keep up, the frames whose successor is already due are
+ * stale: they are merged into the next one (slaves only set in the stale frame
+ * are still sent) or dropped with MENDELEEV_ANIMATION_DROP_STALE. */
+
+#define MENDELEEV_ANIMATION_DROP_STALE (1 << 0)
+
+/* Frames which can wait in the queue */
+#define MENDELEEV_ANIMATION_QUEUE_LENGTH 8
+
+typedef struct _mendeleev_animation mendeleev_animation_t;
+
+typedef struct _mendeleev_animation_stats {
+    /* Frames pushed, committed, merged into a later frame and dropped */
+    unsigned long frames_pushed;
+    unsigned long frames_sent;
+    unsigned long frames_merged;
+    unsigned long frames_dropped;
+    /* Frames not on the line before the next one was due */
+    unsigned long deadline_misses;
+    /* Failed commits */
+    unsigned long errors;
+    /* Average rate of the committed frames */
+    double fps;
+    /* Estimated wire time of the last frame, its ratio to the period and the
+       worst one, in microseconds */
+    int64_t wire_time;
+    double load;
+    int64_t max_wire_time;
+    /* Duration of the last and the slowest commit in microseconds */
+    int64_t commit_time;
+    int64_t max_commit_time;
+} mendeleev_animation_stats_t;
+
+MENDELEEV_API mendeleev_animation_t* mendeleev_animation_new(mendeleev_framebuffer_t *fb, double fps, int flags);
+MENDELEEV_API void mendeleev_animation_free(mendeleev_animation_t *anim);
+
+MENDELEEV_API int mendeleev_animation_push(mendeleev_animation_t *anim, int first_slave,
+                                           const mendeleev_color_t *colors, int nb);
+MENDELEEV_API int mendeleev_animation_run_once(mendeleev_animation_t *anim);
+MENDELEEV_API int mendeleev_animation_get_stats(mendeleev_animation_t *anim,
+                                                mendeleev_animation_stats_t *stats);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_ANIMATION_H */
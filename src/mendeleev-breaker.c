@@ -0,0 +1,260 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "mendeleev-private.h"
+
+typedef struct _mendeleev_breaker_entry {
+    uint8_t state;
+    /* Consecutive timeouts */
+    uint16_t nb_timeouts;
+    /* Delay between two probes, doubled by each failed probe */
+    int64_t backoff;
+    int64_t next_probe;
+} mendeleev_breaker_entry_t;
+
+struct _mendeleev_breaker {
+    int threshold;
+    /* Set while a probe is sent, which the open breaker lets through */
+    int probing;
+    mendeleev_breaker_entry_t slave[256];
+};
+
+static void _transition(mendeleev_t *ctx, int slave, mendeleev_breaker_state state)
+{
+    mendeleev_breaker_entry_t *entry = &ctx->breaker->slave[slave];
+    mendeleev_breaker_state from = entry->state;
+
+    if (from == state)
+        return;
+
+    entry->state = state;
+    if (ctx->debug)
+        printf("Breaker of slave %d: %d -> %d\n", slave, from, state);
+
+    if (ctx->breaker_callback != NULL) {
+        int saved_errno = errno;
+
+        ctx->breaker_callback(ctx, slave, from, state, ctx->breaker_user_data);
+        errno = saved_errno;
+    }
+}
+
+/* Opens the breaker until the next probe */
+static void _open(mendeleev_t *ctx, int slave, int64_t backoff)
+{
+    mendeleev_breaker_entry_t *entry = &ctx->breaker->slave[slave];
+
+    if (backoff < ctx->breaker_backoff_min)
+        backoff = ctx->breaker_backoff_min;
+    if (backoff > ctx->breaker_backoff_max)
+        backoff = ctx->breaker_backoff_max;
+    entry->backoff = backoff;
+    entry->next_probe = _time_us() + backoff;
+
+    if (entry->state == MENDELEEV_BREAKER_CLOSED)
+        ctx->stats.breaker_trips++;
+    _transition(ctx, slave, MENDELEEV_BREAKER_OPEN);
+
+    _schedule_wakeup(ctx);
+}
+
+/* Returns -1 with errno set to EMBDOWN when the requests to slave must fail
+   fast, the probes excepted */
+int _breaker_check(mendeleev_t *ctx, int slave)
+{
+    if (ctx->breaker->slave[slave].state != MENDELEEV_BREAKER_CLOSED &&
+        !ctx->breaker->probing) {
+        errno = EMBDOWN;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns TRUE when slave must be probed: its breaker is open and the backoff
+   has elapsed, or a probe was lost without being completed */
+int _breaker_is_due(mendeleev_t *ctx, int slave, int64_t now)
+{
+    const mendeleev_breaker_entry_t *entry = &ctx->breaker->slave[slave];
+
+    return entry->state != MENDELEEV_BREAKER_CLOSED && entry->next_probe <= now &&
+        !_is_inflight_slave(ctx, slave);
+}
+
+/* Returns the first slave to probe, -1 if none */
+int _breaker_next_due(mendeleev_t *ctx, int64_t now)
+{
+    int slave;
+
+    for (slave = 0; slave < 256; slave++) {
+        if (_breaker_is_due(ctx, slave, now))
+            return slave;
+    }
+    return -1;
+}
+
+/* Returns the time of the next probe, -1 if no breaker is open or waits for
+   the completion of a probe */
+int64_t _breaker_next_probe(mendeleev_t *ctx)
+{
+    int slave;
+    int64_t next = -1;
+
+    for (slave = 0; slave < 256; slave++) {
+        const mendeleev_breaker_entry_t *entry = &ctx->breaker->slave[slave];
+
+        if (entry->state != MENDELEEV_BREAKER_CLOSED && !_is_inflight_slave(ctx, slave) &&
+            (next == -1 || entry->next_probe < next))
+            next = entry->next_probe;
+    }
+    return next;
+}
+
+/* To call around the sending of the probe of slave, which is let through */
+void _breaker_probe_start(mendeleev_t *ctx, int slave)
+{
+    mendeleev_breaker_entry_t *entry = &ctx->breaker->slave[slave];
+
+    ctx->breaker->probing = TRUE;
+    /* The probe is sent again after the backoff if it gets lost */
+    entry->next_probe = _time_us() + entry->backoff;
+    _transition(ctx, slave, MENDELEEV_BREAKER_HALF_OPEN);
+}
+
+void _breaker_probe_end(mendeleev_t *ctx, int slave, int rc)
+{
+    ctx->breaker->probing = FALSE;
+    if (rc == -1)
+        _open(ctx, slave, 2 * ctx->breaker->slave[slave].backoff);
+}
+
+/* Accounts the completion of a request to slave: a timeout or a response */
+void _breaker_update(mendeleev_t *ctx, int slave, int timed_out)
+{
+    mendeleev_breaker_entry_t *entry = &ctx->breaker->slave[slave];
+
+    if (!timed_out) {
+        entry->nb_timeouts = 0;
+        _transition(ctx, slave, MENDELEEV_BREAKER_CLOSED);
+        return;
+    }
+
+    if (entry->nb_timeouts < UINT16_MAX)
+        entry->nb_timeouts++;
+
+    switch (entry->state) {
+    case MENDELEEV_BREAKER_CLOSED:
+        if (entry->nb_timeouts >= ctx->breaker->threshold)
+            _open(ctx, slave, ctx->breaker_backoff_min);
+        break;
+    case MENDELEEV_BREAKER_HALF_OPEN:
+        /* Failed probe */
+        _open(ctx, slave, 2 * entry->backoff);
+        break;
+    default:
+        break;
+    }
+}
+
+void _breaker_free(mendeleev_t *ctx)
+{
+    free(ctx->breaker);
+    ctx->breaker = NULL;
+}
+
+/* Opens the breaker of a slave after threshold consecutive timeouts, 0 to
+   disable the breakers (default). The requests to the slave then fail with
+   EMBDOWN, the skipped commands of a batch included, until a GET_VERSION probe
+   is answered. The probes are sent by mendeleev_on_readable() and
+   mendeleev_on_timeout(), or by mendeleev_send_command() for the slave, after
+   a backoff doubled by each failed probe. */
+int mendeleev_set_breaker(mendeleev_t *ctx, int threshold)
+{
+    if (ctx == NULL || threshold < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (threshold == 0) {
+        _breaker_free(ctx);
+        return 0;
+    }
+
+    if (ctx->breaker == NULL) {
+        ctx->breaker = calloc(1, sizeof(mendeleev_breaker_t));
+        if (ctx->breaker == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    ctx->breaker->threshold = threshold;
+    return 0;
+}
+
+/* Bounds of the delay between two probes in microseconds */
+int mendeleev_set_breaker_backoff(mendeleev_t *ctx, uint32_t min_usec, uint32_t max_usec)
+{
+    if (ctx == NULL || min_usec == 0 || min_usec > max_usec) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->breaker_backoff_min = min_usec;
+    ctx->breaker_backoff_max = max_usec;
+    return 0;
+}
+
+/* The callback is called on each change of state of a breaker, from the
+   function which completed the request or the probe */
+int mendeleev_set_breaker_callback(mendeleev_t *ctx, mendeleev_breaker_cb callback,
+                                   void *user_data)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->breaker_callback = callback;
+    ctx->breaker_user_data = user_data;
+    return 0;
+}
+
+/* Returns the state of the breaker of slave */
+int mendeleev_get_breaker_state(mendeleev_t *ctx, int slave)
+{
+    if (ctx == NULL || slave < 0 || slave > 255) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->breaker == NULL)
+        return MENDELEEV_BREAKER_CLOSED;
+
+    return ctx->breaker->slave[slave].state;
+}
+
+/* Closes the breaker of slave, or of all the slaves when slave is -1 */
+int mendeleev_reset_breaker(mendeleev_t *ctx, int slave)
+{
+    int i;
+
+    if (ctx == NULL || slave < -1 || slave > 255) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->breaker == NULL)
+        return 0;
+
+    for (i = 0; i < 256; i++) {
+        if (slave == -1 || slave == i) {
+            ctx->breaker->slave[i].nb_timeouts = 0;
+            _transition(ctx, i, MENDELEEV_BREAKER_CLOSED);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-color.h"
+
+/* Packs the colours of nb consecutive slaves, starting at first_slave, in a
+   dense colour table. Returns the length of the payload or -1 if it doesn't
+   fit in dest or in a message. */
+int mendeleev_pack_color_table_dense(uint8_t *dest, int dest_size, int first_slave,
+                                     const mendeleev_color_t *colors, int nb)
+{
+    int i;
+    int length = MENDELEEV_COLOR_TABLE_HEADER_DENSE + nb * MENDELEEV_COLOR_LENGTH;
+
+    if (dest == NULL || colors == NULL || nb < 1 || first_slave < 1 ||
+        first_slave + nb - 1 >= MENDELEEV_GROUP_ADDRESS_BASE ||
+        length > dest_size || length > MENDELEEV_MAX_DATA_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dest[0] = MENDELEEV_COLOR_TABLE_DENSE;
+    dest[1] = first_slave;
+    for (i = 0; i < nb; i++) {
+        uint8_t *entry = dest + MENDELEEV_COLOR_TABLE_HEADER_DENSE + i * MENDELEEV_COLOR_LENGTH;
+        entry[0] = colors[i].r;
+        entry[1] = colors[i].g;
+        entry[2] = colors[i].b;
+    }
+
+    return length;
+}
+
+/* Packs the colours of the nb given slaves in a sparse colour table. Returns
+   the length of the payload or -1 if it doesn't fit in dest or in a
+   message. */
+int mendeleev_pack_color_table_sparse(uint8_t *dest, int dest_size, const uint8_t *slaves,
+                                      const mendeleev_color_t *colors, int nb)
+{
+    int i;
+    int length = MENDELEEV_COLOR_TABLE_HEADER_SPARSE +
+        nb * (MENDELEEV_ADDR_LENGTH + MENDELEEV_COLOR_LENGTH);
+
+    if (dest == NULL || slaves == NULL || colors == NULL || nb < 1 ||
+        length > dest_size || length > MENDELEEV_MAX_DATA_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dest[0] = MENDELEEV_COLOR_TABLE_SPARSE;
+    for (i = 0; i < nb; i++) {
+        uint8_t *entry = dest + MENDELEEV_COLOR_TABLE_HEADER_SPARSE +
+            i * (MENDELEEV_ADDR_LENGTH + MENDELEEV_COLOR_LENGTH);
+        entry[0] = slaves[i];
+        entry[1] = colors[i].r;
+        entry[2] = colors[i].g;
+        entry[3] = colors[i].b;
+    }
+
+    return length;
+}
+
+/* Broadcasts a colour table packed by one of the functions above, whatever
+   the current slave. Returns the number of bytes sent or -1. */
+int mendeleev_set_color_table(mendeleev_t *ctx, const uint8_t *table, uint16_t table_length)
+{
+    int rc;
+    int saved_slave;
+
+    if (ctx == NULL || table == NULL || table_length == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    saved_slave = ctx->slave;
+    ctx->slave = MENDELEEV_BROADCAST_ADDRESS;
+    rc = mendeleev_send_command(ctx, MENDELEEV_CMD_SET_COLOR_TABLE, (uint8_t *)table,
+                                table_length, NULL, NULL);
+    ctx->slave = saved_slave;
+
+    return rc;
+}
@@ -0,0 +1,38 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_COLOR_H
+#define MENDELEEV_COLOR_H
+
+#include "mendeleev.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* Payload of MENDELEEV_CMD_SET_COLOR */
+typedef struct _mendeleev_color {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+} mendeleev_color_t;
+
+/* Layouts of the MENDELEEV_CMD_SET_COLOR_TABLE payload, given by its first
+ * byte. Each node picks its own entry out of the broadcast table.
+ * - dense: first slave address, then one colour per consecutive address
+ * - sparse: (slave address, colour) entries */
+#define MENDELEEV_COLOR_TABLE_DENSE   0x00
+#define MENDELEEV_COLOR_TABLE_SPARSE  0x01
+
+#define MENDELEEV_COLOR_LENGTH        3
+#define MENDELEEV_COLOR_TABLE_HEADER_DENSE   2
+#define MENDELEEV_COLOR_TABLE_HEADER_SPARSE  1
+
+MENDELEEV_API int mendeleev_pack_color_table_dense(uint8_t *dest, int dest_size, int first_slave,
+                                                   const mendeleev_color_t *colors, int nb);
+MENDELEEV_API int mendeleev_pack_color_table_sparse(uint8_t *dest, int dest_size, const uint8_t *slaves,
+                                                    const mendeleev_color_t *colors, int nb);
+MENDELEEV_API int mendeleev_set_color_table(mendeleev_t *ctx, const uint8_t *table, uint16_t table_length);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_COLOR_H */
@@ -0,0 +1,404 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CRC16_CLMUL 1
+#elif defined(__aarch64__) && defined(HAVE_SYS_AUXV_H)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC16_PMULL 1
+#endif
+
+#include "mendeleev-private.h"
+
+#include "mendeleev-crc.h"
+
+/* Three engines give the same results:
+ * - table: the byte at a time libmodbus loop, the reference
+ * - slice8: eight bytes per step with eight derived tables
+ * - clmul: folding of 64 byte blocks with carry-less multiplications
+ *   (PCLMULQDQ on x86, PMULL on ARMv8), the end is done by slice8
+ *
+ * The engines work on the reflected CRC register, the byte swapped value of
+ * the libmodbus tables: it's XORed into the first bytes of the data. */
+
+/* Table of CRC values for high-order byte */
+static const uint8_t table_crc_hi[] = {
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
+};
+
+/* Table of CRC values for low-order byte */
+static const uint8_t table_crc_lo[] = {
+    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
+    0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
+    0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
+    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
+    0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
+    0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
+    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
+    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
+    0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
+    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
+    0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
+    0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
+    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
+    0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
+    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
+    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
+    0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
+    0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
+    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
+    0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
+    0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
+    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
+    0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
+    0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
+    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
+    0x43, 0x83, 0x41, 0x81, 0x80, 0x40
+};
+
+/* The derived tables of slice8, table[k][b] is the register after b followed
+   by k zero bytes */
+static uint16_t table_slice[8][256];
+
+/* Folding constants, x^n mod P for the 64 bit lanes of a 128 bit block */
+static uint64_t fold_512[2];
+static uint64_t fold_128[2];
+
+/* Below this length the set-up of the folding costs more than it saves */
+#define CLMUL_MIN_LENGTH 128
+
+typedef uint16_t (*crc16_engine_t)(uint16_t reg, const uint8_t *buffer, size_t length);
+
+static crc16_engine_t crc16_engine = NULL;
+static const char *crc16_engine_name = NULL;
+
+static uint16_t _bswap16(uint16_t value)
+{
+    return (value << 8) | (value >> 8);
+}
+
+static uint16_t _crc16_table(uint16_t reg, const uint8_t *buffer, size_t length)
+{
+    uint8_t crc_hi = reg & 0x00FF;
+    uint8_t crc_lo = reg >> 8;
+    unsigned int i;
+
+    while (length--) {
+        i = crc_hi ^ *buffer++;
+        crc_hi = crc_lo ^ table_crc_hi[i];
+        crc_lo = table_crc_lo[i];
+    }
+
+    return (crc_lo << 8) | crc_hi;
+}
+
+static uint64_t _load64_le(const uint8_t *buffer)
+{
+    uint64_t value;
+
+    memcpy(&value, buffer, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static uint16_t _crc16_slice8(uint16_t reg, const uint8_t *buffer, size_t length)
+{
+    while (length >= 8) {
+        uint64_t x = _load64_le(buffer) ^ reg;
+
+        reg = table_slice[7][x & 0xFF] ^
+            table_slice[6][(x >> 8) & 0xFF] ^
+            table_slice[5][(x >> 16) & 0xFF] ^
+            table_slice[4][(x >> 24) & 0xFF] ^
+            table_slice[3][(x >> 32) & 0xFF] ^
+            table_slice[2][(x >> 40) & 0xFF] ^
+            table_slice[1][(x >> 48) & 0xFF] ^
+            table_slice[0][x >> 56];
+        buffer += 8;
+        length -= 8;
+    }
+
+    while (length--)
+        reg = (reg >> 8) ^ table_slice[0][(reg ^ *buffer++) & 0xFF];
+
+    return reg;
+}
+
+/* x^n mod P, P = x^16 + x^15 + x^2 + 1, in the usual bit order */
+static uint16_t _xpow_mod(unsigned int n)
+{
+    uint32_t r = 1;
+
+    while (n--) {
+        r <<= 1;
+        if (r & 0x10000)
+            r ^= 0x18005;
+    }
+
+    return r;
+}
+
+/* Reflects a polynomial of degree < 16 into a 64 bit lane, where bit j is the
+   coefficient of x^(63 - j) like the bytes of the data */
+static uint64_t _reflect_lane(uint16_t poly)
+{
+    uint64_t lane = 0;
+    int d;
+
+    for (d = 0; d < 16; d++) {
+        if (poly & (1 << d))
+            lane |= (uint64_t)1 << (63 - d);
+    }
+
+    return lane;
+}
+
+/* The carry-less product of two reflected lanes is the reflected product
+   multiplied by x, so the fold of a block by n bits multiplies its first lane
+   by x^(n + 63) and its second lane by x^(n - 1) */
+static void _fold_constants(uint64_t *constants, unsigned int n)
+{
+    constants[0] = _reflect_lane(_xpow_mod(n + 63));
+    constants[1] = _reflect_lane(_xpow_mod(n - 1));
+}
+
+#ifdef HAVE_CRC16_CLMUL
+__attribute__((target("pclmul,sse2")))
+static __m128i _fold_clmul(__m128i x, __m128i k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                         _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t _crc16_clmul(uint16_t reg, const uint8_t *buffer, size_t length)
+{
+    __m128i k512;
+    __m128i k128;
+    __m128i x0, x1, x2, x3;
+    uint8_t block[16];
+
+    if (length < CLMUL_MIN_LENGTH)
+        return _crc16_slice8(reg, buffer, length);
+
+    k512 = _mm_set_epi64x(fold_512[1], fold_512[0]);
+    k128 = _mm_set_epi64x(fold_128[1], fold_128[0]);
+
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buffer),
+                       _mm_cvtsi32_si128(reg));
+    x1 = _mm_loadu_si128((const __m128i *)(buffer + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(buffer + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(buffer + 48));
+    buffer += 64;
+    length -= 64;
+
+    while (length >= 64) {
+        x0 = _mm_xor_si128(_fold_clmul(x0, k512), _mm_loadu_si128((const __m128i *)buffer));
+        x1 = _mm_xor_si128(_fold_clmul(x1, k512), _mm_loadu_si128((const __m128i *)(buffer + 16)));
+        x2 = _mm_xor_si128(_fold_clmul(x2, k512), _mm_loadu_si128((const __m128i *)(buffer + 32)));
+        x3 = _mm_xor_si128(_fold_clmul(x3, k512), _mm_loadu_si128((const __m128i *)(buffer + 48)));
+        buffer += 64;
+        length -= 64;
+    }
+
+    x1 = _mm_xor_si128(x1, _fold_clmul(x0, k128));
+    x2 = _mm_xor_si128(x2, _fold_clmul(x1, k128));
+    x3 = _mm_xor_si128(x3, _fold_clmul(x2, k128));
+
+    while (length >= 16) {
+        x3 = _mm_xor_si128(_fold_clmul(x3, k128), _mm_loadu_si128((const __m128i *)buffer));
+        buffer += 16;
+        length -= 16;
+    }
+
+    /* The remaining block has the same CRC as all the folded data */
+    _mm_storeu_si128((__m128i *)block, x3);
+    reg = _crc16_slice8(0, block, sizeof(block));
+
+    return _crc16_slice8(reg, buffer, length);
+}
+
+static int _has_clmul(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+}
+#endif
+
+#ifdef HAVE_CRC16_PMULL
+__attribute__((target("+crypto")))
+static uint64x2_t _fold_pmull(uint64x2_t x, const uint64_t *k)
+{
+    poly128_t lo = vmull_p64(vgetq_lane_u64(x, 0), k[0]);
+    poly128_t hi = vmull_p64(vgetq_lane_u64(x, 1), k[1]);
+
+    return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+}
+
+__attribute__((target("+crypto")))
+static uint16_t _crc16_clmul(uint16_t reg, const uint8_t *buffer, size_t length)
+{
+    uint64x2_t x0, x1, x2, x3;
+    uint8_t block[16];
+
+    if (length < CLMUL_MIN_LENGTH)
+        return _crc16_slice8(reg, buffer, length);
+
+    x0 = veorq_u64(vreinterpretq_u64_u8(vld1q_u8(buffer)),
+                   vsetq_lane_u64(reg, vdupq_n_u64(0), 0));
+    x1 = vreinterpretq_u64_u8(vld1q_u8(buffer + 16));
+    x2 = vreinterpretq_u64_u8(vld1q_u8(buffer + 32));
+    x3 = vreinterpretq_u64_u8(vld1q_u8(buffer + 48));
+    buffer += 64;
+    length -= 64;
+
+    while (length >= 64) {
+        x0 = veorq_u64(_fold_pmull(x0, fold_512), vreinterpretq_u64_u8(vld1q_u8(buffer)));
+        x1 = veorq_u64(_fold_pmull(x1, fold_512), vreinterpretq_u64_u8(vld1q_u8(buffer + 16)));
+        x2 = veorq_u64(_fold_pmull(x2, fold_512), vreinterpretq_u64_u8(vld1q_u8(buffer + 32)));
+        x3 = veorq_u64(_fold_pmull(x3, fold_512), vreinterpretq_u64_u8(vld1q_u8(buffer + 48)));
+        buffer += 64;
+        length -= 64;
+    }
+
+    x1 = veorq_u64(x1, _fold_pmull(x0, fold_128));
+    x2 = veorq_u64(x2, _fold_pmull(x1, fold_128));
+    x3 = veorq_u64(x3, _fold_pmull(x2, fold_128));
+
+    while (length >= 16) {
+        x3 = veorq_u64(_fold_pmull(x3, fold_128), vreinterpretq_u64_u8(vld1q_u8(buffer)));
+        buffer += 16;
+        length -= 16;
+    }
+
+    vst1q_u8(block, vreinterpretq_u8_u64(x3));
+    reg = _crc16_slice8(0, block, sizeof(block));
+
+    return _crc16_slice8(reg, buffer, length);
+}
+
+static int _has_clmul(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif
+
+static crc16_engine_t _crc16_select(const char **name)
+{
+#if defined(HAVE_CRC16_CLMUL) || defined(HAVE_CRC16_PMULL)
+    if (_has_clmul()) {
+        *name = "clmul";
+        return _crc16_clmul;
+    }
+#endif
+    *name = "slice8";
+    return _crc16_slice8;
+}
+
+/* Derives the tables and constants and picks the engine when the library is
+   loaded, before any thread may compute a CRC */
+__attribute__((constructor))
+static void _crc16_init(void)
+{
+    int b;
+    int k;
+    const char *name;
+
+    for (b = 0; b < 256; b++)
+        table_slice[0][b] = table_crc_hi[b] | (table_crc_lo[b] << 8);
+    for (k = 1; k < 8; k++) {
+        for (b = 0; b < 256; b++) {
+            uint16_t prev = table_slice[k - 1][b];
+            table_slice[k][b] = (prev >> 8) ^ table_slice[0][prev & 0xFF];
+        }
+    }
+
+    _fold_constants(fold_512, 512);
+    _fold_constants(fold_128, 128);
+
+    crc16_engine = _crc16_select(&name);
+    crc16_engine_name = name;
+}
+
+/* Forces an engine (table, slice8 or clmul) or the best one with NULL, for
+   the benchmarks, while no other thread computes a CRC */
+int _crc16_set_engine(const char *name)
+{
+    crc16_engine_t engine;
+
+    if (name == NULL) {
+        engine = _crc16_select(&name);
+    } else if (strcmp(name, "table") == 0) {
+        engine = _crc16_table;
+    } else if (strcmp(name, "slice8") == 0) {
+        engine = _crc16_slice8;
+    } else if (strcmp(name, "clmul") == 0) {
+#if defined(HAVE_CRC16_CLMUL) || defined(HAVE_CRC16_PMULL)
+        if (!_has_clmul()) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        engine = _crc16_clmul;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    crc16_engine_name = name;
+    crc16_engine = engine;
+    return 0;
+}
+
+const char *_crc16_get_engine(void)
+{
+    return crc16_engine_name;
+}
+
+uint16_t mendeleev_crc16_update(uint16_t crc, const uint8_t *buffer, size_t buffer_length)
+{
+    return _bswap16(crc16_engine(_bswap16(crc), buffer, buffer_length));
+}
+
+uint16_t mendeleev_crc16(const uint8_t *buffer, uint16_t buffer_length)
+{
+    return mendeleev_crc16_update(MENDELEEV_CRC16_INIT, buffer, buffer_length);
+}
@@ -0,0 +1,28 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_CRC_H
+#define MENDELEEV_CRC_H
+
+#include <stddef.h>
+
+#include "mendeleev.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* CRC-16 of the frames (Modbus polynomial), computed from the destination
+ * address to the end of the payload. The value is the one of the libmodbus
+ * tables: its high byte is sent first.
+ *
+ * The CRC of a message given in several parts is computed by passing
+ * MENDELEEV_CRC16_INIT with the first part, then the returned value with each
+ * following part. */
+#define MENDELEEV_CRC16_INIT 0xFFFF
+
+MENDELEEV_API uint16_t mendeleev_crc16(const uint8_t *buffer, uint16_t buffer_length);
+MENDELEEV_API uint16_t mendeleev_crc16_update(uint16_t crc, const uint8_t *buffer, size_t buffer_length);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_CRC_H */
@@ -0,0 +1,261 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-delta.h"
+
+/* Length of the blocks of the base which are indexed. A shorter match is
+   sent as bytes, a COPY costing up to 11 bytes. */
+#define DELTA_BLOCK       8
+#define DELTA_MIN_BITS    10
+#define DELTA_MAX_BITS    22
+#define DELTA_VARINT_MAX  5
+
+static size_t _put_varint(uint8_t *dest, uint32_t value)
+{
+    size_t length = 0;
+
+    while (value >= 0x80) {
+        dest[length++] = value | 0x80;
+        value >>= 7;
+    }
+    dest[length++] = value;
+
+    return length;
+}
+
+static int _get_varint(const uint8_t *src, size_t size, size_t *offset, uint32_t *value)
+{
+    uint32_t result = 0;
+    int shift;
+
+    for (shift = 0; shift < 35 && *offset < size; shift += 7) {
+        uint8_t byte = src[(*offset)++];
+
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static uint32_t _hash(const uint8_t *block, int bits)
+{
+    uint64_t value;
+
+    memcpy(&value, block, DELTA_BLOCK);
+    return (value * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+static size_t _add(uint8_t *dest, const uint8_t *data, size_t length)
+{
+    size_t n;
+
+    if (length == 0)
+        return 0;
+
+    dest[0] = MENDELEEV_DELTA_ADD;
+    n = 1 + _put_varint(dest + 1, length);
+    memcpy(dest + n, data, length);
+
+    return n + length;
+}
+
+static size_t _copy(uint8_t *dest, size_t offset, size_t length)
+{
+    size_t n;
+
+    dest[0] = MENDELEEV_DELTA_COPY;
+    n = 1 + _put_varint(dest + 1, length);
+    n += _put_varint(dest + n, offset);
+
+    return n;
+}
+
+/* Length of the match of target in base, forward */
+static size_t _match(const uint8_t *base, size_t base_size, size_t base_offset,
+                     const uint8_t *target, size_t target_size, size_t target_offset)
+{
+    size_t length = 0;
+
+    while (base_offset + length < base_size && target_offset + length < target_size &&
+           base[base_offset + length] == target[target_offset + length])
+        length++;
+
+    return length;
+}
+
+/* Encodes the delta from base to target in a buffer to free with free().
+
+   The blocks of the base are indexed by hash. The target is scanned for them,
+   trying first the base right after the previous copy since a small fix
+   mostly leaves the code at the same place or shifted by a few bytes. */
+int mendeleev_delta_encode(const uint8_t *base, size_t base_size,
+                           const uint8_t *target, size_t target_size,
+                           uint8_t **delta, size_t *delta_size)
+{
+    int32_t *table = NULL;
+    uint8_t *out;
+    size_t length = 0;
+    size_t literal = 0;
+    size_t next = 0;
+    size_t pos = 0;
+    int bits = DELTA_MIN_BITS;
+    size_t i;
+
+    if ((base == NULL && base_size > 0) || target == NULL || target_size == 0 ||
+        delta == NULL || delta_size == NULL ||
+        base_size > UINT32_MAX || target_size > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Worst case, a COPY of a block for each block */
+    out = malloc(DELTA_VARINT_MAX + 2 * target_size + 2 * DELTA_VARINT_MAX + 1);
+    if (out == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    length = _put_varint(out, target_size);
+
+    if (base_size >= DELTA_BLOCK) {
+        while (bits < DELTA_MAX_BITS && ((size_t)1 << bits) < base_size)
+            bits++;
+        table = malloc(sizeof(int32_t) << bits);
+        if (table == NULL) {
+            free(out);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(table, 0xFF, sizeof(int32_t) << bits);
+        /* Backward, to keep the first occurrence */
+        for (i = base_size - DELTA_BLOCK + 1; i-- > 0;)
+            table[_hash(base + i, bits)] = i;
+    }
+
+    while (table != NULL && pos + DELTA_BLOCK <= target_size) {
+        size_t match = 0;
+        size_t from = 0;
+        int32_t candidate;
+
+        if (next < base_size && base[next] == target[pos]) {
+            match = _match(base, base_size, next, target, target_size, pos);
+            from = next;
+        }
+        if (match < DELTA_BLOCK) {
+            candidate = table[_hash(target + pos, bits)];
+            if (candidate >= 0) {
+                size_t m = _match(base, base_size, candidate, target, target_size, pos);
+
+                if (m > match) {
+                    match = m;
+                    from = candidate;
+                }
+            }
+        }
+
+        if (match < DELTA_BLOCK) {
+            pos++;
+            continue;
+        }
+
+        /* Extends the match backward over the pending bytes */
+        while (pos > literal && from > 0 && base[from - 1] == target[pos - 1]) {
+            pos--;
+            from--;
+            match++;
+        }
+
+        length += _add(out + length, target + literal, pos - literal);
+        length += _copy(out + length, from, match);
+        pos += match;
+        literal = pos;
+        next = from + match;
+    }
+    length += _add(out + length, target + literal, target_size - literal);
+
+    free(table);
+    *delta = realloc(out, length);
+    if (*delta == NULL)
+        *delta = out;
+    *delta_size = length;
+
+    return 0;
+}
+
+/* Returns the size of the target of delta or -1 if it is malformed */
+int64_t mendeleev_delta_get_target_size(const uint8_t *delta, size_t delta_size)
+{
+    size_t offset = 0;
+    uint32_t size;
+
+    if (delta == NULL || _get_varint(delta, delta_size, &offset, &size) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return size;
+}
+
+/* Rebuilds in target, of target_size bytes, the image encoded by delta from
+   base. Fails with EINVAL when the delta is malformed or doesn't match these
+   sizes. */
+int mendeleev_delta_apply(const uint8_t *base, size_t base_size,
+                          const uint8_t *delta, size_t delta_size,
+                          uint8_t *target, size_t target_size)
+{
+    size_t offset = 0;
+    size_t written = 0;
+    uint32_t size;
+
+    if (delta == NULL || target == NULL ||
+        _get_varint(delta, delta_size, &offset, &size) == -1 || size != target_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (offset < delta_size) {
+        uint8_t op = delta[offset++];
+        uint32_t length;
+        uint32_t from;
+
+        if (_get_varint(delta, delta_size, &offset, &length) == -1 ||
+            length > target_size - written)
+            goto error;
+
+        switch (op) {
+        case MENDELEEV_DELTA_ADD:
+            if (length > delta_size - offset)
+                goto error;
+            memcpy(target + written, delta + offset, length);
+            offset += length;
+            break;
+        case MENDELEEV_DELTA_COPY:
+            if (_get_varint(delta, delta_size, &offset, &from) == -1 ||
+                base == NULL || from > base_size || length > base_size - from)
+                goto error;
+            memcpy(target + written, base + from, length);
+            break;
+        default:
+            goto error;
+        }
+        written += length;
+    }
+
+    if (written != target_size)
+        goto error;
+
+    return 0;
+
+error:
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,33 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_DELTA_H
+#define MENDELEEV_DELTA_H
+
+#include <stddef.h>
+
+#include "mendeleev.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* A delta rebuilds a target image from a base image. It starts with the size
+ * of the target, followed by operations until the target is complete:
+ * - ADD: 0x00, length, then the bytes to append
+ * - COPY: 0x01, length, offset of the bytes to append in the base
+ * The numbers are unsigned LEB128 (7 bits per byte, least significant group
+ * first, the high bit set on all the bytes but the last one). */
+#define MENDELEEV_DELTA_ADD   0x00
+#define MENDELEEV_DELTA_COPY  0x01
+
+MENDELEEV_API int mendeleev_delta_encode(const uint8_t *base, size_t base_size,
+                                         const uint8_t *target, size_t target_size,
+                                         uint8_t **delta, size_t *delta_size);
+MENDELEEV_API int mendeleev_delta_apply(const uint8_t *base, size_t base_size,
+                                        const uint8_t *delta, size_t delta_size,
+                                        uint8_t *target, size_t target_size);
+MENDELEEV_API int64_t mendeleev_delta_get_target_size(const uint8_t *delta, size_t delta_size);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_DELTA_H */
@@ -0,0 +1,547 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-framebuffer.h"
+
+/* Colours are packed as 0x01RRGGBB, the flag telling the entry is set (frame)
+   or known (acknowledged). 0 is an unset entry. */
+#define FB_VALID 0x01000000
+
+/* The diff compares 8 entries per step */
+#define FB_LANES 8
+
+typedef uint32_t fb_vector_t __attribute__((vector_size(FB_LANES * sizeof(uint32_t))));
+typedef int32_t fb_mask_t __attribute__((vector_size(FB_LANES * sizeof(int32_t))));
+
+#define FB_BITMAP_WORDS (MENDELEEV_FRAMEBUFFER_SIZE / 64)
+
+/* Cost in bytes on the line of the frames, to choose between a broadcast and
+   colour tables */
+#define FB_SET_COLOR_COST (MENDELEEV_MSG_OVERHEAD + MENDELEEV_COLOR_LENGTH)
+#define FB_UNICAST_COST (FB_SET_COLOR_COST + MENDELEEV_MSG_OVERHEAD)
+#define FB_SPARSE_ENTRY_LENGTH (MENDELEEV_ADDR_LENGTH + MENDELEEV_COLOR_LENGTH)
+#define FB_SPARSE_MAX_ENTRIES \
+    ((MENDELEEV_MAX_DATA_LENGTH - MENDELEEV_COLOR_TABLE_HEADER_SPARSE) / FB_SPARSE_ENTRY_LENGTH)
+
+/* How a commit sends the dirty slaves */
+typedef struct _fb_plan {
+    /* Broadcast of the majority colour first */
+    int broadcast;
+    uint32_t majority;
+    /* Slaves left to send, in colour tables or by unicast */
+    int nb_rest;
+    int tables;
+    /* Bytes on the line, responses included */
+    int length;
+} fb_plan_t;
+
+struct _mendeleev_framebuffer {
+    mendeleev_t *ctx;
+    int flags;
+    int unicast_max;
+    /* Colours wanted by the application */
+    uint32_t frame[MENDELEEV_FRAMEBUFFER_SIZE];
+    /* Colours acknowledged by the nodes */
+    uint32_t acked[MENDELEEV_FRAMEBUFFER_SIZE];
+};
+
+static uint32_t _pack(const mendeleev_color_t *color)
+{
+    return FB_VALID | (color->r << 16) | (color->g << 8) | color->b;
+}
+
+static void _unpack(uint32_t value, mendeleev_color_t *color)
+{
+    color->r = (value >> 16) & 0xFF;
+    color->g = (value >> 8) & 0xFF;
+    color->b = value & 0xFF;
+}
+
+static int _is_unicast_address(int slave)
+{
+    return slave > 0 && slave < MENDELEEV_GROUP_ADDRESS_BASE;
+}
+
+/* Sets a bit in dirty for each entry of the frame which differs from the
+   acknowledged colour, returns the number of these entries */
+static int _diff(const mendeleev_framebuffer_t *fb, uint64_t *dirty)
+{
+    int i;
+    int j;
+    int nb = 0;
+
+    memset(dirty, 0, FB_BITMAP_WORDS * sizeof(uint64_t));
+
+    for (i = 0; i < MENDELEEV_FRAMEBUFFER_SIZE; i += FB_LANES) {
+        fb_vector_t frame;
+        fb_vector_t acked;
+        fb_mask_t mask;
+
+        memcpy(&frame, fb->frame + i, sizeof(frame));
+        memcpy(&acked, fb->acked + i, sizeof(acked));
+        mask = (frame != acked) & ((frame & FB_VALID) != 0);
+
+        for (j = 0; j < FB_LANES; j++) {
+            if (mask[j]) {
+                dirty[(i + j) / 64] |= (uint64_t)1 << ((i + j) % 64);
+                nb++;
+            }
+        }
+    }
+
+    return nb;
+}
+
+static int _next_dirty(const uint64_t *dirty, int slave)
+{
+    for (slave++; slave < MENDELEEV_FRAMEBUFFER_SIZE; slave++) {
+        uint64_t word = dirty[slave / 64] >> (slave % 64);
+
+        if (word == 0) {
+            /* Skip to the next word */
+            slave |= 63;
+            continue;
+        }
+        return slave + __builtin_ctzll(word);
+    }
+
+    return -1;
+}
+
+static int _compare_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Most common colour of the frame */
+static uint32_t _majority(const mendeleev_framebuffer_t *fb)
+{
+    uint32_t values[MENDELEEV_FRAMEBUFFER_SIZE];
+    uint32_t best = 0;
+    int best_count = 0;
+    int nb = 0;
+    int i;
+
+    for (i = 0; i < MENDELEEV_FRAMEBUFFER_SIZE; i++) {
+        if (fb->frame[i] & FB_VALID)
+            values[nb++] = fb->frame[i];
+    }
+    qsort(values, nb, sizeof(uint32_t), _compare_uint32);
+
+    for (i = 0; i < nb; ) {
+        int j = i;
+
+        while (j < nb && values[j] == values[i])
+            j++;
+        if (j - i > best_count) {
+            best_count = j - i;
+            best = values[i];
+        }
+        i = j;
+    }
+
+    return best;
+}
+
+static int _sparse_cost(int nb)
+{
+    int nb_frames = (nb + FB_SPARSE_MAX_ENTRIES - 1) / FB_SPARSE_MAX_ENTRIES;
+
+    return nb_frames * (MENDELEEV_MSG_OVERHEAD + MENDELEEV_COLOR_TABLE_HEADER_SPARSE) +
+        nb * FB_SPARSE_ENTRY_LENGTH;
+}
+
+/* Sends SET_COLOR to each dirty slave, pipelined up to the in-flight window of
+   the context. Only the colours confirmed by a response are acknowledged.
+   Returns the number of commands sent or -1 if one of them failed. */
+static int _commit_unicast(mendeleev_framebuffer_t *fb, const uint64_t *dirty)
+{
+    mendeleev_t *ctx = fb->ctx;
+    int saved_slave = ctx->slave;
+    int nb_sent = 0;
+    int error = 0;
+    int next = _next_dirty(dirty, -1);
+
+    while (next != -1 || ctx->nb_inflight > 0) {
+        int rc;
+        int slave;
+
+        if (next != -1 && ctx->nb_inflight < ctx->max_inflight) {
+            uint8_t data[MENDELEEV_COLOR_LENGTH];
+            uint32_t value = fb->frame[next];
+
+            data[0] = (value >> 16) & 0xFF;
+            data[1] = (value >> 8) & 0xFF;
+            data[2] = value & 0xFF;
+            ctx->slave = next;
+            rc = mendeleev_send_request(ctx, MENDELEEV_CMD_SET_COLOR, data, sizeof(data));
+            if (rc == -1) {
+                /* Nothing else is sent, the responses of the requests in
+                   flight are still collected */
+                error = errno;
+                next = -1;
+            } else {
+                nb_sent++;
+                next = _next_dirty(dirty, next);
+            }
+            continue;
+        }
+
+        rc = mendeleev_receive_response(ctx, &slave, NULL, NULL, NULL);
+        if (rc != -1) {
+            fb->acked[slave] = fb->frame[slave];
+        } else {
+            error = errno;
+            if (slave == -1) {
+                /* A read error doesn't answer any request, the requests in
+                   flight are abandoned */
+                _inflight_clear(ctx);
+                next = -1;
+            }
+        }
+    }
+
+    ctx->slave = saved_slave;
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return nb_sent;
+}
+
+/* Broadcasts the colour of the dirty slaves in sparse colour tables and
+   acknowledges them. Returns the number of tables sent or -1. */
+static int _commit_tables(mendeleev_framebuffer_t *fb, const uint64_t *dirty)
+{
+    uint8_t slaves[FB_SPARSE_MAX_ENTRIES];
+    mendeleev_color_t colors[FB_SPARSE_MAX_ENTRIES];
+    uint8_t table[MENDELEEV_MAX_DATA_LENGTH];
+    int nb_sent = 0;
+    int slave = _next_dirty(dirty, -1);
+
+    while (slave != -1) {
+        int nb = 0;
+        int length;
+        int i;
+
+        while (slave != -1 && nb < FB_SPARSE_MAX_ENTRIES) {
+            slaves[nb] = slave;
+            _unpack(fb->frame[slave], &colors[nb]);
+            nb++;
+            slave = _next_dirty(dirty, slave);
+        }
+
+        length = mendeleev_pack_color_table_sparse(table, sizeof(table), slaves, colors, nb);
+        if (length == -1 || mendeleev_set_color_table(fb->ctx, table, length) == -1)
+            return -1;
+        nb_sent++;
+
+        for (i = 0; i < nb; i++)
+            fb->acked[slaves[i]] = fb->frame[slaves[i]];
+    }
+
+    return nb_sent;
+}
+
+/* Broadcasts SET_COLOR with value, every node takes it */
+static int _commit_broadcast(mendeleev_framebuffer_t *fb, uint32_t value)
+{
+    mendeleev_t *ctx = fb->ctx;
+    uint8_t data[MENDELEEV_COLOR_LENGTH];
+    int saved_slave = ctx->slave;
+    int rc;
+    int i;
+
+    data[0] = (value >> 16) & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = value & 0xFF;
+
+    ctx->slave = MENDELEEV_BROADCAST_ADDRESS;
+    rc = mendeleev_send_command(ctx, MENDELEEV_CMD_SET_COLOR, data, sizeof(data), NULL, NULL);
+    ctx->slave = saved_slave;
+    if (rc == -1)
+        return -1;
+
+    for (i = 1; i < MENDELEEV_GROUP_ADDRESS_BASE; i++)
+        fb->acked[i] = value;
+
+    return 1;
+}
+
+mendeleev_framebuffer_t* mendeleev_framebuffer_new(mendeleev_t *ctx, int flags)
+{
+    mendeleev_framebuffer_t *fb;
+
+    if (ctx == NULL || (flags & ~MENDELEEV_FRAMEBUFFER_BROADCAST)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fb = (mendeleev_framebuffer_t *)calloc(1, sizeof(mendeleev_framebuffer_t));
+    if (fb == NULL)
+        return NULL;
+
+    fb->ctx = ctx;
+    fb->flags = flags;
+    fb->unicast_max = MENDELEEV_FRAMEBUFFER_UNICAST_MAX;
+
+    return fb;
+}
+
+void mendeleev_framebuffer_free(mendeleev_framebuffer_t *fb)
+{
+    free(fb);
+}
+
+/* Sets the number of changed nodes up to which a commit in broadcast mode
+   uses unicast commands, which are confirmed */
+int mendeleev_framebuffer_set_unicast_max(mendeleev_framebuffer_t *fb, int unicast_max)
+{
+    if (fb == NULL || unicast_max < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fb->unicast_max = unicast_max;
+    return 0;
+}
+
+int mendeleev_framebuffer_set_color(mendeleev_framebuffer_t *fb, int slave,
+                                    const mendeleev_color_t *color)
+{
+    if (fb == NULL || color == NULL || !_is_unicast_address(slave)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fb->frame[slave] = _pack(color);
+    return 0;
+}
+
+/* Gets the colour of slave in the frame, fails with ENOENT when the slave
+   isn't part of it */
+int mendeleev_framebuffer_get_color(mendeleev_framebuffer_t *fb, int slave,
+                                    mendeleev_color_t *color)
+{
+    if (fb == NULL || color == NULL || !_is_unicast_address(slave)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(fb->frame[slave] & FB_VALID)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    _unpack(fb->frame[slave], color);
+    return 0;
+}
+
+/* Writes the colours of nb consecutive slaves, starting at first_slave */
+int mendeleev_framebuffer_set_frame(mendeleev_framebuffer_t *fb, int first_slave,
+                                    const mendeleev_color_t *colors, int nb)
+{
+    int i;
+
+    if (fb == NULL || colors == NULL || nb < 1 || !_is_unicast_address(first_slave) ||
+        !_is_unicast_address(first_slave + nb - 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < nb; i++)
+        fb->frame[first_slave + i] = _pack(&colors[i]);
+
+    return 0;
+}
+
+/* Removes slave from the frame, its colour isn't sent anymore. The broadcast
+   address removes all the slaves. */
+int mendeleev_framebuffer_remove(mendeleev_framebuffer_t *fb, int slave)
+{
+    if (fb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (slave == MENDELEEV_BROADCAST_ADDRESS) {
+        memset(fb->frame, 0, sizeof(fb->frame));
+    } else if (_is_unicast_address(slave)) {
+        fb->frame[slave] = 0;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Gets the last colour acknowledged by slave, fails with ENOENT when it isn't
+   known */
+int mendeleev_framebuffer_get_acked(mendeleev_framebuffer_t *fb, int slave,
+                                    mendeleev_color_t *color)
+{
+    if (fb == NULL || color == NULL || !_is_unicast_address(slave)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(fb->acked[slave] & FB_VALID)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    _unpack(fb->acked[slave], color);
+    return 0;
+}
+
+/* Forgets the colour acknowledged by slave (all slaves with the broadcast
+   address), for example after a reboot, so that it's sent by the next
+   commit */
+int mendeleev_framebuffer_invalidate(mendeleev_framebuffer_t *fb, int slave)
+{
+    if (fb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (slave == MENDELEEV_BROADCAST_ADDRESS) {
+        memset(fb->acked, 0, sizeof(fb->acked));
+    } else if (_is_unicast_address(slave)) {
+        fb->acked[slave] = 0;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns the number of slaves whose colour differs from the acknowledged
+   one */
+int mendeleev_framebuffer_get_dirty(mendeleev_framebuffer_t *fb)
+{
+    uint64_t dirty[FB_BITMAP_WORDS];
+
+    if (fb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _diff(fb, dirty);
+}
+
+static void _plan(const mendeleev_framebuffer_t *fb, int nb_dirty, fb_plan_t *plan)
+{
+    plan->broadcast = FALSE;
+    plan->majority = 0;
+    plan->nb_rest = nb_dirty;
+    plan->tables = FALSE;
+    plan->length = 0;
+
+    if ((fb->flags & MENDELEEV_FRAMEBUFFER_BROADCAST) && nb_dirty > fb->unicast_max) {
+        uint32_t majority = _majority(fb);
+        int nb_after = 0;
+        int i;
+
+        /* Slaves to send after a broadcast of the majority colour, the ones
+           which are right now but not in the majority colour become dirty */
+        for (i = 1; i < MENDELEEV_GROUP_ADDRESS_BASE; i++) {
+            if ((fb->frame[i] & FB_VALID) && fb->frame[i] != majority)
+                nb_after++;
+        }
+
+        if (FB_SET_COLOR_COST + _sparse_cost(nb_after) < _sparse_cost(nb_dirty)) {
+            plan->broadcast = TRUE;
+            plan->majority = majority;
+            plan->nb_rest = nb_after;
+            plan->length += FB_SET_COLOR_COST;
+        }
+        plan->tables = plan->nb_rest > fb->unicast_max;
+    }
+
+    if (plan->tables)
+        plan->length += _sparse_cost(plan->nb_rest);
+    else
+        plan->length += plan->nb_rest * FB_UNICAST_COST;
+}
+
+/* Returns the estimated time in microseconds the next commit keeps the line
+   busy, the turnaround of the nodes excluded */
+int64_t mendeleev_framebuffer_get_wire_time(mendeleev_framebuffer_t *fb)
+{
+    uint64_t dirty[FB_BITMAP_WORDS];
+    fb_plan_t plan;
+
+    if (fb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _plan(fb, _diff(fb, dirty), &plan);
+    return mendeleev_get_wire_time(fb->ctx, plan.length);
+}
+
+/* Sends the colours of the frame which differ from the acknowledged ones.
+
+   Unicast commands are used for up to unicast_max changed slaves, or always
+   without MENDELEEV_FRAMEBUFFER_BROADCAST. Otherwise the most common colour is
+   broadcast first when it costs fewer bytes than listing its slaves, and the
+   remaining slaves are sent in sparse colour tables.
+
+   Returns the number of frames sent or -1 if a command failed, the slaves not
+   acknowledged are sent again by the next commit. */
+int mendeleev_framebuffer_commit(mendeleev_framebuffer_t *fb)
+{
+    uint64_t dirty[FB_BITMAP_WORDS];
+    fb_plan_t plan;
+    int nb_dirty;
+    int nb_sent = 0;
+    int rc;
+
+    if (fb == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The responses would be mixed with the ones of the application */
+    if (fb->ctx->nb_inflight > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    nb_dirty = _diff(fb, dirty);
+    if (nb_dirty == 0)
+        return 0;
+
+    _plan(fb, nb_dirty, &plan);
+
+    if (plan.broadcast) {
+        rc = _commit_broadcast(fb, plan.majority);
+        if (rc == -1)
+            return -1;
+        nb_sent += rc;
+        if (_diff(fb, dirty) == 0)
+            return nb_sent;
+    }
+
+    if (plan.tables)
+        rc = _commit_tables(fb, dirty);
+    else
+        rc = _commit_unicast(fb, dirty);
+    if (rc == -1)
+        return -1;
+
+    return nb_sent + rc;
+}
@@ -0,0 +1,57 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_FRAMEBUFFER_H
+#define MENDELEEV_FRAMEBUFFER_H
+
+#include "mendeleev.h"
+#include "mendeleev-color.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* A framebuffer holds the colour the application wants for each slave address
+ * and the last colour acknowledged by each node. Committing a frame only sends
+ * the colours which differ from the acknowledged ones.
+ *
+ * By default the colours are sent by unicast MENDELEEV_CMD_SET_COLOR and a
+ * colour is acknowledged by the response of the node. With
+ * MENDELEEV_FRAMEBUFFER_BROADCAST, larger changes are sent by a broadcast of
+ * the most common colour and by colour tables. Nodes never answer them, so
+ * the colours are then acknowledged as soon as they are sent. */
+
+/* One entry per address, only the unicast addresses are used */
+#define MENDELEEV_FRAMEBUFFER_SIZE  256
+
+#define MENDELEEV_FRAMEBUFFER_BROADCAST   (1 << 0)
+
+/* Default number of changed nodes up to which unicast commands are used in
+ * broadcast mode */
+#define MENDELEEV_FRAMEBUFFER_UNICAST_MAX 8
+
+typedef struct _mendeleev_framebuffer mendeleev_framebuffer_t;
+
+MENDELEEV_API mendeleev_framebuffer_t* mendeleev_framebuffer_new(mendeleev_t *ctx, int flags);
+MENDELEEV_API void mendeleev_framebuffer_free(mendeleev_framebuffer_t *fb);
+
+MENDELEEV_API int mendeleev_framebuffer_set_unicast_max(mendeleev_framebuffer_t *fb, int unicast_max);
+
+MENDELEEV_API int mendeleev_framebuffer_set_color(mendeleev_framebuffer_t *fb, int slave,
+                                                  const mendeleev_color_t *color);
+MENDELEEV_API int mendeleev_framebuffer_get_color(mendeleev_framebuffer_t *fb, int slave,
+                                                  mendeleev_color_t *color);
+MENDELEEV_API int mendeleev_framebuffer_set_frame(mendeleev_framebuffer_t *fb, int first_slave,
+                                                  const mendeleev_color_t *colors, int nb);
+MENDELEEV_API int mendeleev_framebuffer_remove(mendeleev_framebuffer_t *fb, int slave);
+
+MENDELEEV_API int mendeleev_framebuffer_get_acked(mendeleev_framebuffer_t *fb, int slave,
+                                                  mendeleev_color_t *color);
+MENDELEEV_API int mendeleev_framebuffer_invalidate(mendeleev_framebuffer_t *fb, int slave);
+
+MENDELEEV_API int mendeleev_framebuffer_get_dirty(mendeleev_framebuffer_t *fb);
+MENDELEEV_API int64_t mendeleev_framebuffer_get_wire_time(mendeleev_framebuffer_t *fb);
+MENDELEEV_API int mendeleev_framebuffer_commit(mendeleev_framebuffer_t *fb);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_FRAMEBUFFER_H */
@@ -0,0 +1,214 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-lz4.h"
+
+#define LZ4_MIN_MATCH      4
+/* The last 5 bytes are literals and the last match starts 12 bytes before
+   the end at the latest, as required by the format */
+#define LZ4_LAST_LITERALS  5
+#define LZ4_MFLIMIT        12
+#define LZ4_HASH_BITS      12
+#define LZ4_MAX_OFFSET     65535
+
+static uint32_t _read32(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static int _hash(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Writes a length of the token as extra bytes */
+static int _put_length(uint8_t *dest, int capacity, int *pos, int length)
+{
+    for (length -= 15; length >= 255; length -= 255) {
+        if (*pos >= capacity)
+            return -1;
+        dest[(*pos)++] = 255;
+    }
+    if (*pos >= capacity)
+        return -1;
+    dest[(*pos)++] = length;
+
+    return 0;
+}
+
+/* Writes a sequence: the literals, then a match unless match_length is 0 */
+static int _put_sequence(uint8_t *dest, int capacity, int *pos,
+                         const uint8_t *literals, int nb_literals,
+                         int offset, int match_length)
+{
+    int ml = match_length - LZ4_MIN_MATCH;
+
+    if (*pos >= capacity)
+        return -1;
+    dest[(*pos)++] = ((nb_literals < 15 ? nb_literals : 15) << 4) |
+        (match_length == 0 ? 0 : (ml < 15 ? ml : 15));
+
+    if (nb_literals >= 15 && _put_length(dest, capacity, pos, nb_literals) == -1)
+        return -1;
+    if (nb_literals > capacity - *pos)
+        return -1;
+    memcpy(dest + *pos, literals, nb_literals);
+    *pos += nb_literals;
+
+    if (match_length == 0)
+        return 0;
+
+    if (*pos + 2 > capacity)
+        return -1;
+    dest[(*pos)++] = offset & 0xFF;
+    dest[(*pos)++] = offset >> 8;
+    if (ml >= 15 && _put_length(dest, capacity, pos, ml) == -1)
+        return -1;
+
+    return 0;
+}
+
+/* Compresses src in dest as a LZ4 block. Returns the length of the block or
+   -1 with errno set to ENOSPC when it doesn't fit in dest_capacity bytes,
+   which can be given the length of src to only keep useful compressions. */
+int mendeleev_lz4_compress(const uint8_t *src, int src_length,
+                           uint8_t *dest, int dest_capacity)
+{
+    int32_t table[1 << LZ4_HASH_BITS];
+    int anchor = 0;
+    int ip = 0;
+    int pos = 0;
+
+    if (src == NULL || dest == NULL || src_length < 0 ||
+        src_length > MENDELEEV_LZ4_MAX_INPUT || dest_capacity < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(table, 0xFF, sizeof(table));
+
+    while (ip < src_length - LZ4_MFLIMIT) {
+        uint32_t sequence = _read32(src + ip);
+        int h = _hash(sequence);
+        int ref = table[h];
+        int length;
+
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || _read32(src + ref) != sequence) {
+            ip++;
+            continue;
+        }
+
+        /* Extends the match backward over the pending literals */
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+        }
+
+        length = LZ4_MIN_MATCH;
+        while (ip + length < src_length - LZ4_LAST_LITERALS &&
+               src[ref + length] == src[ip + length])
+            length++;
+
+        if (_put_sequence(dest, dest_capacity, &pos, src + anchor, ip - anchor,
+                          ip - ref, length) == -1)
+            goto nospace;
+
+        ip += length;
+        anchor = ip;
+        /* Gives the skipped bytes a chance for the next match */
+        if (ip < src_length - LZ4_MFLIMIT)
+            table[_hash(_read32(src + ip - 2))] = ip - 2;
+    }
+
+    if (_put_sequence(dest, dest_capacity, &pos, src + anchor, src_length - anchor, 0, 0) == -1)
+        goto nospace;
+
+    return pos;
+
+nospace:
+    errno = ENOSPC;
+    return -1;
+}
+
+/* Reads a length following the token */
+static int _get_length(const uint8_t *src, int src_length, int *pos, int *length)
+{
+    uint8_t byte;
+
+    do {
+        if (*pos >= src_length)
+            return -1;
+        byte = src[(*pos)++];
+        *length += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+/* Decompresses the LZ4 block src in dest. Returns the decompressed length or
+   -1 with errno set to EINVAL when the block is malformed or doesn't fit in
+   dest_capacity bytes. */
+int mendeleev_lz4_decompress(const uint8_t *src, int src_length,
+                             uint8_t *dest, int dest_capacity)
+{
+    int pos = 0;
+    int out = 0;
+
+    if (src == NULL || dest == NULL || src_length < 1)
+        goto error;
+
+    for (;;) {
+        uint8_t token = src[pos++];
+        int nb_literals = token >> 4;
+        int length = (token & 0x0F) + LZ4_MIN_MATCH;
+        int offset;
+
+        if (nb_literals == 15 && _get_length(src, src_length, &pos, &nb_literals) == -1)
+            goto error;
+        if (nb_literals > src_length - pos || nb_literals > dest_capacity - out)
+            goto error;
+        memcpy(dest + out, src + pos, nb_literals);
+        pos += nb_literals;
+        out += nb_literals;
+
+        /* The last sequence has no match */
+        if (pos == src_length)
+            break;
+
+        if (pos + 2 > src_length)
+            goto error;
+        offset = src[pos] | (src[pos + 1] << 8);
+        pos += 2;
+        if (offset == 0 || offset > out)
+            goto error;
+
+        if ((token & 0x0F) == 15 && _get_length(src, src_length, &pos, &length) == -1)
+            goto error;
+        if (length > dest_capacity - out)
+            goto error;
+
+        /* Byte by byte since the match can overlap the output */
+        while (length-- > 0) {
+            dest[out] = dest[out - offset];
+            out++;
+        }
+
+        if (pos >= src_length)
+            goto error;
+    }
+
+    return out;
+
+error:
+    errno = EINVAL;
+    return -1;
+}
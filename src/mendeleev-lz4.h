@@ -0,0 +1,26 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_LZ4_H
+#define MENDELEEV_LZ4_H
+
+#include <stddef.h>
+
+#include "mendeleev.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* LZ4 blocks (the raw block format, without frame header), which the
+ * reference decoder and the small decoders of microcontrollers read. Blocks
+ * are limited to 64 KiB so that the offsets of the matches always fit. */
+#define MENDELEEV_LZ4_MAX_INPUT  65535
+
+MENDELEEV_API int mendeleev_lz4_compress(const uint8_t *src, int src_length,
+                                         uint8_t *dest, int dest_capacity);
+MENDELEEV_API int mendeleev_lz4_decompress(const uint8_t *src, int src_length,
+                                           uint8_t *dest, int dest_capacity);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_LZ4_H */
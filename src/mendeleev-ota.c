@@ -0,0 +1,1258 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-ota.h"
+#include "mendeleev-delta.h"
+#include "mendeleev-lz4.h"
+
+/* States of a chunk during a transfer */
+#define OTA_CHUNK_PENDING   0
+#define OTA_CHUNK_INFLIGHT  1
+#define OTA_CHUNK_ACKED     2
+
+typedef struct _ota_transfer {
+    mendeleev_t *ctx;
+    const mendeleev_ota_options_t *options;
+    const uint8_t *image;
+    size_t size;
+    int chunk_size;
+    int nb_chunks;
+    uint8_t *state;
+    uint8_t *retries;
+    /* Chunks before are acknowledged, and the first pending one is after */
+    int nb_acked_prefix;
+    int lowest_pending;
+    int nb_acked;
+    /* Chunk of each request in flight */
+    struct {
+        uint16_t seqnr;
+        int chunk;
+    } inflight[MENDELEEV_MAX_INFLIGHT];
+    int nb_inflight;
+    uint16_t crc;
+    /* Image rebuilt by the node when the transfer is a delta */
+    int delta;
+    uint32_t target_size;
+    uint16_t target_crc;
+    uint16_t base_crc;
+    /* Retries of the other operations than DATA, only for a broadcast
+       transfer since an unicast one can be resumed */
+    int command_retries;
+    int64_t start;
+    mendeleev_ota_progress_t progress;
+} ota_transfer_t;
+
+/* A node of a broadcast transfer */
+typedef struct _ota_node {
+    int slave;
+    /* Nodes of the same group receive the same image */
+    int group;
+    char version[MENDELEEV_MAX_DATA_LENGTH + 1];
+    /* 0, or the errno of its failure */
+    int error;
+    int done;
+    int nb_missing;
+    /* Bit set for each missing chunk */
+    uint8_t *missing;
+} ota_node_t;
+
+static void _put_be32(uint8_t *dest, uint32_t value)
+{
+    dest[0] = value >> 24;
+    dest[1] = value >> 16;
+    dest[2] = value >> 8;
+    dest[3] = value;
+}
+
+static uint32_t _get_be32(const uint8_t *src)
+{
+    return ((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+}
+
+void mendeleev_ota_options_init(mendeleev_ota_options_t *options)
+{
+    memset(options, 0, sizeof(mendeleev_ota_options_t));
+    options->chunk_size = MENDELEEV_OTA_MAX_CHUNK;
+    options->window = MENDELEEV_OTA_WINDOW;
+    options->max_retries = MENDELEEV_OTA_MAX_RETRIES;
+    options->resume = TRUE;
+    options->max_rounds = MENDELEEV_OTA_MAX_ROUNDS;
+    options->rebroadcast_min = MENDELEEV_OTA_REBROADCAST_MIN;
+}
+
+/* Sends a command to the current slave, again up to max_retries times when
+   the response is lost or corrupted */
+static int _command(mendeleev_t *ctx, int max_retries, uint8_t command,
+                    uint8_t *req, int req_length, uint8_t *rsp, uint16_t *rsp_length)
+{
+    int rc;
+
+    do {
+        rc = mendeleev_send_command(ctx, command, req, req_length, rsp, rsp_length);
+    } while (rc == -1 && (errno == ETIMEDOUT || errno == EMBBADCRC) && max_retries-- > 0);
+
+    return rc;
+}
+
+/* Sends an OTA operation to the current slave and checks that the response is
+   for the same operation with at least rsp_min bytes of data */
+static int _ota_command(mendeleev_t *ctx, int max_retries, uint8_t *req, int req_length,
+                        uint8_t *rsp, int rsp_min)
+{
+    uint16_t rsp_length;
+    int rc;
+
+    rc = _command(ctx, max_retries, MENDELEEV_CMD_OTA, req, req_length, rsp, &rsp_length);
+    if (rc == -1)
+        return -1;
+
+    if (rsp_length < 1 + rsp_min || rsp[0] != req[0]) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return rsp_length;
+}
+
+static void _report(ota_transfer_t *t)
+{
+    mendeleev_ota_progress_t *p = &t->progress;
+
+    p->offset = (size_t)t->nb_acked_prefix * t->chunk_size;
+    if (p->offset > t->size)
+        p->offset = t->size;
+    p->elapsed = _time_us() - t->start;
+    if (p->elapsed > 0)
+        p->throughput = (p->offset - p->resumed_offset) * 1000000.0 / p->elapsed;
+
+    if (t->options->progress != NULL)
+        t->options->progress(t->ctx, p, t->options->user_data);
+}
+
+static void _ack(ota_transfer_t *t, int chunk)
+{
+    int prefix = t->nb_acked_prefix;
+
+    t->state[chunk] = OTA_CHUNK_ACKED;
+    t->nb_acked++;
+
+    while (t->nb_acked_prefix < t->nb_chunks &&
+           t->state[t->nb_acked_prefix] == OTA_CHUNK_ACKED)
+        t->nb_acked_prefix++;
+
+    if (t->nb_acked_prefix != prefix)
+        _report(t);
+}
+
+static int _next_pending(ota_transfer_t *t)
+{
+    while (t->lowest_pending < t->nb_chunks &&
+           t->state[t->lowest_pending] != OTA_CHUNK_PENDING)
+        t->lowest_pending++;
+
+    return t->lowest_pending < t->nb_chunks ? t->lowest_pending : -1;
+}
+
+/* Builds the DATA operation of chunk, returns its length. The chunk is
+   compressed when asked and shorter for it. */
+static int _build_chunk(ota_transfer_t *t, int chunk, uint8_t *req)
+{
+    size_t offset = (size_t)chunk * t->chunk_size;
+    int length = t->chunk_size;
+    int compressed;
+
+    if (offset + length > t->size)
+        length = t->size - offset;
+
+    _put_be32(req + 1, offset);
+    if (t->options->compress) {
+        compressed = mendeleev_lz4_compress(t->image + offset, length,
+                                            req + MENDELEEV_OTA_DATA_HEADER, length - 1);
+        if (compressed != -1) {
+            req[0] = MENDELEEV_OTA_DATA_LZ4;
+            return MENDELEEV_OTA_DATA_HEADER + compressed;
+        }
+    }
+
+    req[0] = MENDELEEV_OTA_DATA;
+    memcpy(req + MENDELEEV_OTA_DATA_HEADER, t->image + offset, length);
+
+    return MENDELEEV_OTA_DATA_HEADER + length;
+}
+
+static int _send_chunk(ota_transfer_t *t, int chunk)
+{
+    uint8_t req[MENDELEEV_OTA_DATA_HEADER + MENDELEEV_OTA_MAX_CHUNK];
+    int length = _build_chunk(t, chunk, req);
+    int seqnr;
+
+    seqnr = mendeleev_send_request(t->ctx, MENDELEEV_CMD_OTA, req, length);
+    if (seqnr == -1)
+        return -1;
+
+    t->state[chunk] = OTA_CHUNK_INFLIGHT;
+    t->inflight[t->nb_inflight].seqnr = seqnr;
+    t->inflight[t->nb_inflight].chunk = chunk;
+    t->nb_inflight++;
+    t->progress.bytes_sent += length - MENDELEEV_OTA_DATA_HEADER;
+
+    return 0;
+}
+
+/* Collects one response. A chunk which failed goes back to the pending ones
+   until it runs out of retries. */
+static int _receive_chunk(ota_transfer_t *t)
+{
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    uint16_t rsp_length = 0;
+    uint16_t seqnr;
+    int slave;
+    int chunk;
+    int i;
+    int rc;
+
+    rc = mendeleev_receive_response(t->ctx, &slave, &seqnr, rsp, &rsp_length);
+    if (rc == -1 && slave == -1) {
+        /* No request answered, a corrupted frame is left to the timeout of
+           its request */
+        return errno == EMBBADCRC ? 0 : -1;
+    }
+
+    for (i = 0; i < t->nb_inflight; i++) {
+        if (t->inflight[i].seqnr == seqnr)
+            break;
+    }
+    if (i == t->nb_inflight)
+        return 0;
+    chunk = t->inflight[i].chunk;
+    t->inflight[i] = t->inflight[--t->nb_inflight];
+
+    if (rc != -1 && rsp_length >= MENDELEEV_OTA_DATA_HEADER &&
+        (rsp[0] == MENDELEEV_OTA_DATA || rsp[0] == MENDELEEV_OTA_DATA_LZ4) &&
+        _get_be32(rsp + 1) == (uint32_t)chunk * t->chunk_size) {
+        _ack(t, chunk);
+        return 0;
+    }
+
+    if (rc != -1)
+        errno = EMBBADDATA;
+    if (t->retries[chunk]++ >= t->options->max_retries)
+        return -1;
+
+    t->state[chunk] = OTA_CHUNK_PENDING;
+    if (chunk < t->lowest_pending)
+        t->lowest_pending = chunk;
+    t->progress.retransmissions++;
+
+    return 0;
+}
+
+/* Sends the pending chunks to the current slave with up to window chunks in
+   flight, until they are all acknowledged */
+static int _send_chunks(ota_transfer_t *t)
+{
+    int window = t->options->window;
+    int chunk;
+
+    if (mendeleev_set_max_inflight(t->ctx, window) == -1)
+        return -1;
+
+    while (t->nb_acked < t->nb_chunks) {
+        if (t->nb_inflight < window && (chunk = _next_pending(t)) != -1) {
+            if (_send_chunk(t, chunk) == -1)
+                return -1;
+            continue;
+        }
+
+        if (_receive_chunk(t) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Builds the BEGIN operation, returns its length */
+static int _build_begin(ota_transfer_t *t, uint8_t *req)
+{
+    req[0] = MENDELEEV_OTA_BEGIN;
+    req[1] = t->options->resume ? MENDELEEV_OTA_FLAG_RESUME : 0;
+    _put_be32(req + 2, t->size);
+    req[6] = t->chunk_size >> 8;
+    req[7] = t->chunk_size & 0xFF;
+    req[8] = t->crc >> 8;
+    req[9] = t->crc & 0xFF;
+    if (!t->delta)
+        return MENDELEEV_OTA_BEGIN_LENGTH;
+
+    req[1] |= MENDELEEV_OTA_FLAG_DELTA;
+    _put_be32(req + 10, t->target_size);
+    req[14] = t->target_crc >> 8;
+    req[15] = t->target_crc & 0xFF;
+    req[16] = t->base_crc >> 8;
+    req[17] = t->base_crc & 0xFF;
+
+    return MENDELEEV_OTA_BEGIN_DELTA_LENGTH;
+}
+
+/* Sends BEGIN to the current slave, returns the offset it acknowledges */
+static int64_t _begin(ota_transfer_t *t)
+{
+    uint8_t req[MENDELEEV_OTA_BEGIN_DELTA_LENGTH];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    uint32_t offset;
+    int length = _build_begin(t, req);
+
+    if (_ota_command(t->ctx, t->command_retries, req, length, rsp, 4) == -1)
+        return -1;
+
+    offset = _get_be32(rsp + 1);
+    return offset > t->size ? 0 : offset;
+}
+
+/* Sends END to the current slave, fails with EMBOTAFAIL when the image is
+   rejected */
+static int _end(ota_transfer_t *t)
+{
+    uint8_t req[1];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    req[0] = MENDELEEV_OTA_END;
+    if (_ota_command(t->ctx, t->command_retries, req, 1, rsp, 1) == -1)
+        return -1;
+    if (rsp[1] != MENDELEEV_OTA_STATUS_OK) {
+        errno = EMBOTAFAIL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Restarts from the offset acknowledged by the slave, a whole number of
+   chunks */
+static void _resume_at(ota_transfer_t *t, size_t offset)
+{
+    int i = offset / t->chunk_size;
+
+    if (offset == t->size)
+        i = t->nb_chunks;
+    memset(t->state, OTA_CHUNK_ACKED, i);
+    t->nb_acked = i;
+    t->nb_acked_prefix = i;
+    t->lowest_pending = i;
+    t->progress.resumed_offset = (size_t)i * t->chunk_size;
+    if (t->progress.resumed_offset > t->size)
+        t->progress.resumed_offset = t->size;
+}
+
+static int _transfer_init(ota_transfer_t *t, mendeleev_t *ctx,
+                          const mendeleev_ota_options_t *options,
+                          const uint8_t *image, size_t size)
+{
+    memset(t, 0, sizeof(ota_transfer_t));
+    t->ctx = ctx;
+    t->options = options;
+    t->image = image;
+    t->size = size;
+    t->chunk_size = options->chunk_size;
+    t->nb_chunks = (size + t->chunk_size - 1) / t->chunk_size;
+    t->state = calloc(t->nb_chunks, 1);
+    t->retries = calloc(t->nb_chunks, 1);
+    if (t->state == NULL || t->retries == NULL) {
+        free(t->state);
+        free(t->retries);
+        errno = ENOMEM;
+        return -1;
+    }
+    t->crc = mendeleev_crc16_update(MENDELEEV_CRC16_INIT, image, size);
+    t->start = _time_us();
+    t->progress.size = size;
+
+    return 0;
+}
+
+/* Makes t the transfer of a delta from base to target */
+static void _set_delta(ota_transfer_t *t, const uint8_t *base, size_t base_size,
+                       const uint8_t *target, size_t target_size)
+{
+    t->delta = TRUE;
+    t->target_size = target_size;
+    t->target_crc = mendeleev_crc16_update(MENDELEEV_CRC16_INIT, target, target_size);
+    t->base_crc = mendeleev_crc16_update(MENDELEEV_CRC16_INIT, base, base_size);
+}
+
+static void _transfer_free(ota_transfer_t *t)
+{
+    free(t->state);
+    free(t->retries);
+}
+
+static int _check_options(mendeleev_t *ctx, const uint8_t *image, size_t size,
+                          const mendeleev_ota_options_t *options)
+{
+    if (ctx == NULL || image == NULL || size == 0 || size > UINT32_MAX ||
+        options->chunk_size < 1 || options->chunk_size > MENDELEEV_OTA_MAX_CHUNK ||
+        options->window < 1 || options->window > MENDELEEV_MAX_INFLIGHT ||
+        options->max_retries < 0 || options->max_retries > UINT8_MAX ||
+        options->max_rounds < 1 ||
+        options->rebroadcast_min < 1 || options->broadcast_gap < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->nb_inflight > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Sends the image of t to slave, from the offset it acknowledges */
+static int _unicast(ota_transfer_t *t, int slave)
+{
+    mendeleev_t *ctx = t->ctx;
+    int saved_slave = ctx->slave;
+    int saved_max_inflight = ctx->max_inflight;
+    int saved_errno;
+    int64_t offset;
+    int rc = -1;
+
+    t->progress.slave = slave;
+    ctx->slave = slave;
+
+    offset = _begin(t);
+    if (offset != -1) {
+        _resume_at(t, offset);
+        _report(t);
+        if (_send_chunks(t) == 0)
+            rc = _end(t);
+    }
+
+    saved_errno = errno;
+    /* Late responses are dropped by the next receive */
+    _inflight_clear(ctx);
+    ctx->max_inflight = saved_max_inflight;
+    ctx->slave = saved_slave;
+    errno = saved_errno;
+
+    return rc;
+}
+
+/* Sends a firmware image to slave in chunks, several of them in flight.
+
+   Only the chunks which were not acknowledged are sent again, and a transfer
+   interrupted by an error resumes from the offset acknowledged by the slave
+   when options->resume is set. options can be NULL for the defaults.
+
+   Returns 0 once the slave has accepted the image or -1 with errno set, to
+   EMBOTAFAIL when the image is rejected. */
+int mendeleev_ota_update_buffer(mendeleev_t *ctx, int slave,
+                                const uint8_t *image, size_t size,
+                                const mendeleev_ota_options_t *options)
+{
+    mendeleev_ota_options_t defaults;
+    ota_transfer_t t;
+    int rc;
+
+    if (options == NULL) {
+        mendeleev_ota_options_init(&defaults);
+        options = &defaults;
+    }
+
+    if (_check_options(ctx, image, size, options) == -1)
+        return -1;
+    if (slave < 1 || MENDELEEV_IS_MULTICAST_ADDRESS(slave)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (_transfer_init(&t, ctx, options, image, size) == -1)
+        return -1;
+    rc = _unicast(&t, slave);
+    _transfer_free(&t);
+
+    return rc;
+}
+
+/* Maps the file at path in memory */
+static const uint8_t *_map_image(const char *path, size_t *size)
+{
+    struct stat st;
+    void *image;
+    int saved_errno;
+    int fd;
+
+    if (path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    saved_errno = errno;
+    close(fd);
+    if (image == MAP_FAILED) {
+        errno = saved_errno;
+        return NULL;
+    }
+    /* Read once from start to end */
+    madvise(image, st.st_size, MADV_SEQUENTIAL);
+
+    *size = st.st_size;
+    return image;
+}
+
+static void _unmap_image(const uint8_t *image, size_t size)
+{
+    int saved_errno = errno;
+
+    munmap((void *)image, size);
+    errno = saved_errno;
+}
+
+/* Same as mendeleev_ota_update_buffer() with the image of the file at path,
+   mapped in memory */
+int mendeleev_ota_update(mendeleev_t *ctx, int slave, const char *path,
+                         const mendeleev_ota_options_t *options)
+{
+    const uint8_t *image;
+    size_t size;
+    int rc;
+
+    image = _map_image(path, &size);
+    if (image == NULL)
+        return -1;
+
+    rc = mendeleev_ota_update_buffer(ctx, slave, image, size, options);
+    _unmap_image(image, size);
+
+    return rc;
+}
+
+/* Sends an OTA operation to all the nodes, the ones outside the transfer
+   included, no response is expected */
+static int _broadcast(mendeleev_t *ctx, uint8_t *req, int req_length)
+{
+    int saved_slave = ctx->slave;
+    int rc;
+
+    ctx->slave = MENDELEEV_BROADCAST_ADDRESS;
+    rc = mendeleev_send_command(ctx, MENDELEEV_CMD_OTA, req, req_length, NULL, NULL);
+    ctx->slave = saved_slave;
+
+    return rc;
+}
+
+/* Makes the nodes still receiving a broadcast image drop it, the nodes
+   outside the transfer and the failed ones */
+static void _broadcast_abort(mendeleev_t *ctx)
+{
+    uint8_t req[1] = { MENDELEEV_OTA_ABORT };
+
+    _inflight_clear(ctx);
+    _broadcast(ctx, req, sizeof(req));
+}
+
+static int _broadcast_chunk(ota_transfer_t *t, int chunk)
+{
+    uint8_t req[MENDELEEV_OTA_DATA_HEADER + MENDELEEV_OTA_MAX_CHUNK];
+    int length = _build_chunk(t, chunk, req);
+
+    if (t->options->broadcast_gap > 0)
+        usleep(t->options->broadcast_gap);
+
+    if (_broadcast(t->ctx, req, length) == -1)
+        return -1;
+    t->progress.bytes_sent += length - MENDELEEV_OTA_DATA_HEADER;
+
+    return 0;
+}
+
+/* Tells whether node is still to be updated with the image of group */
+static int _in_group(const ota_node_t *node, int group)
+{
+    return node->group == group && node->error == 0 && !node->done;
+}
+
+/* Asks the current slave for the bitmap of its missing chunks. A node which
+   didn't take the broadcast BEGIN is sent it again. */
+static int _poll_missing(ota_transfer_t *t, ota_node_t *node)
+{
+    uint8_t req[5];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int first = 0;
+    int retried = FALSE;
+
+    memset(node->missing, 0, (t->nb_chunks + 7) / 8);
+    node->nb_missing = 0;
+
+    while (first < t->nb_chunks) {
+        int rc;
+        int nb;
+        int i;
+
+        req[0] = MENDELEEV_OTA_MISSING;
+        _put_be32(req + 1, first);
+        rc = _ota_command(t->ctx, t->command_retries, req, sizeof(req), rsp,
+                          MENDELEEV_OTA_MISSING_HEADER - 1);
+        if (rc == -1) {
+            if (errno != EMBXNACK || retried)
+                return -1;
+            /* Not receiving this image */
+            retried = TRUE;
+            if (_begin(t) == -1)
+                return -1;
+            continue;
+        }
+
+        nb = (rsp[5] << 8) | rsp[6];
+        if (_get_be32(rsp + 1) != (uint32_t)first || nb == 0 || first + nb > t->nb_chunks ||
+            rc < MENDELEEV_OTA_MISSING_HEADER + (nb + 7) / 8) {
+            errno = EMBBADDATA;
+            return -1;
+        }
+
+        for (i = 0; i < nb; i++) {
+            if (rsp[MENDELEEV_OTA_MISSING_HEADER + i / 8] & (1 << (i % 8))) {
+                node->missing[(first + i) / 8] |= 1 << ((first + i) % 8);
+                node->nb_missing++;
+            }
+        }
+        first += nb;
+    }
+
+    return 0;
+}
+
+/* Polls the nodes for their missing chunks and repairs them: a chunk missed
+   by at least rebroadcast_min nodes is broadcast again, the other ones are
+   sent by unicast. Returns the number of nodes still missing chunks. */
+static int _repair_round(ota_transfer_t *t, ota_node_t *nodes, int nb_nodes,
+                         int group, uint16_t *nb_missing)
+{
+    mendeleev_t *ctx = t->ctx;
+    int nb_incomplete = 0;
+    int chunk;
+    int i;
+
+    memset(nb_missing, 0, t->nb_chunks * sizeof(uint16_t));
+
+    for (i = 0; i < nb_nodes; i++) {
+        ota_node_t *node = &nodes[i];
+
+        if (!_in_group(node, group))
+            continue;
+
+        ctx->slave = node->slave;
+        if (_poll_missing(t, node) == -1) {
+            node->error = errno;
+            continue;
+        }
+        if (node->nb_missing == 0)
+            continue;
+
+        nb_incomplete++;
+        for (chunk = 0; chunk < t->nb_chunks; chunk++) {
+            if (node->missing[chunk / 8] & (1 << (chunk % 8)))
+                nb_missing[chunk]++;
+        }
+    }
+
+    if (nb_incomplete == 0)
+        return 0;
+
+    for (chunk = 0; chunk < t->nb_chunks; chunk++) {
+        if (nb_missing[chunk] >= t->options->rebroadcast_min) {
+            if (_broadcast_chunk(t, chunk) == -1)
+                return -1;
+            t->progress.retransmissions++;
+        }
+    }
+
+    for (i = 0; i < nb_nodes; i++) {
+        ota_node_t *node = &nodes[i];
+        int nb_unicast = 0;
+
+        if (!_in_group(node, group) || node->nb_missing == 0)
+            continue;
+
+        /* The rebroadcast chunks are checked by the next poll */
+        memset(t->state, OTA_CHUNK_ACKED, t->nb_chunks);
+        memset(t->retries, 0, t->nb_chunks);
+        for (chunk = 0; chunk < t->nb_chunks; chunk++) {
+            if ((node->missing[chunk / 8] & (1 << (chunk % 8))) &&
+                nb_missing[chunk] < t->options->rebroadcast_min) {
+                t->state[chunk] = OTA_CHUNK_PENDING;
+                nb_unicast++;
+            }
+        }
+        if (nb_unicast == 0)
+            continue;
+
+        t->nb_acked = t->nb_chunks - nb_unicast;
+        t->nb_acked_prefix = 0;
+        t->lowest_pending = 0;
+        t->progress.slave = node->slave;
+        ctx->slave = node->slave;
+        if (_send_chunks(t) == -1) {
+            node->error = errno;
+            _inflight_clear(ctx);
+        }
+        t->progress.retransmissions += nb_unicast;
+    }
+
+    return nb_incomplete;
+}
+
+/* Asks the nodes for their version. The ones already running
+   options->version are done and the ones not answering fail. Returns the
+   number of the other ones. */
+static int _discover(mendeleev_t *ctx, ota_node_t *nodes, int nb_nodes,
+                     const mendeleev_ota_options_t *options)
+{
+    int nb_active = 0;
+    int i;
+
+    for (i = 0; i < nb_nodes; i++) {
+        ota_node_t *node = &nodes[i];
+        uint16_t length;
+
+        ctx->slave = node->slave;
+        if (_command(ctx, options->max_retries, MENDELEEV_CMD_GET_VERSION, NULL, 0,
+                     (uint8_t *)node->version, &length) == -1) {
+            node->error = errno;
+            continue;
+        }
+        node->version[length] = '\0';
+
+        if (options->version != NULL && strcmp(node->version, options->version) == 0)
+            node->done = TRUE;
+        else
+            nb_active++;
+    }
+
+    return nb_active;
+}
+
+/* Sends the image of t to the nodes of group: the chunks are broadcast once,
+   then the nodes are polled for the chunks they missed, which are repaired by
+   unicast or broadcast again when enough nodes miss them. The nodes which got
+   the whole image are sent END. Returns -1 if a broadcast failed. */
+static int _broadcast_group(ota_transfer_t *t, ota_node_t *nodes, int nb_nodes, int group)
+{
+    mendeleev_t *ctx = t->ctx;
+    const mendeleev_ota_options_t *options = t->options;
+    uint8_t req[MENDELEEV_OTA_BEGIN_DELTA_LENGTH];
+    uint16_t *nb_missing = NULL;
+    int nb_active = 0;
+    int round;
+    int chunk;
+    int i;
+    int rc;
+
+    for (i = 0; i < nb_nodes; i++) {
+        if (!_in_group(&nodes[i], group))
+            continue;
+        nodes[i].missing = calloc((t->nb_chunks + 7) / 8, 1);
+        if (nodes[i].missing == NULL)
+            nodes[i].error = ENOMEM;
+        else
+            nb_active++;
+    }
+
+    if (nb_active == 0) {
+        rc = 0;
+        goto out;
+    }
+
+    nb_missing = calloc(t->nb_chunks, sizeof(uint16_t));
+    if (nb_missing == NULL) {
+        errno = ENOMEM;
+        rc = -1;
+        goto out;
+    }
+
+    rc = _broadcast(ctx, req, _build_begin(t, req));
+    t->progress.slave = MENDELEEV_BROADCAST_ADDRESS;
+    for (chunk = 0; rc != -1 && chunk < t->nb_chunks; chunk++) {
+        rc = _broadcast_chunk(t, chunk);
+        if (rc != -1) {
+            t->nb_acked_prefix = chunk + 1;
+            _report(t);
+        }
+    }
+
+    for (round = 0; rc != -1 && round < options->max_rounds; round++) {
+        rc = _repair_round(t, nodes, nb_nodes, group, nb_missing);
+        if (rc <= 0)
+            break;
+    }
+    if (rc == -1)
+        goto out;
+
+    for (i = 0; i < nb_nodes; i++) {
+        ota_node_t *node = &nodes[i];
+
+        if (!_in_group(node, group))
+            continue;
+
+        ctx->slave = node->slave;
+        /* Still incomplete after the last round */
+        if (round == options->max_rounds && _poll_missing(t, node) == 0 &&
+            node->nb_missing > 0) {
+            node->error = ETIMEDOUT;
+            continue;
+        }
+        if (_end(t) == -1) {
+            node->error = errno;
+            continue;
+        }
+        node->done = TRUE;
+
+        t->progress.slave = node->slave;
+        t->nb_acked_prefix = t->nb_chunks;
+        _report(t);
+    }
+    rc = 0;
+
+out:
+    for (i = 0; i < nb_nodes; i++) {
+        free(nodes[i].missing);
+        nodes[i].missing = NULL;
+    }
+    free(nb_missing);
+
+    return rc;
+}
+
+static int _check_slaves(const uint8_t *slaves, int nb_slaves)
+{
+    int i;
+
+    if (slaves == NULL || nb_slaves < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < nb_slaves; i++) {
+        if (slaves[i] < 1 || MENDELEEV_IS_MULTICAST_ADDRESS(slaves[i])) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static ota_node_t *_nodes_new(const uint8_t *slaves, int nb_slaves)
+{
+    ota_node_t *nodes = calloc(nb_slaves, sizeof(ota_node_t));
+    int i;
+
+    if (nodes == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < nb_slaves; i++)
+        nodes[i].slave = slaves[i];
+
+    return nodes;
+}
+
+/* Frees the nodes and stores their results, errno of the nodes left undone.
+   Returns the number of updated nodes. */
+static int _nodes_free(ota_node_t *nodes, int nb_nodes, int *results, int error)
+{
+    int nb_updated = 0;
+    int i;
+
+    for (i = 0; i < nb_nodes; i++) {
+        if (nodes[i].done)
+            nb_updated++;
+        if (results != NULL)
+            results[i] = nodes[i].done ? 0 : (nodes[i].error ? nodes[i].error : error);
+    }
+    free(nodes);
+
+    return nb_updated;
+}
+
+/* Sends a firmware image to many nodes at once: the chunks are broadcast once,
+   then each node is polled for the chunks it missed, which are repaired by
+   unicast or broadcast again when enough nodes miss them. The nodes are first
+   asked for their version, the ones already running options->version (when
+   not NULL) are skipped and the ones not answering fail.
+
+   BEGIN and the chunks reach every node on the bus, so the skipped nodes and
+   the ones not in slaves store the image too. ABORT is broadcast at the end
+   for them and for the failed nodes to drop it, the updated nodes ignoring
+   it. A group address would need mendeleev_set_group(), which replaces the
+   groups of the application.
+
+   The progress callback is called with the broadcast address during the
+   broadcast and with the slave during its repair. The result of each node is
+   stored in results (when not NULL): 0 or the errno of its failure.
+
+   Returns the number of updated nodes or -1 if the broadcast failed. */
+int mendeleev_ota_broadcast_buffer(mendeleev_t *ctx, const uint8_t *slaves, int nb_slaves,
+                                   const uint8_t *image, size_t size,
+                                   const mendeleev_ota_options_t *options, int *results)
+{
+    mendeleev_ota_options_t defaults;
+    ota_transfer_t t;
+    ota_node_t *nodes;
+    int saved_slave;
+    int saved_max_inflight;
+    int saved_errno;
+    int nb_updated;
+    int rc = 0;
+
+    if (options == NULL) {
+        mendeleev_ota_options_init(&defaults);
+        options = &defaults;
+    }
+
+    if (_check_options(ctx, image, size, options) == -1 ||
+        _check_slaves(slaves, nb_slaves) == -1)
+        return -1;
+
+    if (_transfer_init(&t, ctx, options, image, size) == -1)
+        return -1;
+    t.command_retries = options->max_retries;
+    nodes = _nodes_new(slaves, nb_slaves);
+    if (nodes == NULL) {
+        _transfer_free(&t);
+        return -1;
+    }
+
+    saved_slave = ctx->slave;
+    saved_max_inflight = ctx->max_inflight;
+
+    if (_discover(ctx, nodes, nb_slaves, options) > 0) {
+        rc = _broadcast_group(&t, nodes, nb_slaves, 0);
+        saved_errno = errno;
+        _broadcast_abort(ctx);
+        errno = saved_errno;
+    }
+
+    saved_errno = errno;
+    _inflight_clear(ctx);
+    ctx->max_inflight = saved_max_inflight;
+    ctx->slave = saved_slave;
+    _transfer_free(&t);
+
+    nb_updated = _nodes_free(nodes, nb_slaves, results, saved_errno);
+    if (rc == -1) {
+        errno = saved_errno;
+        return -1;
+    }
+
+    return nb_updated;
+}
+
+/* Same as mendeleev_ota_broadcast_buffer() with the image of the file at
+   path, mapped in memory */
+int mendeleev_ota_broadcast(mendeleev_t *ctx, const uint8_t *slaves, int nb_slaves,
+                            const char *path, const mendeleev_ota_options_t *options,
+                            int *results)
+{
+    const uint8_t *image;
+    size_t size;
+    int rc;
+
+    image = _map_image(path, &size);
+    if (image == NULL)
+        return -1;
+
+    rc = mendeleev_ota_broadcast_buffer(ctx, slaves, nb_slaves, image, size, options, results);
+    _unmap_image(image, size);
+
+    return rc;
+}
+
+/* Encodes the delta from the image of base to target, fails when the store
+   doesn't have base or the delta isn't smaller than target */
+static int _encode_delta(mendeleev_store_t *store, const char *base,
+                         const uint8_t *target, size_t target_size,
+                         uint8_t **base_image, size_t *base_size,
+                         uint8_t **delta, size_t *delta_size)
+{
+    if (base[0] == '\0' || mendeleev_store_load(store, base, base_image, base_size) == -1)
+        return -1;
+
+    if (mendeleev_delta_encode(*base_image, *base_size, target, target_size,
+                               delta, delta_size) == -1) {
+        free(*base_image);
+        return -1;
+    }
+
+    if (*delta_size >= target_size) {
+        free(*base_image);
+        free(*delta);
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Updates slave to the image of version in store. The version reported by
+   the slave selects the base of a delta in the store, the whole image is sent
+   when the store doesn't have it or when the slave rejects the delta.
+
+   Returns 0 once the slave has accepted the image, or right away when it
+   already runs version, or -1 with errno set. */
+int mendeleev_ota_update_version(mendeleev_t *ctx, int slave, mendeleev_store_t *store,
+                                 const char *version, const mendeleev_ota_options_t *options)
+{
+    mendeleev_ota_options_t defaults;
+    char current[MENDELEEV_MAX_DATA_LENGTH + 1];
+    uint16_t length;
+    uint8_t *target;
+    uint8_t *base;
+    uint8_t *delta;
+    size_t target_size;
+    size_t base_size;
+    size_t delta_size;
+    ota_transfer_t t;
+    int saved_slave;
+    int saved_errno;
+    int rc;
+
+    if (options == NULL) {
+        mendeleev_ota_options_init(&defaults);
+        options = &defaults;
+    }
+
+    if (ctx == NULL || store == NULL || version == NULL ||
+        slave < 1 || MENDELEEV_IS_MULTICAST_ADDRESS(slave)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    saved_slave = ctx->slave;
+    ctx->slave = slave;
+    rc = _command(ctx, options->max_retries, MENDELEEV_CMD_GET_VERSION, NULL, 0,
+                  (uint8_t *)current, &length);
+    ctx->slave = saved_slave;
+    if (rc == -1)
+        return -1;
+    current[length] = '\0';
+    if (strcmp(current, version) == 0)
+        return 0;
+
+    if (mendeleev_store_load(store, version, &target, &target_size) == -1)
+        return -1;
+    if (_check_options(ctx, target, target_size, options) == -1) {
+        free(target);
+        return -1;
+    }
+
+    rc = -1;
+    if (_encode_delta(store, current, target, target_size,
+                      &base, &base_size, &delta, &delta_size) == 0) {
+        if (_transfer_init(&t, ctx, options, delta, delta_size) == 0) {
+            _set_delta(&t, base, base_size, target, target_size);
+            rc = _unicast(&t, slave);
+            _transfer_free(&t);
+        }
+        free(base);
+        free(delta);
+
+        /* Only a rejected delta is worth the whole image */
+        if (rc == -1 && errno != EMBXNACK && errno != EMBOTAFAIL) {
+            saved_errno = errno;
+            free(target);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    if (rc == -1 && _transfer_init(&t, ctx, options, target, target_size) == 0) {
+        rc = _unicast(&t, slave);
+        _transfer_free(&t);
+    }
+
+    saved_errno = errno;
+    free(target);
+    errno = saved_errno;
+
+    return rc;
+}
+
+/* Updates the nodes to the image of version in store, like
+   mendeleev_ota_broadcast_buffer(). The nodes running the same version are
+   sent the same delta from it, when the store has the image of this version.
+   The other nodes, and the ones rejecting their delta, are then sent the
+   whole image. The nodes already running version are skipped. */
+int mendeleev_ota_broadcast_version(mendeleev_t *ctx, const uint8_t *slaves, int nb_slaves,
+                                    mendeleev_store_t *store, const char *version,
+                                    const mendeleev_ota_options_t *options, int *results)
+{
+    mendeleev_ota_options_t opts;
+    ota_transfer_t t;
+    ota_node_t *nodes;
+    uint8_t *target;
+    size_t target_size;
+    int saved_slave;
+    int saved_max_inflight;
+    int saved_errno;
+    int nb_updated;
+    int i;
+    int j;
+    int rc = 0;
+
+    if (options == NULL)
+        mendeleev_ota_options_init(&opts);
+    else
+        opts = *options;
+    opts.version = version;
+
+    if (ctx == NULL || store == NULL || version == NULL ||
+        _check_slaves(slaves, nb_slaves) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mendeleev_store_load(store, version, &target, &target_size) == -1)
+        return -1;
+    nodes = _nodes_new(slaves, nb_slaves);
+    if (_check_options(ctx, target, target_size, &opts) == -1 || nodes == NULL) {
+        saved_errno = errno;
+        free(nodes);
+        free(target);
+        errno = saved_errno;
+        return -1;
+    }
+
+    saved_slave = ctx->slave;
+    saved_max_inflight = ctx->max_inflight;
+
+    if (_discover(ctx, nodes, nb_slaves, &opts) > 0) {
+        /* One group per version, after the index of its first node. Group 0
+           receives the whole image. */
+        for (i = 0; i < nb_slaves; i++) {
+            if (!_in_group(&nodes[i], 0)) {
+                nodes[i].group = -1;
+                continue;
+            }
+            nodes[i].group = i + 1;
+            for (j = 0; j < i; j++) {
+                if (strcmp(nodes[i].version, nodes[j].version) == 0) {
+                    nodes[i].group = nodes[j].group;
+                    break;
+                }
+            }
+        }
+
+        for (i = 0; rc != -1 && i < nb_slaves; i++) {
+            int group = i + 1;
+            uint8_t *base;
+            uint8_t *delta;
+            size_t base_size;
+            size_t delta_size;
+            int ok = FALSE;
+
+            if (!_in_group(&nodes[i], group))
+                continue;
+
+            if (_encode_delta(store, nodes[i].version, target, target_size,
+                              &base, &base_size, &delta, &delta_size) == 0) {
+                if (_transfer_init(&t, ctx, &opts, delta, delta_size) == 0) {
+                    _set_delta(&t, base, base_size, target, target_size);
+                    t.command_retries = opts.max_retries;
+                    rc = _broadcast_group(&t, nodes, nb_slaves, group);
+                    _transfer_free(&t);
+                    ok = TRUE;
+                }
+                free(base);
+                free(delta);
+            }
+
+            for (j = i; j < nb_slaves; j++) {
+                if (nodes[j].group != group || nodes[j].done)
+                    continue;
+                if (!ok || nodes[j].error == EMBXNACK || nodes[j].error == EMBOTAFAIL) {
+                    nodes[j].group = 0;
+                    nodes[j].error = 0;
+                }
+            }
+        }
+
+        if (rc != -1 && _transfer_init(&t, ctx, &opts, target, target_size) == 0) {
+            t.command_retries = opts.max_retries;
+            rc = _broadcast_group(&t, nodes, nb_slaves, 0);
+            _transfer_free(&t);
+        }
+
+        saved_errno = errno;
+        _broadcast_abort(ctx);
+        errno = saved_errno;
+    }
+
+    saved_errno = errno;
+    _inflight_clear(ctx);
+    ctx->max_inflight = saved_max_inflight;
+    ctx->slave = saved_slave;
+    free(target);
+
+    nb_updated = _nodes_free(nodes, nb_slaves, results, saved_errno);
+    if (rc == -1) {
+        errno = saved_errno;
+        return -1;
+    }
+
+    return nb_updated;
+}
+
+/* Asks slave for the state of its firmware transfer */
+int mendeleev_ota_get_status(mendeleev_t *ctx, int slave, mendeleev_ota_status_t *status)
+{
+    uint8_t req[1];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int saved_slave;
+    int rc;
+
+    if (ctx == NULL || status == NULL || slave < 1 || MENDELEEV_IS_MULTICAST_ADDRESS(slave)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    saved_slave = ctx->slave;
+    ctx->slave = slave;
+    req[0] = MENDELEEV_OTA_STATUS;
+    rc = _ota_command(ctx, 0, req, 1, rsp, 9);
+    ctx->slave = saved_slave;
+    if (rc == -1)
+        return -1;
+
+    status->state = rsp[1];
+    status->offset = _get_be32(rsp + 2);
+    status->size = _get_be32(rsp + 6);
+
+    return 0;
+}
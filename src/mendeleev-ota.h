@@ -0,0 +1,157 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_OTA_H
+#define MENDELEEV_OTA_H
+
+#include <stddef.h>
+
+#include "mendeleev.h"
+#include "mendeleev-store.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* The payload of MENDELEEV_CMD_OTA starts with an operation, the multi-byte
+ * fields are big endian:
+ * - BEGIN: flags (1), image size (4), chunk size (2), image CRC (2), then
+ *   with MENDELEEV_OTA_FLAG_DELTA: target size (4), target CRC (2), base
+ *   CRC (2)
+ *   response: acknowledged offset (4), where the transfer resumes
+ * - DATA: offset (4), chunk
+ *   response: offset (4) of the stored chunk
+ * - DATA_LZ4: same as DATA with the chunk compressed as a LZ4 block (see
+ *   mendeleev-lz4.h)
+ * - END: no data
+ *   response: status (1)
+ * - STATUS: no data
+ *   response: state (1), acknowledged offset (4), image size (4)
+ * - MISSING: first chunk (4)
+ *   response: first chunk (4), number of chunks (2), then one bit per chunk
+ *   from the first one (least significant bit first), set when the chunk is
+ *   missing. The node covers as many chunks as fit in the response.
+ * - ABORT: no data, a node receiving an image drops it and returns to IDLE
+ *   response: no data
+ * The acknowledged offset is the length of the image received without gap.
+ * The image CRC is mendeleev_crc16() of the whole image.
+ *
+ * With MENDELEEV_OTA_FLAG_DELTA, the image is a delta (see mendeleev-delta.h)
+ * from the base, the firmware run by the node, to the target it rebuilds at
+ * END. A node whose firmware doesn't match the base CRC rejects BEGIN. */
+#define MENDELEEV_OTA_BEGIN   0x00
+#define MENDELEEV_OTA_DATA    0x01
+#define MENDELEEV_OTA_END     0x02
+#define MENDELEEV_OTA_STATUS  0x03
+#define MENDELEEV_OTA_MISSING 0x04
+#define MENDELEEV_OTA_DATA_LZ4 0x05
+#define MENDELEEV_OTA_ABORT   0x06
+
+/* Flag of BEGIN: keep the chunks received by an interrupted transfer of the
+ * same image */
+#define MENDELEEV_OTA_FLAG_RESUME  0x01
+/* Flag of BEGIN: the image is a delta */
+#define MENDELEEV_OTA_FLAG_DELTA   0x02
+
+#define MENDELEEV_OTA_BEGIN_LENGTH   10
+#define MENDELEEV_OTA_BEGIN_DELTA_LENGTH 18
+#define MENDELEEV_OTA_DATA_HEADER    5
+#define MENDELEEV_OTA_MAX_CHUNK      (MENDELEEV_MAX_DATA_LENGTH - MENDELEEV_OTA_DATA_HEADER)
+#define MENDELEEV_OTA_MISSING_HEADER 7
+
+/* Status of END */
+#define MENDELEEV_OTA_STATUS_OK          0x00
+#define MENDELEEV_OTA_STATUS_INCOMPLETE  0x01
+#define MENDELEEV_OTA_STATUS_BAD_CRC     0x02
+#define MENDELEEV_OTA_STATUS_BAD_DELTA   0x03
+
+/* States of STATUS */
+#define MENDELEEV_OTA_STATE_IDLE       0x00
+#define MENDELEEV_OTA_STATE_RECEIVING  0x01
+#define MENDELEEV_OTA_STATE_COMPLETE   0x02
+#define MENDELEEV_OTA_STATE_FAILED     0x03
+
+/* Default number of chunks in flight */
+#define MENDELEEV_OTA_WINDOW       8
+/* Default number of retransmissions of a chunk */
+#define MENDELEEV_OTA_MAX_RETRIES  5
+/* Default number of poll and repair rounds of a broadcast transfer */
+#define MENDELEEV_OTA_MAX_ROUNDS   8
+/* Default number of nodes missing a chunk to broadcast it again */
+#define MENDELEEV_OTA_REBROADCAST_MIN 2
+
+typedef struct _mendeleev_ota_progress {
+    int slave;
+    size_t size;
+    /* Image received by the slave without gap */
+    size_t offset;
+    /* Offset where the transfer started, more than 0 when resumed */
+    size_t resumed_offset;
+    /* Chunk bytes sent, once compressed, retransmissions included */
+    size_t bytes_sent;
+    unsigned int retransmissions;
+    /* Elapsed time in microseconds and acknowledged bytes per second */
+    int64_t elapsed;
+    double throughput;
+} mendeleev_ota_progress_t;
+
+typedef void (*mendeleev_ota_progress_cb)(mendeleev_t *ctx,
+                                          const mendeleev_ota_progress_t *progress,
+                                          void *user_data);
+
+typedef struct _mendeleev_ota_options {
+    /* Bytes per chunk, up to MENDELEEV_OTA_MAX_CHUNK */
+    int chunk_size;
+    /* Chunks in flight, up to MENDELEEV_MAX_INFLIGHT */
+    int window;
+    /* Retransmissions of a chunk before giving up, up to 255 */
+    int max_retries;
+    /* Resume an interrupted transfer of the same image */
+    int resume;
+    /* Send the chunks which compress with DATA_LZ4, the nodes must support
+       it */
+    int compress;
+    /* Broadcast transfers: rounds of repair, nodes missing a chunk to
+       broadcast it again rather than unicast it, delay in microseconds before
+       each broadcast chunk for the nodes to store the previous one, version
+       of the image to skip the nodes already running it (or NULL) */
+    int max_rounds;
+    int rebroadcast_min;
+    int broadcast_gap;
+    const char *version;
+    mendeleev_ota_progress_cb progress;
+    void *user_data;
+} mendeleev_ota_options_t;
+
+typedef struct _mendeleev_ota_status {
+    int state;
+    size_t offset;
+    size_t size;
+} mendeleev_ota_status_t;
+
+MENDELEEV_API void mendeleev_ota_options_init(mendeleev_ota_options_t *options);
+
+MENDELEEV_API int mendeleev_ota_update(mendeleev_t *ctx, int slave, const char *path,
+                                       const mendeleev_ota_options_t *options);
+MENDELEEV_API int mendeleev_ota_update_buffer(mendeleev_t *ctx, int slave,
+                                              const uint8_t *image, size_t size,
+                                              const mendeleev_ota_options_t *options);
+MENDELEEV_API int mendeleev_ota_broadcast(mendeleev_t *ctx, const uint8_t *slaves, int nb_slaves,
+                                          const char *path, const mendeleev_ota_options_t *options,
+                                          int *results);
+MENDELEEV_API int mendeleev_ota_broadcast_buffer(mendeleev_t *ctx, const uint8_t *slaves, int nb_slaves,
+                                                 const uint8_t *image, size_t size,
+                                                 const mendeleev_ota_options_t *options, int *results);
+MENDELEEV_API int mendeleev_ota_update_version(mendeleev_t *ctx, int slave,
+                                               mendeleev_store_t *store, const char *version,
+                                               const mendeleev_ota_options_t *options);
+MENDELEEV_API int mendeleev_ota_broadcast_version(mendeleev_t *ctx, const uint8_t *slaves,
+                                                  int nb_slaves, mendeleev_store_t *store,
+                                                  const char *version,
+                                                  const mendeleev_ota_options_t *options,
+                                                  int *results);
+MENDELEEV_API int mendeleev_ota_get_status(mendeleev_t *ctx, int slave,
+                                           mendeleev_ota_status_t *status);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_OTA_H */
@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <config.h>
 
 #include "mendeleev.h"
@@ -24,15 +25,50 @@ MENDELEEV_BEGIN_DECLS
  * - HEADER_LENGTH_RTU (1) + function (1) + address (2) + number (2) + CRC (2)
  */
 
+/* Max message length */
+#define MAX_MESSAGE_LENGTH MENDELEEV_MAX_MESSAGE_LENGTH
+
+/* Size of the receive ring buffer, must be a power of two */
+#define _RX_BUFFER_SIZE 4096
+
 /* Timeouts in microsecond (0.5 s) */
 #define _RESPONSE_TIMEOUT    500000
 #define _BYTE_TIMEOUT        500000
 
+/* Minimal idle time ending a frame, as in Modbus RTU above 19200 bauds */
+#define _FRAME_GAP_MIN       1750
+
+/* Default bounds of the adaptive response timeouts (10 ms to 0.5 s) */
+#define _ADAPTIVE_TIMEOUT_MIN  10000
+#define _ADAPTIVE_TIMEOUT_MAX  _RESPONSE_TIMEOUT
+
+/* Response time estimates of mendeleev_set_adaptive_timeout() */
+typedef struct _mendeleev_rtt mendeleev_rtt_t;
+
+/* Retry policies of the commands below, the last one is the default */
+#define _RETRY_COMMANDS      8
+/* Writes of the link recovery for a command without retry policy */
+#define _LINK_MAX_ATTEMPTS   5
+
+/* Default bounds of the delay between two probes of an open breaker */
+#define _BREAKER_BACKOFF_MIN  100000
+#define _BREAKER_BACKOFF_MAX  30000000
+
+/* Circuit breakers of mendeleev_set_breaker() */
+typedef struct _mendeleev_breaker mendeleev_breaker_t;
+
+/* Latency histograms of mendeleev-stats.c */
+typedef struct _mendeleev_latency mendeleev_latency_t;
+
 typedef struct _mendeleev_backend {
     int (*set_slave) (mendeleev_t *ctx, int slave);
     int (*build_request_basis) (mendeleev_t *ctx, uint8_t command, uint8_t *req);
     int (*send_msg_pre) (uint8_t *req, int req_length);
+    int (*send_msg_trailer) (const uint8_t *header, int header_length,
+                             const uint8_t *data, int data_length,
+                             uint8_t *trailer);
     ssize_t (*send) (mendeleev_t *ctx, const uint8_t *req, int req_length);
+    ssize_t (*sendv) (mendeleev_t *ctx, const struct iovec *iov, int iovcnt);
     int (*receive) (mendeleev_t *ctx, uint8_t *req);
     ssize_t (*recv) (mendeleev_t *ctx, uint8_t *rsp, int rsp_length);
     int (*check_integrity) (mendeleev_t *ctx, uint8_t *msg,
@@ -42,10 +78,48 @@ typedef struct _mendeleev_backend {
     int (*connect) (mendeleev_t *ctx);
     void (*close) (mendeleev_t *ctx);
     int (*flush) (mendeleev_t *ctx);
-    int (*select) (mendeleev_t *ctx, fd_set *rset, struct timeval *tv, int msg_length);
+    int (*select) (mendeleev_t *ctx, struct timeval *tv);
+    int64_t (*wire_time) (mendeleev_t *ctx, int length);
     void (*free) (mendeleev_t *ctx);
 } mendeleev_backend_t;
 
+/* Received bytes not parsed yet. The indexes are free running, the bytes
+   between head and tail are valid. */
+typedef struct _mendeleev_ring {
+    unsigned int head;
+    unsigned int tail;
+    uint8_t buf[_RX_BUFFER_SIZE];
+} mendeleev_ring_t;
+
+/* A request waiting for its response, matched on (slave, sequence number) */
+typedef struct _mendeleev_request {
+    int in_use;
+    int slave;
+    uint16_t seqnr;
+    /* Copy of the request header, used by check_confirmation() */
+    uint8_t header[MENDELEEV_DATA_OFFSET];
+    /* Monotonic deadline in microseconds */
+    int64_t deadline;
+    /* Expected end of the transmission of the request */
+    int64_t sent_at;
+    /* Time of the call which sent the request, for the latency statistics */
+    int64_t started_at;
+    /* Completion callback of mendeleev_submit() */
+    mendeleev_completion_cb callback;
+    void *user_data;
+} mendeleev_request_t;
+
+/* A submitted request waiting for a free in-flight slot */
+typedef struct _mendeleev_pending {
+    struct _mendeleev_pending *next;
+    int slave;
+    uint8_t command;
+    uint16_t data_length;
+    mendeleev_completion_cb callback;
+    void *user_data;
+    uint8_t data[];
+} mendeleev_pending_t;
+
 struct _mendeleev {
     /* Slave address */
     int slave;
@@ -55,13 +129,81 @@ struct _mendeleev {
     int error_recovery;
     struct timeval response_timeout;
     struct timeval byte_timeout;
+    /* Silence after a request which times it out, disabled when zero */
+    struct timeval first_byte_timeout;
+    int frame_gap;
+    /* Expected end of the transmission of the sent bytes */
+    int64_t tx_end;
+    int64_t last_byte_at;
+    /* Adaptive response timeouts, NULL when disabled */
+    mendeleev_rtt_t *rtt;
+    uint32_t adaptive_timeout_min;
+    uint32_t adaptive_timeout_max;
+    /* Retry policies, unset when max_attempts is 0 */
+    mendeleev_retry_policy_t retry[_RETRY_COMMANDS + 1];
+    /* Timeout (0 for the response timeout) and deadline (0 for none) of the
+       current attempt of a retried command */
+    int64_t attempt_timeout;
+    int64_t attempt_deadline;
+    /* Circuit breakers, NULL when disabled */
+    mendeleev_breaker_t *breaker;
+    uint32_t breaker_backoff_min;
+    uint32_t breaker_backoff_max;
+    mendeleev_breaker_cb breaker_callback;
+    void *breaker_user_data;
+    /* Counters and latency histograms (allocated on the first response) */
+    mendeleev_stats_t stats;
+    mendeleev_latency_t *latency;
     const mendeleev_backend_t *backend;
     void *backend_data;
+    /* Next sequence number to use for each slave address */
+    uint16_t seqnr[256];
+    /* Requests sent and not answered yet */
+    int max_inflight;
+    int nb_inflight;
+    mendeleev_request_t inflight[MENDELEEV_MAX_INFLIGHT];
+    /* Queue of mendeleev_submit() */
+    mendeleev_pending_t *pending_head;
+    mendeleev_pending_t *pending_tail;
+    /* Bytes read from the socket not parsed yet, shared by the blocking and
+       non-blocking receive paths */
+    mendeleev_ring_t rx;
+    /* Reactor driving the context, if any, and the index of the timer of the
+       context in its heap (-1 for none) */
+    struct _mendeleev_reactor *reactor;
+    int reactor_timer;
 };
 
 void _init_common(mendeleev_t *ctx);
 void _error_print(mendeleev_t *ctx, const char *context);
 int _receive_msg(mendeleev_t *ctx, uint8_t *msg);
+int _ring_extract_frame(mendeleev_t *ctx, uint8_t *msg);
+int _is_inflight_slave(mendeleev_t *ctx, int slave);
+void _inflight_clear(mendeleev_t *ctx);
+void _requests_abort(mendeleev_t *ctx, int error);
+void _schedule_wakeup(mendeleev_t *ctx);
+int64_t _time_us(void);
+int _crc16_set_engine(const char *name);
+const char *_crc16_get_engine(void);
+int64_t _rtt_deadline(mendeleev_t *ctx, mendeleev_request_t *request);
+void _rtt_update(mendeleev_t *ctx, const mendeleev_request_t *request,
+                 const uint8_t *rsp, int rsp_length);
+void _rtt_free(mendeleev_t *ctx);
+const mendeleev_retry_policy_t *_retry_policy(mendeleev_t *ctx, uint8_t command);
+int _retry_is_retryable(const mendeleev_retry_policy_t *policy, int error);
+int64_t _retry_backoff(const mendeleev_retry_policy_t *policy, int attempt);
+int _retry_send_attempts(mendeleev_t *ctx, uint8_t command);
+int _breaker_check(mendeleev_t *ctx, int slave);
+int _breaker_is_due(mendeleev_t *ctx, int slave, int64_t now);
+int _breaker_next_due(mendeleev_t *ctx, int64_t now);
+int64_t _breaker_next_probe(mendeleev_t *ctx);
+void _breaker_probe_start(mendeleev_t *ctx, int slave);
+void _breaker_probe_end(mendeleev_t *ctx, int slave, int rc);
+void _breaker_update(mendeleev_t *ctx, int slave, int timed_out);
+void _breaker_free(mendeleev_t *ctx);
+void _stats_record_latency(mendeleev_t *ctx, int slave, uint8_t command, int64_t latency);
+void _stats_free(mendeleev_t *ctx);
+int _reactor_schedule(struct _mendeleev_reactor *reactor, mendeleev_t *ctx, int64_t deadline);
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dest, const char *src, size_t dest_size);
@@ -0,0 +1,384 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-reactor.h"
+
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+/* Max events handled by one epoll_wait() call */
+#define _REACTOR_MAX_EVENTS 32
+
+/* Next wakeup of a context */
+typedef struct _mendeleev_timer {
+    int64_t deadline;
+    mendeleev_t *ctx;
+} mendeleev_timer_t;
+
+struct _mendeleev_reactor {
+    int epfd;
+    /* Registered contexts */
+    mendeleev_t **ctxs;
+    int nb_ctxs;
+    /* Min-heap of the wakeups, one timer per context at most, whose index is
+       kept in the context to move it in place */
+    mendeleev_timer_t *timers;
+    int nb_timers;
+    int max_timers;
+};
+
+static void _heap_set(mendeleev_reactor_t *reactor, int i, mendeleev_timer_t timer)
+{
+    reactor->timers[i] = timer;
+    timer.ctx->reactor_timer = i;
+}
+
+static void _heap_swap(mendeleev_reactor_t *reactor, int a, int b)
+{
+    mendeleev_timer_t tmp = reactor->timers[a];
+
+    _heap_set(reactor, a, reactor->timers[b]);
+    _heap_set(reactor, b, tmp);
+}
+
+static void _heap_up(mendeleev_reactor_t *reactor, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (reactor->timers[parent].deadline <= reactor->timers[i].deadline)
+            break;
+        _heap_swap(reactor, parent, i);
+        i = parent;
+    }
+}
+
+static void _heap_down(mendeleev_reactor_t *reactor, int i)
+{
+    for (;;) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+
+        if (left < reactor->nb_timers &&
+            reactor->timers[left].deadline < reactor->timers[smallest].deadline)
+            smallest = left;
+        if (right < reactor->nb_timers &&
+            reactor->timers[right].deadline < reactor->timers[smallest].deadline)
+            smallest = right;
+        if (smallest == i)
+            break;
+        _heap_swap(reactor, smallest, i);
+        i = smallest;
+    }
+}
+
+/* Removes the timer at index i from the heap */
+static void _heap_remove(mendeleev_reactor_t *reactor, int i)
+{
+    reactor->timers[i].ctx->reactor_timer = -1;
+    reactor->nb_timers--;
+    if (i < reactor->nb_timers) {
+        _heap_set(reactor, i, reactor->timers[reactor->nb_timers]);
+        _heap_up(reactor, i);
+        _heap_down(reactor, i);
+    }
+}
+
+static void _heap_pop(mendeleev_reactor_t *reactor)
+{
+    _heap_remove(reactor, 0);
+}
+
+/* Sets the timer of the context to deadline, -1 to remove it. Called by the
+   context each time its next wakeup changes. */
+int _reactor_schedule(mendeleev_reactor_t *reactor, mendeleev_t *ctx, int64_t deadline)
+{
+    int i = ctx->reactor_timer;
+
+    if (deadline == -1) {
+        if (i != -1)
+            _heap_remove(reactor, i);
+        return 0;
+    }
+
+    if (i != -1) {
+        int64_t previous = reactor->timers[i].deadline;
+
+        reactor->timers[i].deadline = deadline;
+        if (deadline < previous)
+            _heap_up(reactor, i);
+        else
+            _heap_down(reactor, i);
+        return 0;
+    }
+
+    if (reactor->nb_timers == reactor->max_timers) {
+        int max_timers = reactor->max_timers ? 2 * reactor->max_timers : 64;
+        mendeleev_timer_t *timers;
+
+        timers = (mendeleev_timer_t *)realloc(reactor->timers,
+                                              max_timers * sizeof(mendeleev_timer_t));
+        if (timers == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        reactor->timers = timers;
+        reactor->max_timers = max_timers;
+    }
+
+    reactor->timers[reactor->nb_timers].deadline = deadline;
+    reactor->timers[reactor->nb_timers].ctx = ctx;
+    ctx->reactor_timer = reactor->nb_timers;
+    _heap_up(reactor, reactor->nb_timers);
+    reactor->nb_timers++;
+
+    return 0;
+}
+
+mendeleev_reactor_t* mendeleev_reactor_new(void)
+{
+#if HAVE_SYS_EPOLL_H
+    mendeleev_reactor_t *reactor;
+
+    reactor = (mendeleev_reactor_t *)malloc(sizeof(mendeleev_reactor_t));
+    if (reactor == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epfd == -1) {
+        free(reactor);
+        return NULL;
+    }
+
+    reactor->ctxs = NULL;
+    reactor->nb_ctxs = 0;
+    reactor->timers = NULL;
+    reactor->nb_timers = 0;
+    reactor->max_timers = 0;
+
+    return reactor;
+#else
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+void mendeleev_reactor_free(mendeleev_reactor_t *reactor)
+{
+    if (reactor == NULL)
+        return;
+
+    while (reactor->nb_ctxs > 0)
+        mendeleev_reactor_remove(reactor, reactor->ctxs[0]);
+
+    close(reactor->epfd);
+    free(reactor->ctxs);
+    free(reactor->timers);
+    free(reactor);
+}
+
+/* Registers a connected context, its socket must not change while it is
+   registered */
+int mendeleev_reactor_add(mendeleev_reactor_t *reactor, mendeleev_t *ctx)
+{
+#if HAVE_SYS_EPOLL_H
+    mendeleev_t **ctxs;
+    struct epoll_event event;
+
+    if (reactor == NULL || ctx == NULL || ctx->s == -1 || ctx->reactor != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctxs = (mendeleev_t **)realloc(reactor->ctxs,
+                                   (reactor->nb_ctxs + 1) * sizeof(mendeleev_t *));
+    if (ctxs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    reactor->ctxs = ctxs;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = ctx;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, ctx->s, &event) == -1)
+        return -1;
+
+    reactor->ctxs[reactor->nb_ctxs++] = ctx;
+    ctx->reactor = reactor;
+
+    /* Wakeup of the requests already in flight */
+    _schedule_wakeup(ctx);
+
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int mendeleev_reactor_remove(mendeleev_reactor_t *reactor, mendeleev_t *ctx)
+{
+#if HAVE_SYS_EPOLL_H
+    int i;
+
+    if (reactor == NULL || ctx == NULL || ctx->reactor != reactor) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->s != -1)
+        epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, ctx->s, NULL);
+
+    for (i = 0; i < reactor->nb_ctxs; i++) {
+        if (reactor->ctxs[i] == ctx) {
+            reactor->ctxs[i] = reactor->ctxs[--reactor->nb_ctxs];
+            break;
+        }
+    }
+
+    if (ctx->reactor_timer != -1)
+        _heap_remove(reactor, ctx->reactor_timer);
+
+    ctx->reactor = NULL;
+
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* The epoll fd can be watched by an outer event loop, it is readable when
+   mendeleev_reactor_run_once() has something to do */
+int mendeleev_reactor_get_fd(mendeleev_reactor_t *reactor)
+{
+    if (reactor == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return reactor->epfd;
+}
+
+/* Waits up to timeout_ms milliseconds (-1 for no limit) for incoming data or
+   a request deadline, then dispatches the completions. Returns the number of
+   completed requests.
+
+   A context whose descriptor fails or hangs up is removed from the reactor
+   and its requests are completed with the error. The other contexts are
+   still served, then -1 is returned with errno set to the error; the context
+   can be added again once reconnected. */
+int mendeleev_reactor_run_once(mendeleev_reactor_t *reactor, int timeout_ms)
+{
+#if HAVE_SYS_EPOLL_H
+    int i;
+    int rc;
+    int completed = 0;
+    int error = 0;
+    int nb_expired;
+    int64_t now;
+    struct epoll_event events[_REACTOR_MAX_EVENTS];
+
+    if (reactor == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (reactor->nb_timers > 0) {
+        int64_t remaining = reactor->timers[0].deadline - _time_us();
+        int timer_ms = remaining <= 0 ? 0 : (int)((remaining + 999) / 1000);
+
+        if (timeout_ms < 0 || timer_ms < timeout_ms)
+            timeout_ms = timer_ms;
+    }
+
+    rc = epoll_wait(reactor->epfd, events, _REACTOR_MAX_EVENTS, timeout_ms);
+    if (rc == -1) {
+        if (errno != EINTR)
+            return -1;
+        rc = 0;
+    }
+
+    for (i = 0; i < rc; i++) {
+        mendeleev_t *ctx = (mendeleev_t *)events[i].data.ptr;
+        int nb = mendeleev_on_readable(ctx);
+
+        if (nb == -1 || (events[i].events & (EPOLLHUP | EPOLLERR))) {
+            /* Level-triggered, a dead descriptor would be reported again at
+               once */
+            if (nb != -1)
+                errno = ECONNRESET;
+            else
+                nb = 0;
+            error = errno;
+            _error_print(ctx, "reactor");
+            mendeleev_reactor_remove(reactor, ctx);
+            _requests_abort(ctx, error);
+        }
+        completed += nb;
+    }
+
+    /* The timers expired before this pass only, the fd is read before the
+       ones set by mendeleev_on_timeout() */
+    now = _time_us();
+    nb_expired = reactor->nb_timers;
+    while (nb_expired-- > 0 && reactor->nb_timers > 0 && reactor->timers[0].deadline <= now) {
+        mendeleev_t *ctx = reactor->timers[0].ctx;
+
+        _heap_pop(reactor);
+        completed += mendeleev_on_timeout(ctx);
+    }
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return completed;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Runs until no registered context has a request left to complete. Returns
+   the number of completed requests. */
+int mendeleev_reactor_run(mendeleev_reactor_t *reactor)
+{
+    int completed = 0;
+
+    if (reactor == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        int i;
+        int rc;
+        int pending = 0;
+
+        for (i = 0; i < reactor->nb_ctxs; i++)
+            pending += mendeleev_get_pending(reactor->ctxs[i]);
+        if (pending == 0)
+            break;
+
+        rc = mendeleev_reactor_run_once(reactor, -1);
+        if (rc == -1)
+            return -1;
+        completed += rc;
+    }
+
+    return completed;
+}
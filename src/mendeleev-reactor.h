@@ -0,0 +1,27 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_REACTOR_H
+#define MENDELEEV_REACTOR_H
+
+#include "mendeleev.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* Drives many contexts from a single thread with one epoll set */
+typedef struct _mendeleev_reactor mendeleev_reactor_t;
+
+MENDELEEV_API mendeleev_reactor_t* mendeleev_reactor_new(void);
+MENDELEEV_API void mendeleev_reactor_free(mendeleev_reactor_t *reactor);
+
+MENDELEEV_API int mendeleev_reactor_add(mendeleev_reactor_t *reactor, mendeleev_t *ctx);
+MENDELEEV_API int mendeleev_reactor_remove(mendeleev_reactor_t *reactor, mendeleev_t *ctx);
+MENDELEEV_API int mendeleev_reactor_get_fd(mendeleev_reactor_t *reactor);
+
+MENDELEEV_API int mendeleev_reactor_run_once(mendeleev_reactor_t *reactor, int timeout_ms);
+MENDELEEV_API int mendeleev_reactor_run(mendeleev_reactor_t *reactor);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_REACTOR_H */
@@ -0,0 +1,100 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "mendeleev-private.h"
+
+/* Returns the policy of command, the default one otherwise, or NULL when
+   the command is not retried */
+const mendeleev_retry_policy_t *_retry_policy(mendeleev_t *ctx, uint8_t command)
+{
+    if (command < _RETRY_COMMANDS && ctx->retry[command].max_attempts > 0)
+        return &ctx->retry[command];
+    if (ctx->retry[_RETRY_COMMANDS].max_attempts > 0)
+        return &ctx->retry[_RETRY_COMMANDS];
+    return NULL;
+}
+
+/* Returns TRUE when the error of a failed attempt may be retried */
+int _retry_is_retryable(const mendeleev_retry_policy_t *policy, int error)
+{
+    switch (error) {
+    case ETIMEDOUT:
+        return (policy->retry_on & MENDELEEV_RETRY_TIMEOUT) != 0;
+    case EMBBADCRC:
+        return (policy->retry_on & MENDELEEV_RETRY_BADCRC) != 0;
+    case EMBBADDATA:
+    case EMBBADSLAVE:
+        return (policy->retry_on & MENDELEEV_RETRY_BADDATA) != 0;
+    case EMBXNACK:
+        return (policy->retry_on & MENDELEEV_RETRY_NACK) != 0;
+    case EMBXSBUSY:
+        return (policy->retry_on & MENDELEEV_RETRY_BUSY) != 0;
+    default:
+        return FALSE;
+    }
+}
+
+/* Returns the delay in microseconds before the attempt following attempt */
+int64_t _retry_backoff(const mendeleev_retry_policy_t *policy, int attempt)
+{
+    int64_t delay = policy->backoff_usec;
+    int i;
+
+    for (i = 1; i < attempt && delay < policy->backoff_max_usec; i++)
+        delay *= policy->backoff_factor;
+
+    return delay > policy->backoff_max_usec ? policy->backoff_max_usec : delay;
+}
+
+/* Returns the number of writes of a request to command with the link
+   recovery, which is bounded even without a policy */
+int _retry_send_attempts(mendeleev_t *ctx, uint8_t command)
+{
+    const mendeleev_retry_policy_t *policy = _retry_policy(ctx, command);
+
+    return policy != NULL ? policy->max_attempts : _LINK_MAX_ATTEMPTS;
+}
+
+/* Sets the retry policy of mendeleev_send_command() for command, or the
+   default policy of the commands without their own with -1. A NULL policy
+   removes it, a command without policy being sent once.
+
+   The policy is applied to the blocking commands only: the requests of
+   mendeleev_send_request() and mendeleev_submit() are answered as is. */
+int mendeleev_set_retry_policy(mendeleev_t *ctx, int command,
+                               const mendeleev_retry_policy_t *policy)
+{
+    mendeleev_retry_policy_t *slot;
+
+    if (ctx == NULL || command < -1 || command >= _RETRY_COMMANDS ||
+        (policy != NULL && (policy->max_attempts < 1 || policy->backoff_factor < 1 ||
+                            policy->backoff_usec > policy->backoff_max_usec))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slot = &ctx->retry[command == -1 ? _RETRY_COMMANDS : command];
+    if (policy != NULL)
+        *slot = *policy;
+    else
+        memset(slot, 0, sizeof(*slot));
+    return 0;
+}
+
+/* Copies the policy of command (-1 for the default one) in policy, whose
+   max_attempts is 0 when none is set */
+int mendeleev_get_retry_policy(mendeleev_t *ctx, int command,
+                               mendeleev_retry_policy_t *policy)
+{
+    if (ctx == NULL || policy == NULL || command < -1 || command >= _RETRY_COMMANDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *policy = ctx->retry[command == -1 ? _RETRY_COMMANDS : command];
+    return 0;
+}
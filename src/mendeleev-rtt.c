@@ -0,0 +1,242 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mendeleev-private.h"
+
+/* Commands with their own estimate, the others share the one of the slave */
+#define RTT_COMMANDS     8
+/* Clock granularity of RFC 6298, the minimal margin over the smoothed RTT */
+#define RTT_GRANULARITY  1000
+#define RTT_MAX_BACKOFF  6
+
+/* Smoothed turnaround time of a slave (or one of its commands), that is the
+   time between the end of the request and the start of the response on the
+   line, in microseconds. */
+typedef struct _mendeleev_rtt_entry {
+    int32_t srtt;
+    int32_t rttvar;
+    /* Largest response seen, to scale the timeout to its transmission */
+    uint16_t rsp_length;
+    uint8_t valid;
+    /* Number of timeouts since the last sample, the timeout doubles each */
+    uint8_t backoff;
+} mendeleev_rtt_entry_t;
+
+struct _mendeleev_rtt {
+    /* Expected end of the last response in flight */
+    int64_t busy_until;
+    int64_t last_response_at;
+    mendeleev_rtt_entry_t slave[256];
+    mendeleev_rtt_entry_t command[256][RTT_COMMANDS];
+};
+
+static int64_t _wire(mendeleev_t *ctx, int length)
+{
+    return ctx->backend->wire_time(ctx, length);
+}
+
+static int _request_length(const uint8_t *header)
+{
+    return MENDELEEV_MSG_OVERHEAD +
+        ((header[MENDELEEV_DATALEN_OFFSET] << 8) | header[MENDELEEV_DATALEN_OFFSET + 1]);
+}
+
+static mendeleev_rtt_entry_t *_command_entry(mendeleev_rtt_t *rtt, int slave, uint8_t command)
+{
+    return command < RTT_COMMANDS ? &rtt->command[slave][command] : NULL;
+}
+
+/* Returns the estimate of the command if any, then the one of the slave */
+static const mendeleev_rtt_entry_t *_estimate(mendeleev_rtt_t *rtt, int slave, uint8_t command)
+{
+    const mendeleev_rtt_entry_t *entry = _command_entry(rtt, slave, command);
+
+    if (entry != NULL && entry->valid)
+        return entry;
+    if (rtt->slave[slave].valid)
+        return &rtt->slave[slave];
+    return NULL;
+}
+
+/* Time to wait for the start of a response once the request is sent, the
+   fixed response timeout until a first sample is known */
+static int64_t _turnaround_timeout(mendeleev_t *ctx, const mendeleev_rtt_entry_t *entry)
+{
+    int64_t timeout;
+    int64_t margin;
+
+    if (entry == NULL)
+        return (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+            ctx->response_timeout.tv_usec;
+
+    margin = 4 * (int64_t)entry->rttvar;
+    if (margin < RTT_GRANULARITY)
+        margin = RTT_GRANULARITY;
+    timeout = (entry->srtt + margin) << entry->backoff;
+
+    if (timeout < ctx->adaptive_timeout_min)
+        timeout = ctx->adaptive_timeout_min;
+    if (timeout > ctx->adaptive_timeout_max)
+        timeout = ctx->adaptive_timeout_max;
+
+    return timeout;
+}
+
+static int _response_length(const mendeleev_rtt_entry_t *entry)
+{
+    return entry != NULL ? entry->rsp_length : MENDELEEV_MSG_OVERHEAD;
+}
+
+/* RFC 6298 */
+static void _sample(mendeleev_rtt_entry_t *entry, int32_t rtt, int rsp_length)
+{
+    if (!entry->valid) {
+        entry->srtt = rtt;
+        entry->rttvar = rtt / 2;
+        entry->valid = TRUE;
+    } else {
+        int32_t delta = entry->srtt > rtt ? entry->srtt - rtt : rtt - entry->srtt;
+
+        entry->rttvar = (3 * (int64_t)entry->rttvar + delta) / 4;
+        entry->srtt = (7 * (int64_t)entry->srtt + rtt) / 8;
+    }
+    entry->backoff = 0;
+    if (rsp_length > entry->rsp_length)
+        entry->rsp_length = rsp_length;
+}
+
+static void _backoff(mendeleev_rtt_entry_t *entry)
+{
+    if (entry->valid && entry->backoff < RTT_MAX_BACKOFF)
+        entry->backoff++;
+}
+
+/* Returns the deadline of the request which has just been sent.
+
+   The line is half-duplex, so when requests are pipelined, a request is only
+   transmitted after the responses expected before it. */
+int64_t _rtt_deadline(mendeleev_t *ctx, mendeleev_request_t *request)
+{
+    mendeleev_rtt_t *rtt = ctx->rtt;
+    const mendeleev_rtt_entry_t *entry = _estimate(rtt, request->slave,
+                                                   request->header[MENDELEEV_CMD_OFFSET]);
+    int64_t start = request->sent_at;
+    int64_t rsp_wire = _wire(ctx, _response_length(entry));
+
+    if (ctx->nb_inflight > 0) {
+        int64_t after = rtt->busy_until + _wire(ctx, _request_length(request->header));
+        if (after > start)
+            start = after;
+    }
+
+    rtt->busy_until = start + (entry != NULL ? entry->srtt : 0) + rsp_wire;
+
+    return start + _turnaround_timeout(ctx, entry) + rsp_wire;
+}
+
+/* Updates the estimates with the response of request, rsp NULL on timeout */
+void _rtt_update(mendeleev_t *ctx, const mendeleev_request_t *request,
+                 const uint8_t *rsp, int rsp_length)
+{
+    mendeleev_rtt_t *rtt = ctx->rtt;
+    uint8_t command = request->header[MENDELEEV_CMD_OFFSET];
+    mendeleev_rtt_entry_t *entry = _command_entry(rtt, request->slave, command);
+    int64_t now;
+    int64_t start;
+    int64_t sample;
+
+    if (rsp == NULL) {
+        if (entry != NULL)
+            _backoff(entry);
+        _backoff(&rtt->slave[request->slave]);
+        return;
+    }
+
+    /* A response is matched on its sequence number, so unlike TCP
+       retransmissions, there is no ambiguity about the request answered */
+    now = _time_us();
+    start = rtt->last_response_at + _wire(ctx, _request_length(request->header));
+    if (start < request->sent_at)
+        start = request->sent_at;
+    sample = now - start - _wire(ctx, rsp_length);
+    if (sample < 0)
+        sample = 0;
+    else if (sample > INT32_MAX)
+        sample = INT32_MAX;
+    rtt->last_response_at = now;
+
+    if (entry != NULL)
+        _sample(entry, sample, rsp_length);
+    _sample(&rtt->slave[request->slave], sample, rsp_length);
+}
+
+void _rtt_free(mendeleev_t *ctx)
+{
+    free(ctx->rtt);
+    ctx->rtt = NULL;
+}
+
+/* Enables the timeouts derived from the response times of each slave and
+   command, like the retransmission timeout of TCP. The fixed response timeout
+   is used until a first response of the slave is received. */
+int mendeleev_set_adaptive_timeout(mendeleev_t *ctx, int enable)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!enable) {
+        _rtt_free(ctx);
+        return 0;
+    }
+
+    if (ctx->rtt == NULL) {
+        ctx->rtt = calloc(1, sizeof(mendeleev_rtt_t));
+        if (ctx->rtt == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Bounds of the adaptive timeouts in microseconds, the transmission time of
+   the request and of the response being added to them */
+int mendeleev_set_adaptive_timeout_bounds(mendeleev_t *ctx, uint32_t min_usec, uint32_t max_usec)
+{
+    if (ctx == NULL || min_usec == 0 || min_usec > max_usec) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->adaptive_timeout_min = min_usec;
+    ctx->adaptive_timeout_max = max_usec;
+    return 0;
+}
+
+/* Returns the timeout in microseconds of a request to slave with data_length
+   bytes of data sent on an idle line, the fixed response timeout when the
+   adaptive timeouts are disabled */
+int64_t mendeleev_get_adaptive_timeout(mendeleev_t *ctx, int slave, uint8_t command,
+                                       uint16_t data_length)
+{
+    const mendeleev_rtt_entry_t *entry = NULL;
+
+    if (ctx == NULL || slave < 0 || slave > 255 || data_length > MENDELEEV_MAX_DATA_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->rtt == NULL)
+        return _turnaround_timeout(ctx, NULL);
+
+    entry = _estimate(ctx->rtt, slave, command);
+    return _wire(ctx, MENDELEEV_MSG_OVERHEAD + data_length) +
+        _turnaround_timeout(ctx, entry) + _wire(ctx, _response_length(entry));
+}
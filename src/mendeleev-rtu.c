@@ -11,6 +11,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "mendeleev-private.h"
 
@@ -25,71 +27,15 @@
 #include <linux/serial.h>
 #endif
 
-/* Table of CRC values for high-order byte */
-static const uint8_t table_crc_hi[] = {
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
-};
-
-/* Table of CRC values for low-order byte */
-static const uint8_t table_crc_lo[] = {
-    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
-    0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
-    0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
-    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
-    0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
-    0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
-    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
-    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
-    0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
-    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
-    0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
-    0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
-    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
-    0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
-    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
-    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
-    0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
-    0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
-    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
-    0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
-    0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
-    0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
-    0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
-    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
-    0x43, 0x83, 0x41, 0x81, 0x80, 0x40
-};
+/* Max number of parts of a message given to writev() */
+#define _MAX_IOV 8
 
 /* Define the slave ID of the remote device to talk in master mode or set the
  * internal slave ID in slave mode */
 static int _set_slave(mendeleev_t *ctx, int slave)
 {
-    /* Broadcast address is 0xFF (MENDELEEV_BROADCAST_ADDRESS) */
+    /* Broadcast address is 0xFF (MENDELEEV_BROADCAST_ADDRESS) and group
+     * addresses are just below (MENDELEEV_GROUP_ADDRESS) */
     if (slave > 0 && slave <= 255) {
         ctx->slave = slave;
     } else {
@@ -110,7 +56,9 @@ static int _build_request_basis(mendeleev_t *ctx, uint8_t command, uint8_t *req)
     }
     req[length++] = ctx->slave; // destination
     req[length++] = 0; // source
-    uint16_t sqnr = 1;
+    /* Sequence numbers are incremented per slave so that pipelined
+     * responses can be matched to their request */
+    uint16_t sqnr = ++ctx->seqnr[ctx->slave];
     req[length++] = sqnr >> 8;
     req[length++] = sqnr & 0x00FF;
     req[length++] = command;
@@ -118,31 +66,32 @@ static int _build_request_basis(mendeleev_t *ctx, uint8_t command, uint8_t *req)
     return length;
 }
 
-static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
-{
-    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
-    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
-    unsigned int i; /* will index into CRC lookup */
-
-    /* pass through message buffer */
-    while (buffer_length--) {
-        i = crc_hi ^ *buffer++; /* calculate the CRC  */
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
-    }
-
-    return (crc_hi << 8 | crc_lo);
-}
-
 static int _send_msg_pre(uint8_t *req, int req_length)
 {
-    uint16_t crc = crc16(req + MENDELEEV_DEST_OFFSET, req_length - MENDELEEV_PREAMBLE_LENGTH);
+    uint16_t crc = mendeleev_crc16(req + MENDELEEV_DEST_OFFSET, req_length - MENDELEEV_PREAMBLE_LENGTH);
     req[req_length++] = crc >> 8;
     req[req_length++] = crc & 0x00FF;
 
     return req_length;
 }
 
+/* Computes the CRC trailer of a message whose payload isn't contiguous with
+   its header */
+static int _send_msg_trailer(const uint8_t *header, int header_length,
+                             const uint8_t *data, int data_length,
+                             uint8_t *trailer)
+{
+    uint16_t crc;
+
+    crc = mendeleev_crc16_update(MENDELEEV_CRC16_INIT, header + MENDELEEV_DEST_OFFSET,
+                                 header_length - MENDELEEV_PREAMBLE_LENGTH);
+    crc = mendeleev_crc16_update(crc, data, data_length);
+    trailer[0] = crc >> 8;
+    trailer[1] = crc & 0x00FF;
+
+    return MENDELEEV_CHECKSUM_LENGTH;
+}
+
 #if HAVE_DECL_TIOCM_RTS
 static void _ioctl_rts(mendeleev_t *ctx, int on)
 {
@@ -159,12 +108,75 @@ static void _ioctl_rts(mendeleev_t *ctx, int on)
 }
 #endif
 
-static ssize_t _send(mendeleev_t *ctx, const uint8_t *req, int req_length)
+/* Writes all the iov parts, waiting for room in the output buffer of the
+   non-blocking descriptor when needed. Returns the number of bytes written,
+   which is short when the line stays busy for the response timeout, or -1
+   with errno set to ETIMEDOUT when nothing could be written. */
+static ssize_t _writev_all(mendeleev_t *ctx, const struct iovec *iov, int iovcnt)
+{
+    ssize_t rc;
+    ssize_t written = 0;
+    struct iovec parts[_MAX_IOV];
+    struct iovec *part = parts;
+
+    if (iovcnt > _MAX_IOV) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(parts, iov, iovcnt * sizeof(struct iovec));
+
+    while (iovcnt > 0) {
+        rc = writev(ctx->s, part, iovcnt);
+        if (rc == -1) {
+            struct pollfd pfd;
+            int timeout_ms = ctx->response_timeout.tv_sec * 1000 +
+                ctx->response_timeout.tv_usec / 1000;
+
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return written > 0 ? written : -1;
+
+            pfd.fd = ctx->s;
+            pfd.events = POLLOUT;
+            rc = poll(&pfd, 1, timeout_ms);
+            if (rc <= 0) {
+                if (written > 0)
+                    return written;
+                if (rc == 0)
+                    errno = ETIMEDOUT;
+                return -1;
+            }
+            continue;
+        }
+
+        written += rc;
+        /* Skips the parts fully written */
+        while (iovcnt > 0 && (size_t)rc >= part->iov_len) {
+            rc -= part->iov_len;
+            part++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            part->iov_base = (uint8_t *)part->iov_base + rc;
+            part->iov_len -= rc;
+        }
+    }
+
+    return written;
+}
+
+static ssize_t _sendv(mendeleev_t *ctx, const struct iovec *iov, int iovcnt)
 {
 #if HAVE_DECL_TIOCM_RTS
     mendeleev_rtu_t *ctx_rtu = ctx->backend_data;
     if (ctx_rtu->rts != MENDELEEV_RTU_RTS_NONE) {
         ssize_t size;
+        int i;
+        int req_length = 0;
+
+        for (i = 0; i < iovcnt; i++)
+            req_length += iov[i].iov_len;
 
         if (ctx->debug) {
             fprintf(stderr, "Sending request using RTS signal\n");
@@ -173,7 +185,7 @@ static ssize_t _send(mendeleev_t *ctx, const uint8_t *req, int req_length)
         ctx_rtu->set_rts(ctx, ctx_rtu->rts == MENDELEEV_RTU_RTS_UP);
         usleep(ctx_rtu->rts_delay);
 
-        size = write(ctx->s, req, req_length);
+        size = _writev_all(ctx, iov, iovcnt);
 
         usleep(ctx_rtu->onebyte_time * req_length + ctx_rtu->rts_delay);
         ctx_rtu->set_rts(ctx, ctx_rtu->rts != MENDELEEV_RTU_RTS_UP);
@@ -181,12 +193,21 @@ static ssize_t _send(mendeleev_t *ctx, const uint8_t *req, int req_length)
         return size;
     } else {
 #endif
-        return write(ctx->s, req, req_length);
+        return _writev_all(ctx, iov, iovcnt);
 #if HAVE_DECL_TIOCM_RTS
     }
 #endif
 }
 
+static ssize_t _send(mendeleev_t *ctx, const uint8_t *req, int req_length)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)req;
+    iov.iov_len = req_length;
+    return _sendv(ctx, &iov, 1);
+}
+
 static int _receive(mendeleev_t *ctx, uint8_t *req)
 {
     int rc;
@@ -217,14 +238,13 @@ static ssize_t _recv(mendeleev_t *ctx, uint8_t *rsp, int rsp_length)
     return read(ctx->s, rsp, rsp_length);
 }
 
-static int _flush(mendeleev_t *);
-
 static int _pre_check_confirmation(mendeleev_t *ctx, const uint8_t *req,
                                               const uint8_t *rsp, int rsp_length)
 {
     /* Check responding slave is the slave we requested (except for broacast
      * request) */
-    if (req[MENDELEEV_DEST_OFFSET] != rsp[MENDELEEV_SRC_OFFSET] && req[MENDELEEV_DEST_OFFSET] != MENDELEEV_BROADCAST_ADDRESS) {
+    if (req[MENDELEEV_DEST_OFFSET] != rsp[MENDELEEV_SRC_OFFSET] &&
+        !MENDELEEV_IS_MULTICAST_ADDRESS(req[MENDELEEV_DEST_OFFSET])) {
         if (ctx->debug) {
             fprintf(stderr,
                     "The responding slave %d isn't the requested slave %d\n",
@@ -251,9 +271,12 @@ static int _pre_check_confirmation(mendeleev_t *ctx, const uint8_t *req,
     return 0;
 }
 
-/* The check_crc16 function shall return 0 is the message is ignored and the
+/* The check_crc16 function shall return 0 if the message is ignored and the
    message length if the CRC is valid. Otherwise it shall return -1 and set
-   errno to EMBBADCRC. */
+   errno to EMBBADCRC.
+
+   The CRC is checked first so the frame parser can tell a valid frame for
+   another slave from line noise. */
 static int _check_integrity(mendeleev_t *ctx, uint8_t *msg,
                                        const int msg_length)
 {
@@ -261,34 +284,30 @@ static int _check_integrity(mendeleev_t *ctx, uint8_t *msg,
     uint16_t crc_received;
     int slave = msg[MENDELEEV_SRC_OFFSET];
 
-    /* Filter on the Modbus unit identifier (slave) in RTU mode to avoid useless
-     * CRC computing. */
-    if (slave != ctx->slave && slave != MENDELEEV_BROADCAST_ADDRESS) {
-        if (ctx->debug) {
-            printf("Request for slave %d ignored (not %d)\n", slave, ctx->slave);
-        }
-        /* Following call to check_confirmation handles this error */
-        return 0;
-    }
-
-    crc_calculated = crc16(msg + MENDELEEV_PREAMBLE_LENGTH, msg_length - MENDELEEV_PREAMBLE_LENGTH - MENDELEEV_CHECKSUM_LENGTH);
+    crc_calculated = mendeleev_crc16(msg + MENDELEEV_PREAMBLE_LENGTH, msg_length - MENDELEEV_PREAMBLE_LENGTH - MENDELEEV_CHECKSUM_LENGTH);
     crc_received = (msg[msg_length - 2] << 8) | msg[msg_length - 1];
 
     /* Check CRC of msg */
-    if (crc_calculated == crc_received) {
-        return msg_length;
-    } else {
+    if (crc_calculated != crc_received) {
         if (ctx->debug) {
             fprintf(stderr, "ERROR CRC received 0x%0X != CRC calculated 0x%0X\n",
                     crc_received, crc_calculated);
         }
-
-        if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_PROTOCOL) {
-            _flush(ctx);
-        }
         errno = EMBBADCRC;
         return -1;
     }
+
+    /* Filter on the slave address, a broadcast or group address can't be the
+     * source of a response */
+    if (MENDELEEV_IS_MULTICAST_ADDRESS(slave) ||
+        (slave != ctx->slave && !_is_inflight_slave(ctx, slave))) {
+        if (ctx->debug) {
+            printf("Request for slave %d ignored (not %d)\n", slave, ctx->slave);
+        }
+        return 0;
+    }
+
+    return msg_length;
 }
 
 /* Sets up a serial port for RTU communications */
@@ -824,18 +843,39 @@ static int _flush(mendeleev_t *ctx)
     return tcflush(ctx->s, TCIOFLUSH);
 }
 
-static int _select(mendeleev_t *ctx, fd_set *rset,
-                              struct timeval *tv, int length_to_read)
+/* Waits until the socket is readable, tv is the maximum delay */
+static int _select(mendeleev_t *ctx, struct timeval *tv)
 {
     int s_rc;
-    while ((s_rc = select(ctx->s+1, rset, NULL, NULL, tv)) == -1) {
+    struct pollfd pfd;
+
+    pfd.fd = ctx->s;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+#ifdef HAVE_PPOLL
+    /* Microsecond resolution */
+    struct timespec ts;
+
+    ts.tv_sec = tv->tv_sec;
+    ts.tv_nsec = tv->tv_usec * 1000;
+#else
+    int timeout_ms = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+#endif
+
+    for (;;) {
+#ifdef HAVE_PPOLL
+        s_rc = ppoll(&pfd, 1, &ts, NULL);
+#else
+        s_rc = poll(&pfd, 1, timeout_ms);
+#endif
+        if (s_rc != -1)
+            break;
+
         if (errno == EINTR) {
             if (ctx->debug) {
                 fprintf(stderr, "A non blocked signal was caught\n");
             }
-            /* Necessary after an error */
-            FD_ZERO(rset);
-            FD_SET(ctx->s, rset);
         } else {
             return -1;
         }
@@ -847,9 +887,24 @@ static int _select(mendeleev_t *ctx, fd_set *rset,
         return -1;
     }
 
+    if (pfd.revents & POLLNVAL) {
+        errno = EBADF;
+        return -1;
+    }
+
     return s_rc;
 }
 
+/* Time in microseconds to transmit length bytes with the settings of the line,
+   without the per byte rounding of onebyte_time */
+static int64_t _wire_time(mendeleev_t *ctx, int length)
+{
+    mendeleev_rtu_t *ctx_rtu = ctx->backend_data;
+    int bits = 1 + ctx_rtu->data_bit + (ctx_rtu->parity == 'N' ? 0 : 1) + ctx_rtu->stop_bit;
+
+    return ((int64_t)length * bits * 1000000 + ctx_rtu->baud - 1) / ctx_rtu->baud;
+}
+
 static void _free(mendeleev_t *ctx) {
     if (ctx->backend_data) {
         free(((mendeleev_rtu_t *)ctx->backend_data)->device);
@@ -863,7 +918,9 @@ const mendeleev_backend_t _backend = {
     _set_slave,
     _build_request_basis,
     _send_msg_pre,
+    _send_msg_trailer,
     _send,
+    _sendv,
     _receive,
     _recv,
     _check_integrity,
@@ -872,6 +929,7 @@ const mendeleev_backend_t _backend = {
     _close,
     _flush,
     _select,
+    _wire_time,
     _free
 };
 
@@ -0,0 +1,381 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-stats.h"
+
+#define SUB_BUCKETS     (1 << MENDELEEV_HISTOGRAM_SUB_BITS)
+/* Values below have a bucket each */
+#define LINEAR_LIMIT    (2 * SUB_BUCKETS)
+/* Commands with their own histogram, the others share the last one */
+#define STATS_COMMANDS  8
+/* Exported buckets, one per power of two up to 2^25 us (33.5 s) */
+#define EXPORT_MAX_BITS 25
+
+struct _mendeleev_latency {
+    mendeleev_histogram_t command[STATS_COMMANDS + 1];
+    /* Allocated on the first response of the slave */
+    mendeleev_histogram_t *slave[256];
+};
+
+static int _log2(uint32_t value)
+{
+    int n = 0;
+
+    while (value >>= 1)
+        n++;
+    return n;
+}
+
+/* Returns the bucket of value */
+int mendeleev_histogram_bucket(uint32_t value)
+{
+    int e;
+
+    if (value < LINEAR_LIMIT)
+        return value;
+
+    e = _log2(value);
+    return LINEAR_LIMIT + (e - MENDELEEV_HISTOGRAM_SUB_BITS - 1) * SUB_BUCKETS +
+        ((value >> (e - MENDELEEV_HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Returns the highest value of bucket */
+uint32_t mendeleev_histogram_bucket_limit(int bucket)
+{
+    int e;
+    int sub;
+    uint64_t low;
+
+    if (bucket < 0)
+        return 0;
+    if (bucket < LINEAR_LIMIT)
+        return bucket;
+    if (bucket >= MENDELEEV_HISTOGRAM_BUCKETS)
+        return UINT32_MAX;
+
+    e = MENDELEEV_HISTOGRAM_SUB_BITS + 1 + (bucket - LINEAR_LIMIT) / SUB_BUCKETS;
+    sub = (bucket - LINEAR_LIMIT) % SUB_BUCKETS;
+    low = (uint64_t)(SUB_BUCKETS + sub) << (e - MENDELEEV_HISTOGRAM_SUB_BITS);
+
+    return low + ((uint64_t)1 << (e - MENDELEEV_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/* Returns the value below which percentile percent of the values are, rounded
+   up to the limit of its bucket, or 0 for an empty histogram */
+uint32_t mendeleev_histogram_percentile(const mendeleev_histogram_t *histogram, double percentile)
+{
+    uint64_t target;
+    uint64_t count = 0;
+    int i;
+
+    if (histogram == NULL || histogram->count == 0)
+        return 0;
+
+    if (percentile <= 0)
+        return histogram->min;
+    if (percentile >= 100)
+        return histogram->max;
+
+    target = (uint64_t)(histogram->count * percentile / 100);
+    if (target == 0)
+        target = 1;
+
+    for (i = 0; i < MENDELEEV_HISTOGRAM_BUCKETS; i++) {
+        count += histogram->buckets[i];
+        if (count >= target)
+            break;
+    }
+
+    return mendeleev_histogram_bucket_limit(i) < histogram->max ?
+        mendeleev_histogram_bucket_limit(i) : histogram->max;
+}
+
+static void _record(mendeleev_histogram_t *histogram, uint32_t value)
+{
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[mendeleev_histogram_bucket(value)]++;
+}
+
+/* Records the time between a request and its response */
+void _stats_record_latency(mendeleev_t *ctx, int slave, uint8_t command, int64_t latency)
+{
+    struct _mendeleev_latency *l = ctx->latency;
+    uint32_t value = latency < 0 ? 0 : (latency > UINT32_MAX ? UINT32_MAX : latency);
+
+    if (l == NULL) {
+        l = calloc(1, sizeof(struct _mendeleev_latency));
+        if (l == NULL)
+            return;
+        ctx->latency = l;
+    }
+
+    _record(&l->command[command < STATS_COMMANDS ? command : STATS_COMMANDS], value);
+
+    if (l->slave[slave] == NULL) {
+        l->slave[slave] = calloc(1, sizeof(mendeleev_histogram_t));
+        if (l->slave[slave] == NULL)
+            return;
+    }
+    _record(l->slave[slave], value);
+}
+
+void _stats_free(mendeleev_t *ctx)
+{
+    int i;
+
+    if (ctx->latency == NULL)
+        return;
+
+    for (i = 0; i < 256; i++)
+        free(ctx->latency->slave[i]);
+    free(ctx->latency);
+    ctx->latency = NULL;
+}
+
+/* Copies the counters of the context in stats */
+int mendeleev_get_stats(mendeleev_t *ctx, mendeleev_stats_t *stats)
+{
+    if (ctx == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = ctx->stats;
+    return 0;
+}
+
+/* Clears the counters and the histograms */
+int mendeleev_reset_stats(mendeleev_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    _stats_free(ctx);
+    return 0;
+}
+
+/* Copies the histogram of the response times of command, the commands above
+   MENDELEEV_CMD_SET_GROUP sharing one */
+int mendeleev_get_command_latency(mendeleev_t *ctx, uint8_t command,
+                                  mendeleev_histogram_t *histogram)
+{
+    if (ctx == NULL || histogram == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->latency == NULL)
+        memset(histogram, 0, sizeof(*histogram));
+    else
+        *histogram = ctx->latency->command[command < STATS_COMMANDS ? command : STATS_COMMANDS];
+    return 0;
+}
+
+/* Copies the histogram of the response times of slave */
+int mendeleev_get_slave_latency(mendeleev_t *ctx, int slave, mendeleev_histogram_t *histogram)
+{
+    if (ctx == NULL || histogram == NULL || slave < 0 || slave > 255) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->latency == NULL || ctx->latency->slave[slave] == NULL)
+        memset(histogram, 0, sizeof(*histogram));
+    else
+        *histogram = *ctx->latency->slave[slave];
+    return 0;
+}
+
+static void _write_counter(FILE *f, const char *name, const char *help, uint64_t value)
+{
+    fprintf(f, "# HELP mendeleev_%s_total %s\n", name, help);
+    fprintf(f, "# TYPE mendeleev_%s_total counter\n", name);
+    fprintf(f, "mendeleev_%s_total %llu\n", name, (unsigned long long)value);
+}
+
+/* Writes the histogram with a bucket per power of two */
+static void _write_histogram(FILE *f, const char *name, const char *label, int value,
+                             const mendeleev_histogram_t *histogram)
+{
+    uint64_t count = 0;
+    int bits;
+    int i = 0;
+
+    for (bits = MENDELEEV_HISTOGRAM_SUB_BITS + 1; bits <= EXPORT_MAX_BITS; bits++) {
+        uint32_t limit = ((uint32_t)1 << bits) - 1;
+
+        while (i < MENDELEEV_HISTOGRAM_BUCKETS && mendeleev_histogram_bucket_limit(i) <= limit)
+            count += histogram->buckets[i++];
+        fprintf(f, "mendeleev_%s_seconds_bucket{%s=\"%d\",le=\"%.6f\"} %llu\n",
+                name, label, value, limit / 1e6, (unsigned long long)count);
+    }
+    fprintf(f, "mendeleev_%s_seconds_bucket{%s=\"%d\",le=\"+Inf\"} %llu\n",
+            name, label, value, (unsigned long long)histogram->count);
+    fprintf(f, "mendeleev_%s_seconds_sum{%s=\"%d\"} %.6f\n",
+            name, label, value, histogram->sum / 1e6);
+    fprintf(f, "mendeleev_%s_seconds_count{%s=\"%d\"} %llu\n",
+            name, label, value, (unsigned long long)histogram->count);
+}
+
+static int _write_stats(mendeleev_t *ctx, FILE *f)
+{
+    const mendeleev_stats_t *s = &ctx->stats;
+    int i;
+
+    _write_counter(f, "frames_sent", "Frames sent", s->frames_sent);
+    _write_counter(f, "bytes_sent", "Bytes sent", s->bytes_sent);
+    _write_counter(f, "frames_received", "Valid frames received", s->frames_received);
+    _write_counter(f, "bytes_received", "Bytes received", s->bytes_received);
+    _write_counter(f, "bytes_skipped", "Bytes skipped to find the start of a frame",
+                   s->bytes_skipped);
+    _write_counter(f, "crc_errors", "Frames dropped for a bad CRC", s->crc_errors);
+    _write_counter(f, "timeouts", "Requests without response", s->timeouts);
+    _write_counter(f, "bad_slave", "Frames of slaves neither current nor in flight",
+                   s->bad_slave);
+    _write_counter(f, "bad_seqnr", "Responses not matching the sequence numbers in flight",
+                   s->bad_seqnr);
+    _write_counter(f, "late_responses", "Responses of the current slave with no request in flight",
+                   s->late_responses);
+    _write_counter(f, "exceptions", "Exception responses", s->exceptions);
+    _write_counter(f, "flushes", "Flushes", s->flushes);
+    _write_counter(f, "bytes_flushed", "Bytes dropped by the flushes", s->bytes_flushed);
+    _write_counter(f, "drains", "Drains", s->drains);
+    _write_counter(f, "bytes_drained", "Bytes dropped by the drains", s->bytes_drained);
+    _write_counter(f, "frame_gaps", "Partial frames ended by the frame gap", s->frame_gaps);
+    _write_counter(f, "retries", "Commands attempted again", s->retries);
+    _write_counter(f, "breaker_trips", "Breakers opened", s->breaker_trips);
+
+    if (ctx->latency != NULL) {
+        fprintf(f, "# HELP mendeleev_command_latency_seconds Response time by command\n");
+        fprintf(f, "# TYPE mendeleev_command_latency_seconds histogram\n");
+        for (i = 0; i <= STATS_COMMANDS; i++) {
+            if (ctx->latency->command[i].count > 0)
+                _write_histogram(f, "command_latency", "command", i, &ctx->latency->command[i]);
+        }
+
+        fprintf(f, "# HELP mendeleev_slave_latency_seconds Response time by slave\n");
+        fprintf(f, "# TYPE mendeleev_slave_latency_seconds histogram\n");
+        for (i = 0; i < 256; i++) {
+            if (ctx->latency->slave[i] != NULL)
+                _write_histogram(f, "slave_latency", "slave", i, ctx->latency->slave[i]);
+        }
+    }
+
+    return ferror(f) ? -1 : 0;
+}
+
+/* Writes the statistics to fd in the text format of Prometheus */
+int mendeleev_write_stats(mendeleev_t *ctx, int fd)
+{
+    FILE *f;
+    int rc;
+    int fd_copy;
+
+    if (ctx == NULL || fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd_copy = dup(fd);
+    if (fd_copy == -1)
+        return -1;
+    f = fdopen(fd_copy, "w");
+    if (f == NULL) {
+        close(fd_copy);
+        return -1;
+    }
+
+    rc = _write_stats(ctx, f);
+    if (fclose(f) == EOF)
+        rc = -1;
+    return rc;
+}
+
+static int _export_socket(mendeleev_t *ctx, const char *path)
+{
+    int s;
+    int rc;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(s);
+        return -1;
+    }
+
+    rc = mendeleev_write_stats(ctx, s);
+    close(s);
+    return rc;
+}
+
+/* Exports the statistics in the text format of Prometheus to path. A Unix
+   socket at path is connected to, otherwise the file is replaced atomically,
+   as read by the textfile collector of the node exporter. */
+int mendeleev_export_stats(mendeleev_t *ctx, const char *path)
+{
+    char tmp_path[PATH_MAX];
+    struct stat st;
+    FILE *f;
+    int rc;
+
+    if (ctx == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        return _export_socket(ctx, path);
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    f = fopen(tmp_path, "w");
+    if (f == NULL)
+        return -1;
+
+    rc = _write_stats(ctx, f);
+    if (fclose(f) == EOF)
+        rc = -1;
+    if (rc == 0 && rename(tmp_path, path) == -1)
+        rc = -1;
+    if (rc == -1) {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+    }
+
+    return rc;
+}
@@ -0,0 +1,69 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_STATS_H
+#define MENDELEEV_STATS_H
+
+#include "mendeleev.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* Counters of a context since its creation or mendeleev_reset_stats() */
+typedef struct _mendeleev_stats {
+    uint64_t frames_sent;
+    uint64_t bytes_sent;
+    uint64_t frames_received;
+    uint64_t bytes_received;
+    /* Bytes skipped to find the start of a frame */
+    uint64_t bytes_skipped;
+    uint64_t crc_errors;
+    uint64_t timeouts;
+    /* Valid frames of the slaves neither current nor in flight */
+    uint64_t bad_slave;
+    /* Responses of a slave in flight not matching its sequence numbers */
+    uint64_t bad_seqnr;
+    /* Responses of the current slave with no request in flight */
+    uint64_t late_responses;
+    uint64_t exceptions;
+    uint64_t flushes;
+    uint64_t bytes_flushed;
+    uint64_t drains;
+    uint64_t bytes_drained;
+    /* Partial frames ended by the frame gap */
+    uint64_t frame_gaps;
+    uint64_t retries;
+    /* Breakers opened after timeouts */
+    uint64_t breaker_trips;
+} mendeleev_stats_t;
+
+/* Latency histogram in microseconds, log-linear as HdrHistogram: the values
+ * below 16 have their own bucket, then each power of two is split in 8
+ * buckets, so a value is known within 12.5%. */
+#define MENDELEEV_HISTOGRAM_SUB_BITS  3
+#define MENDELEEV_HISTOGRAM_BUCKETS   240
+
+typedef struct _mendeleev_histogram {
+    uint64_t count;
+    /* Sum of the values, for the mean */
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+    uint32_t buckets[MENDELEEV_HISTOGRAM_BUCKETS];
+} mendeleev_histogram_t;
+
+MENDELEEV_API int mendeleev_get_stats(mendeleev_t *ctx, mendeleev_stats_t *stats);
+MENDELEEV_API int mendeleev_reset_stats(mendeleev_t *ctx);
+
+MENDELEEV_API int mendeleev_get_command_latency(mendeleev_t *ctx, uint8_t command, mendeleev_histogram_t *histogram);
+MENDELEEV_API int mendeleev_get_slave_latency(mendeleev_t *ctx, int slave, mendeleev_histogram_t *histogram);
+MENDELEEV_API int mendeleev_histogram_bucket(uint32_t value);
+MENDELEEV_API uint32_t mendeleev_histogram_bucket_limit(int bucket);
+MENDELEEV_API uint32_t mendeleev_histogram_percentile(const mendeleev_histogram_t *histogram, double percentile);
+
+MENDELEEV_API int mendeleev_write_stats(mendeleev_t *ctx, int fd);
+MENDELEEV_API int mendeleev_export_stats(mendeleev_t *ctx, const char *path);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_STATS_H */
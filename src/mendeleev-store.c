@@ -0,0 +1,405 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "mendeleev-private.h"
+#include "mendeleev-store.h"
+
+#define DIGEST_HEX_LENGTH  (2 * MENDELEEV_STORE_DIGEST_LENGTH)
+
+struct _mendeleev_store {
+    char *path;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void _sha256_block(uint32_t *h, const uint8_t *block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, k;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[4 * i] << 24) | (block[4 * i + 1] << 16) |
+            (block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+            ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+            ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+/* SHA-256 of data, the address of an image in the store */
+void mendeleev_sha256(const uint8_t *data, size_t size,
+                      uint8_t digest[MENDELEEV_STORE_DIGEST_LENGTH])
+{
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint8_t last[128];
+    size_t rest = size % 64;
+    size_t last_length;
+    uint64_t bits = (uint64_t)size * 8;
+    size_t i;
+
+    for (i = 0; i + 64 <= size; i += 64)
+        _sha256_block(h, data + i);
+
+    /* Padding, then the length in bits */
+    memcpy(last, data + size - rest, rest);
+    last[rest] = 0x80;
+    last_length = rest < 56 ? 64 : 128;
+    memset(last + rest + 1, 0, last_length - rest - 1);
+    for (i = 0; i < 8; i++)
+        last[last_length - 1 - i] = bits >> (8 * i);
+
+    for (i = 0; i < last_length; i += 64)
+        _sha256_block(h, last + i);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = h[i] >> 24;
+        digest[4 * i + 1] = h[i] >> 16;
+        digest[4 * i + 2] = h[i] >> 8;
+        digest[4 * i + 3] = h[i];
+    }
+}
+
+static void _digest_hex(const uint8_t *image, size_t size, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    uint8_t digest[MENDELEEV_STORE_DIGEST_LENGTH];
+    int i;
+
+    mendeleev_sha256(image, size, digest);
+    for (i = 0; i < MENDELEEV_STORE_DIGEST_LENGTH; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0x0F];
+    }
+    hex[DIGEST_HEX_LENGTH] = '\0';
+}
+
+static int _check_version(const char *version)
+{
+    if (version == NULL || version[0] == '\0' || version[0] == '.' ||
+        strchr(version, '/') != NULL || strlen(version) > NAME_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _mkdir(const char *path)
+{
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
+
+/* Writes the file dir/name by renaming a temporary file, so that a reader
+   never sees it partially written */
+static int _write_file(mendeleev_store_t *store, const char *dir, const char *name,
+                       const void *data, size_t size)
+{
+    char tmp_path[PATH_MAX];
+    char path[PATH_MAX];
+    const uint8_t *p = data;
+    int saved_errno;
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s/.%s.%d", store->path, dir, name, (int)getpid());
+    snprintf(path, sizeof(path), "%s/%s/%s", store->path, dir, name);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    while (size > 0) {
+        ssize_t rc = write(fd, p, size);
+
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            goto error;
+        }
+        p += rc;
+        size -= rc;
+    }
+
+    if (fsync(fd) == -1 || close(fd) == -1) {
+        fd = -1;
+        goto error;
+    }
+    if (rename(tmp_path, path) == -1) {
+        fd = -1;
+        goto error;
+    }
+
+    return 0;
+
+error:
+    saved_errno = errno;
+    if (fd != -1)
+        close(fd);
+    unlink(tmp_path);
+    errno = saved_errno;
+    return -1;
+}
+
+/* Reads the whole file at path in a buffer to free with free() */
+static int _read_file(const char *path, uint8_t **data, size_t *size)
+{
+    struct stat st;
+    uint8_t *buffer;
+    size_t length = 0;
+    int saved_errno;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1)
+        goto error;
+
+    /* One more byte to end a text with a NUL */
+    buffer = malloc(st.st_size + 1);
+    if (buffer == NULL)
+        goto error;
+
+    while (length < (size_t)st.st_size) {
+        ssize_t rc = read(fd, buffer + length, st.st_size - length);
+
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            if (rc == 0)
+                errno = EIO;
+            free(buffer);
+            goto error;
+        }
+        length += rc;
+    }
+    close(fd);
+
+    buffer[length] = '\0';
+    *data = buffer;
+    *size = length;
+
+    return 0;
+
+error:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+/* Reads the digest of version in hex */
+static int _read_version(mendeleev_store_t *store, const char *version, char *hex)
+{
+    char path[PATH_MAX];
+    uint8_t *data;
+    size_t size;
+
+    snprintf(path, sizeof(path), "%s/versions/%s", store->path, version);
+    if (_read_file(path, &data, &size) == -1)
+        return -1;
+
+    if (size < DIGEST_HEX_LENGTH ||
+        strspn((char *)data, "0123456789abcdef") != DIGEST_HEX_LENGTH) {
+        free(data);
+        errno = EMBBADDATA;
+        return -1;
+    }
+    memcpy(hex, data, DIGEST_HEX_LENGTH);
+    hex[DIGEST_HEX_LENGTH] = '\0';
+    free(data);
+
+    return 0;
+}
+
+/* Opens the store at path, created when it doesn't exist */
+mendeleev_store_t* mendeleev_store_open(const char *path)
+{
+    mendeleev_store_t *store;
+    char dir[PATH_MAX];
+
+    if (path == NULL || strlen(path) + sizeof("/versions/") + NAME_MAX >= PATH_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (_mkdir(path) == -1)
+        return NULL;
+    snprintf(dir, sizeof(dir), "%s/objects", path);
+    if (_mkdir(dir) == -1)
+        return NULL;
+    snprintf(dir, sizeof(dir), "%s/versions", path);
+    if (_mkdir(dir) == -1)
+        return NULL;
+
+    store = (mendeleev_store_t *)malloc(sizeof(mendeleev_store_t));
+    if (store == NULL)
+        return NULL;
+
+    store->path = strdup(path);
+    if (store->path == NULL) {
+        free(store);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return store;
+}
+
+void mendeleev_store_close(mendeleev_store_t *store)
+{
+    if (store == NULL)
+        return;
+
+    free(store->path);
+    free(store);
+}
+
+/* Stores image as the one of version, which replaces the previous image of
+   the version if any. The image itself is written once for all the versions
+   sharing it. */
+int mendeleev_store_add(mendeleev_store_t *store, const char *version,
+                        const uint8_t *image, size_t size)
+{
+    char hex[DIGEST_HEX_LENGTH + 2];
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (store == NULL || image == NULL || size == 0 || _check_version(version) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _digest_hex(image, size, hex);
+    snprintf(path, sizeof(path), "%s/objects/%s", store->path, hex);
+    if (stat(path, &st) == -1 || (size_t)st.st_size != size) {
+        if (_write_file(store, "objects", hex, image, size) == -1)
+            return -1;
+    }
+
+    strcat(hex, "\n");
+    return _write_file(store, "versions", version, hex, DIGEST_HEX_LENGTH + 1);
+}
+
+/* Loads the image of version in a buffer to free with free(). Fails with
+   ENOENT when the version isn't in the store and EMBBADDATA when the image
+   doesn't match its digest. */
+int mendeleev_store_load(mendeleev_store_t *store, const char *version,
+                         uint8_t **image, size_t *size)
+{
+    char hex[DIGEST_HEX_LENGTH + 1];
+    char check[DIGEST_HEX_LENGTH + 1];
+    char path[PATH_MAX];
+
+    if (store == NULL || image == NULL || size == NULL || _check_version(version) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (_read_version(store, version, hex) == -1)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/objects/%s", store->path, hex);
+    if (_read_file(path, image, size) == -1)
+        return -1;
+
+    _digest_hex(*image, *size, check);
+    if (strcmp(hex, check) != 0) {
+        free(*image);
+        *image = NULL;
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Finds a version whose image is image, its name is copied to version.
+   Fails with ENOENT when there is none. */
+int mendeleev_store_find(mendeleev_store_t *store, const uint8_t *image,
+                         size_t size, char *version, size_t max_length)
+{
+    char hex[DIGEST_HEX_LENGTH + 1];
+    char other[DIGEST_HEX_LENGTH + 1];
+    char dir[PATH_MAX];
+    struct dirent *entry;
+    DIR *d;
+    int rc = -1;
+
+    if (store == NULL || image == NULL || version == NULL || max_length == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _digest_hex(image, size, hex);
+
+    snprintf(dir, sizeof(dir), "%s/versions", store->path);
+    d = opendir(dir);
+    if (d == NULL)
+        return -1;
+
+    errno = ENOENT;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (_read_version(store, entry->d_name, other) == -1 || strcmp(hex, other) != 0)
+            continue;
+
+        if (strlen(entry->d_name) >= max_length) {
+            errno = ERANGE;
+        } else {
+            strcpy(version, entry->d_name);
+            rc = 0;
+        }
+        break;
+    }
+    if (rc == -1 && errno != ERANGE)
+        errno = ENOENT;
+    closedir(d);
+
+    return rc;
+}
@@ -0,0 +1,39 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MENDELEEV_STORE_H
+#define MENDELEEV_STORE_H
+
+#include <stddef.h>
+
+#include "mendeleev.h"
+
+MENDELEEV_BEGIN_DECLS
+
+/* A local store of firmware images, addressed by content:
+ * - <path>/objects/<digest> holds an image, named after the SHA-256 of its
+ *   content in hexadecimal
+ * - <path>/versions/<version> holds the digest of the image of a version, as
+ *   reported by MENDELEEV_CMD_GET_VERSION
+ * A version can't be empty, start with a dot or contain a slash. */
+#define MENDELEEV_STORE_DIGEST_LENGTH  32
+
+typedef struct _mendeleev_store mendeleev_store_t;
+
+MENDELEEV_API mendeleev_store_t* mendeleev_store_open(const char *path);
+MENDELEEV_API void mendeleev_store_close(mendeleev_store_t *store);
+
+MENDELEEV_API int mendeleev_store_add(mendeleev_store_t *store, const char *version,
+                                      const uint8_t *image, size_t size);
+MENDELEEV_API int mendeleev_store_load(mendeleev_store_t *store, const char *version,
+                                       uint8_t **image, size_t *size);
+MENDELEEV_API int mendeleev_store_find(mendeleev_store_t *store, const uint8_t *image,
+                                       size_t size, char *version, size_t max_length);
+
+MENDELEEV_API void mendeleev_sha256(const uint8_t *data, size_t size,
+                                    uint8_t digest[MENDELEEV_STORE_DIGEST_LENGTH]);
+
+MENDELEEV_END_DECLS
+
+#endif /* MENDELEEV_STORE_H */
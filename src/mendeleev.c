@@ -15,6 +15,7 @@
 #include <limits.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include <config.h>
 
@@ -29,9 +30,6 @@ const unsigned int libmendeleev_version_major = LIBMENDELEEV_VERSION_MAJOR;
 const unsigned int libmendeleev_version_minor = LIBMENDELEEV_VERSION_MINOR;
 const unsigned int libmendeleev_version_micro = LIBMENDELEEV_VERSION_MICRO;
 
-/* Max message length */
-#define MAX_MESSAGE_LENGTH 260
-
 const char *mendeleev_strerror(int errnum) {
     switch (errnum) {
     case EMBXILFUN:
@@ -64,6 +62,10 @@ const char *mendeleev_strerror(int errnum) {
         return "Too many data";
     case EMBBADSLAVE:
         return "Response not from requested slave";
+    case EMBOTAFAIL:
+        return "Firmware image rejected by the slave";
+    case EMBDOWN:
+        return "Slave down, circuit breaker open";
     default:
         return strerror(errnum);
     }
@@ -81,18 +83,212 @@ void _error_print(mendeleev_t *ctx, const char *context)
     }
 }
 
-static void _sleep_response_timeout(mendeleev_t *ctx)
+static void _sleep_us(int64_t delay)
 {
-    /* Response timeout is always positive */
     /* usleep source code */
     struct timespec request, remaining;
-    request.tv_sec = ctx->response_timeout.tv_sec;
-    request.tv_nsec = ((long int)ctx->response_timeout.tv_usec) * 1000;
+    request.tv_sec = delay / 1000000;
+    request.tv_nsec = (long int)(delay % 1000000) * 1000;
     while (nanosleep(&request, &remaining) == -1 && errno == EINTR) {
         request = remaining;
     }
 }
 
+static void _sleep_response_timeout(mendeleev_t *ctx)
+{
+    /* Response timeout is always positive */
+    _sleep_us((int64_t)ctx->response_timeout.tv_sec * 1000000 +
+              ctx->response_timeout.tv_usec);
+}
+
+static unsigned int _ring_length(const mendeleev_ring_t *ring)
+{
+    return ring->tail - ring->head;
+}
+
+static uint8_t _ring_peek(const mendeleev_ring_t *ring, unsigned int offset)
+{
+    return ring->buf[(ring->head + offset) & (_RX_BUFFER_SIZE - 1)];
+}
+
+/* Copies length bytes of the ring, starting at offset, without consuming them */
+static void _ring_copy(const mendeleev_ring_t *ring, uint8_t *dest,
+                       unsigned int offset, unsigned int length)
+{
+    unsigned int start = (ring->head + offset) & (_RX_BUFFER_SIZE - 1);
+    unsigned int first = _RX_BUFFER_SIZE - start;
+
+    if (first > length)
+        first = length;
+    memcpy(dest, ring->buf + start, first);
+    memcpy(dest + first, ring->buf, length - first);
+}
+
+static void _ring_consume(mendeleev_ring_t *ring, unsigned int length)
+{
+    ring->head += length;
+}
+
+static void _ring_reset(mendeleev_ring_t *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/* Reads as many bytes as available in the contiguous free space of the ring.
+   Returns the number of bytes read or -1 (errno of recv). */
+static int _ring_fill(mendeleev_t *ctx)
+{
+    int rc;
+    mendeleev_ring_t *ring = &ctx->rx;
+    unsigned int start = ring->tail & (_RX_BUFFER_SIZE - 1);
+    unsigned int room = _RX_BUFFER_SIZE - _ring_length(ring);
+
+    if (room > _RX_BUFFER_SIZE - start)
+        room = _RX_BUFFER_SIZE - start;
+
+    rc = ctx->backend->recv(ctx, ring->buf + start, room);
+    if (rc > 0) {
+        /* Display the hex code of each character received */
+        if (ctx->debug) {
+            int i;
+            for (i = 0; i < rc; i++)
+                printf("<%.2X>", ring->buf[start + i]);
+        }
+        ring->tail += rc;
+        ctx->last_byte_at = _time_us();
+        ctx->stats.bytes_received += rc;
+    }
+
+    return rc;
+}
+
+/* Returns the length of the frame starting at offset in the ring, 0 when the
+   header isn't complete yet or -1 when there is no valid header at offset:
+   the preamble must be complete and the data length in bounds. */
+static int _ring_frame_length(const mendeleev_ring_t *ring, unsigned int offset)
+{
+    unsigned int i;
+    unsigned int length = _ring_length(ring) - offset;
+    uint16_t datalen;
+
+    for (i = 0; i < MENDELEEV_PREAMBLE_LENGTH && i < length; i++) {
+        if (_ring_peek(ring, offset + i) != PREAMBLE)
+            return -1;
+    }
+
+    if (length < MENDELEEV_DATA_OFFSET)
+        return 0;
+
+    datalen = (_ring_peek(ring, offset + MENDELEEV_DATALEN_OFFSET) << 8) |
+        _ring_peek(ring, offset + MENDELEEV_DATALEN_OFFSET + 1);
+    if (datalen > MAX_MESSAGE_LENGTH - MENDELEEV_MSG_OVERHEAD)
+        return -1;
+
+    return MENDELEEV_DATA_OFFSET + datalen + MENDELEEV_CHECKSUM_LENGTH;
+}
+
+/* Looks for a complete frame with a valid CRC after the start of the ring.
+   Returns its offset or 0 if there is none. */
+static unsigned int _ring_find_next_frame(mendeleev_t *ctx)
+{
+    unsigned int offset;
+    unsigned int length = _ring_length(&ctx->rx);
+    uint8_t msg[MAX_MESSAGE_LENGTH];
+
+    for (offset = 1; offset + MENDELEEV_MSG_OVERHEAD <= length; offset++) {
+        int frame_length = _ring_frame_length(&ctx->rx, offset);
+
+        if (frame_length <= 0 || offset + frame_length > length)
+            continue;
+
+        _ring_copy(&ctx->rx, msg, offset, frame_length);
+        if (ctx->backend->check_integrity(ctx, msg, frame_length) != -1)
+            return offset;
+    }
+
+    return 0;
+}
+
+/* Extracts the first valid frame of the receive buffer into msg.
+
+   The parser hunts for the preamble and checks the bounds of the header and
+   the CRC. On failure it slides forward one byte to resynchronise, so noise or
+   the rest of a partial frame only costs the bytes involved. Frames for other
+   slaves are skipped.
+
+   Returns the length of the frame, 0 if no frame is complete yet or -1 with
+   errno set to EMBBADCRC when a corrupted frame was dropped and no other
+   frame is complete. */
+int _ring_extract_frame(mendeleev_t *ctx, uint8_t *msg)
+{
+    int rc;
+    int bad_crc = FALSE;
+    unsigned int skipped = 0;
+    mendeleev_ring_t *ring = &ctx->rx;
+
+    for (;;) {
+        int frame_length;
+        unsigned int next;
+
+        /* Hunt for the preamble */
+        while (_ring_length(ring) > 0 && _ring_peek(ring, 0) != PREAMBLE) {
+            _ring_consume(ring, 1);
+            skipped++;
+        }
+
+        frame_length = _ring_frame_length(ring, 0);
+        if (frame_length == -1) {
+            _ring_consume(ring, 1);
+            skipped++;
+            continue;
+        }
+
+        if (frame_length == 0 || _ring_length(ring) < (unsigned int)frame_length) {
+            /* Incomplete, unless the header is garbage hiding a complete
+               frame further in the buffer */
+            next = _ring_find_next_frame(ctx);
+            if (next == 0) {
+                rc = 0;
+                break;
+            }
+            _ring_consume(ring, next);
+            skipped += next;
+            continue;
+        }
+
+        _ring_copy(ring, msg, 0, frame_length);
+        rc = ctx->backend->check_integrity(ctx, msg, frame_length);
+        if (rc == -1) {
+            /* Resynchronise on the next byte */
+            bad_crc = TRUE;
+            ctx->stats.crc_errors++;
+            _ring_consume(ring, 1);
+            skipped++;
+            continue;
+        }
+
+        _ring_consume(ring, frame_length);
+        ctx->stats.frames_received++;
+        if (rc > 0)
+            break;
+        /* Valid frame for another slave */
+        ctx->stats.bad_slave++;
+    }
+
+    ctx->stats.bytes_skipped += skipped;
+    if (skipped > 0 && ctx->debug) {
+        fprintf(stderr, "%u bytes skipped to find the start of a frame\n", skipped);
+    }
+
+    if (rc == 0 && bad_crc) {
+        errno = EMBBADCRC;
+        return -1;
+    }
+
+    return rc;
+}
+
 int mendeleev_flush(mendeleev_t *ctx)
 {
     int rc;
@@ -102,7 +298,14 @@ int mendeleev_flush(mendeleev_t *ctx)
         return -1;
     }
 
+    /* Bytes already read are discarded too */
+    ctx->stats.flushes++;
+    ctx->stats.bytes_flushed += _ring_length(&ctx->rx);
+    _ring_reset(&ctx->rx);
+
     rc = ctx->backend->flush(ctx);
+    if (rc > 0)
+        ctx->stats.bytes_flushed += rc;
     if (rc != -1 && ctx->debug) {
         /* Not all backends are able to return the number of bytes flushed */
         printf("Bytes flushed (%d)\n", rc);
@@ -110,6 +313,296 @@ int mendeleev_flush(mendeleev_t *ctx)
     return rc;
 }
 
+/* Idle time which ends a frame, 3.5 characters as in Modbus RTU but at least
+   1.75 ms */
+static int64_t _idle_gap(mendeleev_t *ctx)
+{
+    int64_t gap = ctx->backend->wire_time(ctx, 7) / 2;
+
+    return gap < _FRAME_GAP_MIN ? _FRAME_GAP_MIN : gap;
+}
+
+/* Reads and discards the incoming bytes until the line is idle for 3.5
+   characters, for the response timeout at most when they don't stop.
+   Returns the number of bytes dropped, the unparsed ones included. */
+int mendeleev_drain(mendeleev_t *ctx)
+{
+    int rc;
+    int dropped;
+    int64_t gap;
+    int64_t deadline;
+    uint8_t buf[256];
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dropped = _ring_length(&ctx->rx);
+    _ring_reset(&ctx->rx);
+
+    gap = _idle_gap(ctx);
+    deadline = _time_us() + (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+        ctx->response_timeout.tv_usec;
+
+    for (;;) {
+        struct timeval tv;
+        int64_t wait = deadline - _time_us();
+
+        if (wait <= 0)
+            break;
+        if (wait > gap)
+            wait = gap;
+        tv.tv_sec = wait / 1000000;
+        tv.tv_usec = wait % 1000000;
+
+        rc = ctx->backend->select(ctx, &tv);
+        if (rc == -1) {
+            if (errno == ETIMEDOUT)
+                break;
+            return -1;
+        }
+
+        rc = ctx->backend->recv(ctx, buf, sizeof(buf));
+        if (rc == 0) {
+            errno = ECONNRESET;
+            rc = -1;
+        }
+        if (rc == -1)
+            return -1;
+        dropped += rc;
+    }
+
+    ctx->stats.drains++;
+    ctx->stats.bytes_drained += dropped;
+    if (ctx->debug)
+        printf("Bytes drained (%d)\n", dropped);
+
+    return dropped;
+}
+
+/* Resynchronizes on the line after an error, by draining the garbage with
+   MENDELEEV_ERROR_RECOVERY_DRAIN or else by flushing after the response
+   timeout */
+static void _recover(mendeleev_t *ctx)
+{
+    if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_DRAIN) {
+        mendeleev_drain(ctx);
+    } else {
+        _sleep_response_timeout(ctx);
+        mendeleev_flush(ctx);
+    }
+}
+
+/* Monotonic clock in microseconds, used for request deadlines */
+int64_t _time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Returns TRUE when a response of this slave is expected */
+int _is_inflight_slave(mendeleev_t *ctx, int slave)
+{
+    int i;
+
+    if (ctx->nb_inflight == 0)
+        return FALSE;
+
+    for (i = 0; i < MENDELEEV_MAX_INFLIGHT; i++) {
+        if (ctx->inflight[i].in_use && ctx->inflight[i].slave == slave)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Returns the slot of the request which expires first */
+static int _inflight_first_deadline(mendeleev_t *ctx)
+{
+    int i;
+    int first = -1;
+
+    for (i = 0; i < MENDELEEV_MAX_INFLIGHT; i++) {
+        if (ctx->inflight[i].in_use &&
+            (first == -1 || ctx->inflight[i].deadline < ctx->inflight[first].deadline)) {
+            first = i;
+        }
+    }
+    return first;
+}
+
+/* Returns the slot of the request sent first */
+static int _inflight_oldest(mendeleev_t *ctx)
+{
+    int i;
+    int oldest = -1;
+
+    for (i = 0; i < MENDELEEV_MAX_INFLIGHT; i++) {
+        if (ctx->inflight[i].in_use &&
+            (oldest == -1 || ctx->inflight[i].sent_at < ctx->inflight[oldest].sent_at)) {
+            oldest = i;
+        }
+    }
+    return oldest;
+}
+
+/* Returns the slot of the request which expires first and its expiry in
+   expiry, or -1 when no request is in flight.
+
+   With a first byte timeout, the oldest request also expires when the line
+   stays silent that long after its transmission. The line being half-duplex,
+   a pipelined request is only transmitted after the bytes received before. */
+static int _inflight_next_expiry(mendeleev_t *ctx, int64_t *expiry)
+{
+    int slot = _inflight_first_deadline(ctx);
+    int oldest;
+    const uint8_t *header;
+    int64_t silence;
+
+    if (slot == -1)
+        return -1;
+
+    *expiry = ctx->inflight[slot].deadline;
+    if (ctx->first_byte_timeout.tv_sec == 0 && ctx->first_byte_timeout.tv_usec == 0)
+        return slot;
+
+    oldest = _inflight_oldest(ctx);
+    header = ctx->inflight[oldest].header;
+    silence = ctx->last_byte_at + ctx->backend->wire_time(ctx, MENDELEEV_MSG_OVERHEAD +
+        ((header[MENDELEEV_DATALEN_OFFSET] << 8) | header[MENDELEEV_DATALEN_OFFSET + 1]));
+    if (silence < ctx->tx_end)
+        silence = ctx->tx_end;
+    silence += (int64_t)ctx->first_byte_timeout.tv_sec * 1000000 +
+        ctx->first_byte_timeout.tv_usec;
+
+    if (silence < *expiry) {
+        *expiry = silence;
+        slot = oldest;
+    }
+    return slot;
+}
+
+/* Idle time which ends a frame, or 0 when the frame gap detection is
+   disabled */
+static int64_t _frame_gap(mendeleev_t *ctx)
+{
+    return ctx->frame_gap ? _idle_gap(ctx) : 0;
+}
+
+/* Returns the time of the next call to mendeleev_on_timeout(), -1 when there
+   is nothing to wait for */
+static int64_t _next_wakeup(mendeleev_t *ctx)
+{
+    int64_t wakeup = -1;
+    int64_t gap = _frame_gap(ctx);
+
+    if (_inflight_next_expiry(ctx, &wakeup) == -1)
+        wakeup = -1;
+
+    /* End of a partial frame */
+    if (gap > 0 && _ring_length(&ctx->rx) > 0 &&
+        (wakeup == -1 || ctx->last_byte_at + gap < wakeup))
+        wakeup = ctx->last_byte_at + gap;
+
+    /* Probe of an open breaker, which waits for room in the in-flight table */
+    if (ctx->breaker != NULL && ctx->nb_inflight < ctx->max_inflight) {
+        int64_t probe = _breaker_next_probe(ctx);
+
+        if (probe != -1 && (wakeup == -1 || probe < wakeup))
+            wakeup = probe;
+    }
+
+    return wakeup;
+}
+
+/* Moves the timer of the context in the reactor to its next wakeup */
+void _schedule_wakeup(mendeleev_t *ctx)
+{
+    if (ctx->reactor != NULL)
+        _reactor_schedule(ctx->reactor, ctx, _next_wakeup(ctx));
+}
+
+/* Registers a sent request in the in-flight table and returns its slot */
+static int _inflight_add(mendeleev_t *ctx, const uint8_t *req,
+                         mendeleev_completion_cb callback, void *user_data)
+{
+    int i;
+    mendeleev_request_t *request;
+    int64_t timeout = (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+        ctx->response_timeout.tv_usec;
+
+    if (ctx->nb_inflight >= ctx->max_inflight) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    for (i = 0; i < MENDELEEV_MAX_INFLIGHT; i++) {
+        if (!ctx->inflight[i].in_use)
+            break;
+    }
+
+    request = &ctx->inflight[i];
+    request->in_use = TRUE;
+    request->slave = req[MENDELEEV_DEST_OFFSET];
+    request->seqnr = (req[MENDELEEV_SEQNR_OFFSET] << 8) | req[MENDELEEV_SEQNR_OFFSET + 1];
+    memcpy(request->header, req, MENDELEEV_DATA_OFFSET);
+    request->sent_at = ctx->tx_end;
+    request->started_at = _time_us();
+    if (ctx->attempt_timeout > 0)
+        request->deadline = _time_us() + ctx->attempt_timeout;
+    else if (ctx->rtt != NULL)
+        request->deadline = _rtt_deadline(ctx, request);
+    else
+        request->deadline = _time_us() + timeout;
+    if (ctx->attempt_deadline > 0 && request->deadline > ctx->attempt_deadline)
+        request->deadline = ctx->attempt_deadline;
+    request->callback = callback;
+    request->user_data = user_data;
+    ctx->nb_inflight++;
+
+    _schedule_wakeup(ctx);
+
+    return i;
+}
+
+static void _inflight_remove(mendeleev_t *ctx, int slot)
+{
+    if (ctx->inflight[slot].in_use) {
+        ctx->inflight[slot].in_use = FALSE;
+        ctx->nb_inflight--;
+    }
+}
+
+void _inflight_clear(mendeleev_t *ctx)
+{
+    int i;
+
+    for (i = 0; i < MENDELEEV_MAX_INFLIGHT; i++)
+        _inflight_remove(ctx, i);
+}
+
+/* Finds the request answered by rsp, -1 for a late or duplicate response */
+static int _inflight_match(mendeleev_t *ctx, const uint8_t *rsp)
+{
+    int i;
+    int slave = rsp[MENDELEEV_SRC_OFFSET];
+    uint16_t seqnr = (rsp[MENDELEEV_SEQNR_OFFSET] << 8) | rsp[MENDELEEV_SEQNR_OFFSET + 1];
+
+    for (i = 0; i < MENDELEEV_MAX_INFLIGHT; i++) {
+        mendeleev_request_t *request = &ctx->inflight[i];
+        if (request->in_use && request->slave == slave && request->seqnr == seqnr)
+            return i;
+    }
+
+    if (_is_inflight_slave(ctx, slave))
+        ctx->stats.bad_seqnr++;
+    else
+        ctx->stats.late_responses++;
+    return -1;
+}
+
 /* Computes the length of the expected response */
 static unsigned int compute_response_length_from_request(mendeleev_t *ctx, uint8_t *req)
 {
@@ -119,11 +612,14 @@ static unsigned int compute_response_length_from_request(mendeleev_t *ctx, uint8
     case MENDELEEV_CMD_SET_COLOR:
     case MENDELEEV_CMD_SET_MODE:
     case MENDELEEV_CMD_SET_OUTPUT:
-    case MENDELEEV_CMD_OTA:
     case MENDELEEV_CMD_REBOOT:
+    case MENDELEEV_CMD_SET_COLOR_TABLE:
+    case MENDELEEV_CMD_SET_GROUP:
         length = 0;
         break;
     case MENDELEEV_CMD_GET_VERSION:
+    case MENDELEEV_CMD_OTA:
+        /* The length of an OTA response depends on its operation */
         return MSG_LENGTH_UNDEFINED;
     default:
         /* we do not expect any data in the response */
@@ -133,25 +629,48 @@ static unsigned int compute_response_length_from_request(mendeleev_t *ctx, uint8
     return MENDELEEV_DATA_OFFSET + length + MENDELEEV_CHECKSUM_LENGTH;
 }
 
-/* Sends a request/response */
-static int send_msg(mendeleev_t *ctx, uint8_t *msg, int msg_length)
+/* Sends a message made of the iov parts */
+static int _send_iov(mendeleev_t *ctx, const struct iovec *iov, int iovcnt)
 {
     int rc;
     int i;
+    int msg_length = 0;
+    int attempts = 0;
+    int max_attempts = _LINK_MAX_ATTEMPTS;
 
-    // Adds CRC
-    msg_length = ctx->backend->send_msg_pre(msg, msg_length);
+    for (i = 0; i < iovcnt; i++)
+        msg_length += iov[i].iov_len;
+
+    if (iov[0].iov_len > MENDELEEV_CMD_OFFSET)
+        max_attempts = _retry_send_attempts(ctx, ((const uint8_t *)iov[0].iov_base)[MENDELEEV_CMD_OFFSET]);
 
     if (ctx->debug) {
-        for (i = 0; i < msg_length; i++)
-            printf("[%.2X]", msg[i]);
+        for (i = 0; i < iovcnt; i++) {
+            size_t j;
+            for (j = 0; j < iov[i].iov_len; j++)
+                printf("[%.2X]", ((const uint8_t *)iov[i].iov_base)[j]);
+        }
         printf("\n");
     }
 
     /* In recovery mode, the write command will be issued until to be
-       successful! Disabled by default. */
+       successful, as many times as the attempts of the retry policy of the
+       command at most. Disabled by default. */
     do {
-        rc = ctx->backend->send(ctx, msg, msg_length);
+        rc = ctx->backend->sendv(ctx, iov, iovcnt);
+        if (rc > 0) {
+            int64_t now = _time_us();
+
+            ctx->stats.bytes_sent += rc;
+            if (ctx->tx_end < now)
+                ctx->tx_end = now;
+            ctx->tx_end += ctx->backend->wire_time(ctx, rc);
+        }
+        if (rc != -1 && rc != msg_length) {
+            /* Short write, the frame is incomplete on the line */
+            errno = EMBBADDATA;
+            rc = -1;
+        }
         if (rc == -1) {
             _error_print(ctx, NULL);
             if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_LINK) {
@@ -162,20 +681,41 @@ static int send_msg(mendeleev_t *ctx, uint8_t *msg, int msg_length)
                     _sleep_response_timeout(ctx);
                     mendeleev_connect(ctx);
                 } else {
-                    _sleep_response_timeout(ctx);
-                    mendeleev_flush(ctx);
+                    _recover(ctx);
                 }
                 errno = saved_errno;
             }
         }
     } while ((ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_LINK) &&
-             rc == -1);
+             rc == -1 && ++attempts < max_attempts);
 
-    if (rc > 0 && rc != msg_length) {
-        errno = EMBBADDATA;
-        return -1;
-    }
+    return rc;
+}
 
+/* Sends a request made of a header and a payload. The CRC is computed over
+   both and the payload is sent in place, without being copied. */
+static int send_msg_payload(mendeleev_t *ctx, uint8_t *header, int header_length,
+                            const uint8_t *data, int data_length)
+{
+    int rc;
+    int iovcnt = 0;
+    struct iovec iov[3];
+    uint8_t trailer[MENDELEEV_CHECKSUM_LENGTH];
+
+    iov[iovcnt].iov_base = header;
+    iov[iovcnt++].iov_len = header_length;
+    if (data_length > 0) {
+        iov[iovcnt].iov_base = (void *)data;
+        iov[iovcnt++].iov_len = data_length;
+    }
+    iov[iovcnt].iov_base = trailer;
+    iov[iovcnt++].iov_len = ctx->backend->send_msg_trailer(header, header_length,
+                                                           data, data_length,
+                                                           trailer);
+
+    rc = _send_iov(ctx, iov, iovcnt);
+    if (rc != -1)
+        ctx->stats.frames_sent++;
     return rc;
 }
 
@@ -198,40 +738,87 @@ static int send_msg(mendeleev_t *ctx, uint8_t *msg, int msg_length)
    - read() or recv() error codes
 */
 
-int _receive_msg(mendeleev_t *ctx, uint8_t *msg)
+static int _receive_frame(mendeleev_t *ctx, uint8_t *msg,
+                          const struct timeval *response_timeout)
 {
     int rc;
-    fd_set rset;
     struct timeval tv;
-    struct timeval *p_tv;
-    uint16_t length_to_read;
-    int msg_length = 0;
-    uint16_t datalen;
+    int64_t deadline;
+    int64_t gap = _frame_gap(ctx);
+    int byte_timeout_set = (ctx->byte_timeout.tv_sec > 0 ||
+                            ctx->byte_timeout.tv_usec > 0);
 
     if (ctx->debug) {
         printf("Waiting for a confirmation...\n");
     }
 
-    /* Add a file descriptor to the set */
-    FD_ZERO(&rset);
-    FD_SET(ctx->s, &rset);
-
-    length_to_read = MENDELEEV_DATA_OFFSET;
+    deadline = _time_us() + (int64_t)response_timeout->tv_sec * 1000000 +
+        response_timeout->tv_usec;
+
+    /* Bytes left over by the previous read are parsed before any syscall */
+    while ((rc = _ring_extract_frame(ctx, msg)) == 0) {
+        int in_gap = FALSE;
+
+        if (_ring_length(&ctx->rx) > 0 && gap > 0 &&
+            (!byte_timeout_set ||
+             gap < (int64_t)ctx->byte_timeout.tv_sec * 1000000 + ctx->byte_timeout.tv_usec)) {
+            /* The frame ends when the line is idle for the frame gap */
+            tv.tv_sec = gap / 1000000;
+            tv.tv_usec = gap % 1000000;
+            in_gap = TRUE;
+        } else if (_ring_length(&ctx->rx) > 0 && byte_timeout_set) {
+            /* If there is no character in the buffer, the allowed timeout
+               interval between two consecutive bytes is defined by
+               byte_timeout */
+            tv.tv_sec = ctx->byte_timeout.tv_sec;
+            tv.tv_usec = ctx->byte_timeout.tv_usec;
+        } else {
+            /* The full response must be read before expiration of response
+               timeout */
+            int64_t remaining = deadline - _time_us();
+
+            if (remaining < 0)
+                remaining = 0;
+            tv.tv_sec = remaining / 1000000;
+            tv.tv_usec = remaining % 1000000;
+        }
 
-    tv.tv_sec = ctx->response_timeout.tv_sec;
-    tv.tv_usec = ctx->response_timeout.tv_usec;
-    p_tv = &tv;
+        /* The attempt of a retried command doesn't last past its deadline,
+           even while a frame is being received */
+        if (ctx->attempt_deadline > 0) {
+            int64_t remaining = ctx->attempt_deadline - _time_us();
+
+            if (remaining < 0)
+                remaining = 0;
+            if (remaining < (int64_t)tv.tv_sec * 1000000 + tv.tv_usec) {
+                tv.tv_sec = remaining / 1000000;
+                tv.tv_usec = remaining % 1000000;
+                in_gap = FALSE;
+            }
+        }
 
-    while (length_to_read != 0) {
-        rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
+        rc = ctx->backend->select(ctx, &tv);
+        if (rc == -1 && errno == ETIMEDOUT && in_gap) {
+            /* The partial frame is over, the response may still come */
+            if (ctx->debug) {
+                fprintf(stderr, "Frame gap, %u bytes dropped\n",
+                        _ring_length(&ctx->rx));
+            }
+            ctx->stats.frame_gaps++;
+            _ring_reset(&ctx->rx);
+            continue;
+        }
         if (rc == -1) {
             _error_print(ctx, "select");
+            if (errno == ETIMEDOUT) {
+                /* The partial frame can't be completed anymore */
+                _ring_reset(&ctx->rx);
+            }
             if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_LINK) {
                 int saved_errno = errno;
 
                 if (errno == ETIMEDOUT) {
-                    _sleep_response_timeout(ctx);
-                    mendeleev_flush(ctx);
+                    _recover(ctx);
                 } else if (errno == EBADF) {
                     mendeleev_close(ctx);
                     mendeleev_connect(ctx);
@@ -241,7 +828,9 @@ int _receive_msg(mendeleev_t *ctx, uint8_t *msg)
             return -1;
         }
 
-        rc = ctx->backend->recv(ctx, msg + msg_length, length_to_read);
+        /* Reads everything available, the bytes past the end of the frame
+           are kept for the next one */
+        rc = _ring_fill(ctx);
         if (rc == 0) {
             errno = ECONNRESET;
             rc = -1;
@@ -260,43 +849,17 @@ int _receive_msg(mendeleev_t *ctx, uint8_t *msg)
             }
             return -1;
         }
-
-        /* Display the hex code of each character received */
-        if (ctx->debug) {
-            int i;
-            for (i=0; i < rc; i++)
-                printf("<%.2X>", msg[msg_length + i]);
-        }
-
-        /* Sums bytes received */
-        msg_length += rc;
-        /* Computes remaining bytes */
-        length_to_read -= rc;
-
-        if (length_to_read == 0) {
-            datalen = ((msg[MENDELEEV_DATALEN_OFFSET] << 8) | msg[MENDELEEV_DATALEN_OFFSET + 1]);
-            if (msg_length < (MENDELEEV_DATA_OFFSET + datalen + MENDELEEV_CHECKSUM_LENGTH)) {
-                length_to_read = datalen + MENDELEEV_CHECKSUM_LENGTH;
-            }
-        }
-
-        if (length_to_read > 0 &&
-            (ctx->byte_timeout.tv_sec > 0 || ctx->byte_timeout.tv_usec > 0)) {
-            /* If there is no character in the buffer, the allowed timeout
-               interval between two consecutive bytes is defined by
-               byte_timeout */
-            tv.tv_sec = ctx->byte_timeout.tv_sec;
-            tv.tv_usec = ctx->byte_timeout.tv_usec;
-            p_tv = &tv;
-        }
-        /* else timeout isn't set again, the full response must be read before
-           expiration of response timeout (for CONFIRMATION only) */
     }
 
     if (ctx->debug)
         printf("\n");
 
-    return ctx->backend->check_integrity(ctx, msg, msg_length);
+    return rc;
+}
+
+int _receive_msg(mendeleev_t *ctx, uint8_t *msg)
+{
+    return _receive_frame(ctx, msg, &ctx->response_timeout);
 }
 
 /* Receive the request from a modbus master */
@@ -340,8 +903,7 @@ static int check_confirmation(mendeleev_t *ctx, uint8_t *req,
         rc = ctx->backend->pre_check_confirmation(ctx, req, rsp, rsp_length);
         if (rc == -1) {
             if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                mendeleev_flush(ctx);
+                _recover(ctx);
             }
             return -1;
         }
@@ -351,6 +913,7 @@ static int check_confirmation(mendeleev_t *ctx, uint8_t *req,
 
     /* If the command is one's complement */
     if (function >= 0x80) {
+        ctx->stats.exceptions++;
         if ((rsp_length == (MENDELEEV_DATA_OFFSET + MENDELEEV_CHECKSUM_LENGTH)) && (req[MENDELEEV_CMD_OFFSET] == (uint8_t)(~function))) {
             /* Valid exception code received */
             errno = MENDELEEV_ENOBASE + MENDELEEV_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
@@ -379,8 +942,7 @@ static int check_confirmation(mendeleev_t *ctx, uint8_t *req,
                         function, req[MENDELEEV_CMD_OFFSET]);
             }
             if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                mendeleev_flush(ctx);
+                _recover(ctx);
             }
             errno = EMBBADDATA;
             return -1;
@@ -393,8 +955,7 @@ static int check_confirmation(mendeleev_t *ctx, uint8_t *req,
                         rsp_sequence_number, req_sequence_number);
             }
             if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_PROTOCOL) {
-                _sleep_response_timeout(ctx);
-                mendeleev_flush(ctx);
+                _recover(ctx);
             }
             errno = EMBBADDATA;
             return -1;
@@ -408,6 +969,8 @@ static int check_confirmation(mendeleev_t *ctx, uint8_t *req,
         case MENDELEEV_CMD_GET_VERSION:
         case MENDELEEV_CMD_SET_OUTPUT:
         case MENDELEEV_CMD_REBOOT:
+        case MENDELEEV_CMD_SET_COLOR_TABLE:
+        case MENDELEEV_CMD_SET_GROUP:
         default:
             rc = 1;
         }
@@ -418,8 +981,7 @@ static int check_confirmation(mendeleev_t *ctx, uint8_t *req,
                     rsp_length, rsp_length_computed);
         }
         if (ctx->error_recovery & MENDELEEV_ERROR_RECOVERY_PROTOCOL) {
-            _sleep_response_timeout(ctx);
-            mendeleev_flush(ctx);
+            _recover(ctx);
         }
         errno = EMBBADDATA;
         rc = -1;
@@ -429,51 +991,808 @@ static int check_confirmation(mendeleev_t *ctx, uint8_t *req,
 }
 
 
-int mendeleev_send_command(mendeleev_t *ctx, uint8_t command, uint8_t *data, uint16_t data_length, uint8_t *rsp_buf, uint16_t *rsp_length)
+/* Builds the header of a request, up to the data length, for the current
+   slave */
+static int _build_request_header(mendeleev_t *ctx, uint8_t command,
+                                 uint16_t data_length, uint8_t *req)
 {
-    int rc;
     int req_length;
-    uint8_t req[MAX_MESSAGE_LENGTH];
 
-    if (data_length > (MAX_MESSAGE_LENGTH - MENDELEEV_MSG_OVERHEAD)) {
-        errno = EINVAL;
+    req_length = ctx->backend->build_request_basis(ctx, command, req);
+    req[req_length++] = data_length >> 8;
+    req[req_length++] = data_length & 0x00FF;
+
+    return req_length;
+}
+
+/* Checks the response rsp (NULL on timeout) of the request in slot, releases
+   the slot and runs the completion callback of the request. Returns the result
+   of check_confirmation(). */
+static int _inflight_complete(mendeleev_t *ctx, int slot, uint8_t *rsp, int rsp_length)
+{
+    int rc;
+    mendeleev_request_t request = ctx->inflight[slot];
+
+    _inflight_remove(ctx, slot);
+
+    if (ctx->rtt != NULL)
+        _rtt_update(ctx, &request, rsp, rsp_length);
+    if (ctx->breaker != NULL)
+        _breaker_update(ctx, request.slave, rsp == NULL);
+
+    if (rsp == NULL) {
+        ctx->stats.timeouts++;
+        errno = ETIMEDOUT;
+        _error_print(ctx, "response");
+        rc = -1;
+    } else {
+        _stats_record_latency(ctx, request.slave, request.header[MENDELEEV_CMD_OFFSET],
+                              _time_us() - request.started_at);
+        rc = check_confirmation(ctx, request.header, rsp, rsp_length);
+    }
+
+    if (request.callback != NULL) {
+        int saved_errno = errno;
+        mendeleev_completion_t completion;
+
+        completion.slave = request.slave;
+        completion.seqnr = request.seqnr;
+        completion.command = request.header[MENDELEEV_CMD_OFFSET];
+        completion.rc = rc;
+        completion.error = (rc == -1) ? saved_errno : 0;
+        if (rc != -1) {
+            completion.data = rsp + MENDELEEV_DATA_OFFSET;
+            completion.data_length = (rsp[MENDELEEV_DATALEN_OFFSET] << 8) | rsp[MENDELEEV_DATALEN_OFFSET + 1];
+        } else {
+            completion.data = NULL;
+            completion.data_length = 0;
+        }
+        request.callback(ctx, &completion, request.user_data);
+        errno = saved_errno;
+    }
+
+    return rc;
+}
+
+static int _send_request(mendeleev_t *ctx, uint8_t command, const uint8_t *data,
+                         uint16_t data_length, mendeleev_completion_cb callback,
+                         void *user_data)
+{
+    int rc;
+    int req_length;
+    uint16_t seqnr;
+    uint8_t req[MENDELEEV_DATA_OFFSET];
+
+    /* Don't send anything when the response could not be tracked */
+    if (!MENDELEEV_IS_MULTICAST_ADDRESS(ctx->slave) &&
+        ctx->nb_inflight >= ctx->max_inflight) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (ctx->breaker != NULL && !MENDELEEV_IS_MULTICAST_ADDRESS(ctx->slave) &&
+        _breaker_check(ctx, ctx->slave) == -1)
+        return -1;
+
+    req_length = _build_request_header(ctx, command, data_length, req);
+    seqnr = (req[MENDELEEV_SEQNR_OFFSET] << 8) | req[MENDELEEV_SEQNR_OFFSET + 1];
+
+    rc = send_msg_payload(ctx, req, req_length, data, data_length);
+    if (rc == -1)
+        return -1;
+
+    /* Suppress any responses when the request was a broadcast or a group
+       request */
+    if (!MENDELEEV_IS_MULTICAST_ADDRESS(ctx->slave)) {
+        if (_inflight_add(ctx, req, callback, user_data) == -1)
+            return -1;
+    }
+
+    return seqnr;
+}
+
+/* Sends a GET_VERSION request to probe slave, whose breaker is open */
+static int _send_probe(mendeleev_t *ctx, int slave)
+{
+    int rc;
+    int saved_slave = ctx->slave;
+
+    ctx->slave = slave;
+    _breaker_probe_start(ctx, slave);
+    rc = _send_request(ctx, MENDELEEV_CMD_GET_VERSION, NULL, 0, NULL, NULL);
+    _breaker_probe_end(ctx, slave, rc);
+    ctx->slave = saved_slave;
+
+    return rc;
+}
+
+/* Sends the due probes while the in-flight table has room */
+static void _send_probes(mendeleev_t *ctx)
+{
+    int slave;
+
+    if (ctx->breaker == NULL)
+        return;
+
+    while (ctx->nb_inflight < ctx->max_inflight &&
+           (slave = _breaker_next_due(ctx, _time_us())) != -1) {
+        if (_send_probe(ctx, slave) == -1)
+            break;
+    }
+}
+
+/* Builds and sends a request to the current slave. Unless the request is a
+   broadcast, it is registered in the in-flight table to wait for its response.
+   Returns the sequence number of the request or -1 if an error occurred. */
+int mendeleev_send_request(mendeleev_t *ctx, uint8_t command, uint8_t *data, uint16_t data_length)
+{
+    if (ctx == NULL || data_length > (MAX_MESSAGE_LENGTH - MENDELEEV_MSG_OVERHEAD)) {
+        errno = EINVAL;
         return -1;
     }
 
+    return _send_request(ctx, command, data, data_length, NULL, NULL);
+}
+
+/* Waits for the response of any request in flight.
+
+   The slave and the sequence number of the answered request are stored in
+   slave and seqnr (when not NULL), also when the request failed. Responses
+   which don't match a request in flight (late or duplicate responses) are
+   dropped. When no response arrived before the deadline of the oldest request,
+   this request is removed from the table and errno is set to ETIMEDOUT. */
+int mendeleev_receive_response(mendeleev_t *ctx, int *slave, uint16_t *seqnr,
+                               uint8_t *rsp_buf, uint16_t *rsp_length)
+{
+    int rc;
+    int slot;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
     if (ctx == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    req_length = ctx->backend->build_request_basis(ctx, command, req);
-    req[req_length++] = data_length >> 8;
-    req[req_length++] = data_length & 0x00FF;
-    memcpy(req + req_length, data, data_length);
-    req_length += data_length;
+    if (slave != NULL)
+        *slave = -1;
 
-    /* Suppress any responses when the request was a broadcast */
-    rc = send_msg(ctx, req, req_length);
-    if ((ctx->slave != MENDELEEV_BROADCAST_ADDRESS) && rc > 0) {
-        uint8_t rsp[MAX_MESSAGE_LENGTH];
+    for (;;) {
+        int64_t expiry;
+        int64_t remaining;
+        struct timeval tv;
 
-        rc = _receive_msg(ctx, rsp);
-        if (rc == -1)
+        slot = _inflight_next_expiry(ctx, &expiry);
+        if (slot == -1) {
+            /* Nothing to wait for */
+            errno = EINVAL;
+            return -1;
+        }
+
+        remaining = expiry - _time_us();
+        if (remaining <= 0) {
+            if (slave != NULL)
+                *slave = ctx->inflight[slot].slave;
+            if (seqnr != NULL)
+                *seqnr = ctx->inflight[slot].seqnr;
+            return _inflight_complete(ctx, slot, NULL, 0);
+        }
+
+        tv.tv_sec = remaining / 1000000;
+        tv.tv_usec = remaining % 1000000;
+        rc = _receive_frame(ctx, rsp, &tv);
+        if (rc == -1) {
+            if (errno == ETIMEDOUT)
+                continue;
+            return -1;
+        }
+
+        slot = _inflight_match(ctx, rsp);
+        if (slot == -1) {
+            if (ctx->debug) {
+                fprintf(stderr, "Late or duplicate response of slave %d dropped\n",
+                        rsp[MENDELEEV_SRC_OFFSET]);
+            }
+            continue;
+        }
+        break;
+    }
+
+    if (slave != NULL)
+        *slave = ctx->inflight[slot].slave;
+    if (seqnr != NULL)
+        *seqnr = ctx->inflight[slot].seqnr;
+
+    rc = _inflight_complete(ctx, slot, rsp, rc);
+    if (rc == -1)
+        return -1;
+
+    uint16_t datalen = ((rsp[MENDELEEV_DATALEN_OFFSET] << 8) | rsp[MENDELEEV_DATALEN_OFFSET + 1]);
+    if (datalen > 0 && rsp_buf != NULL) {
+        memcpy(rsp_buf, rsp + MENDELEEV_DATA_OFFSET, datalen);
+    }
+    if (rsp_length != NULL) {
+        *rsp_length = datalen;
+    }
+
+    return rc;
+}
+
+static int _send_command(mendeleev_t *ctx, uint8_t command, uint8_t *data, uint16_t data_length, uint8_t *rsp_buf, uint16_t *rsp_length)
+{
+    int rc;
+    int req_length;
+    uint8_t req[MENDELEEV_DATA_OFFSET];
+
+    if (data_length > (MAX_MESSAGE_LENGTH - MENDELEEV_MSG_OVERHEAD)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The response of a pipelined request would be consumed here */
+    if (ctx->nb_inflight > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (ctx->breaker != NULL && !MENDELEEV_IS_MULTICAST_ADDRESS(ctx->slave) &&
+        _breaker_check(ctx, ctx->slave) == -1) {
+        /* The command is sent when the slave answers its probe */
+        if (!_breaker_is_due(ctx, ctx->slave, _time_us()) ||
+            _send_probe(ctx, ctx->slave) == -1)
             return -1;
+        rc = mendeleev_receive_response(ctx, NULL, NULL, NULL, NULL);
+        if (ctx->nb_inflight > 0)
+            _inflight_clear(ctx);
+        if (_breaker_check(ctx, ctx->slave) == -1)
+            return -1;
+    }
 
-        rc = check_confirmation(ctx, req, rsp, rc);
+    if (!MENDELEEV_IS_MULTICAST_ADDRESS(ctx->slave)) {
+        rc = mendeleev_send_request(ctx, command, data, data_length);
         if (rc == -1)
             return -1;
 
-        uint16_t datalen = ((rsp[MENDELEEV_DATALEN_OFFSET] << 8) | rsp[MENDELEEV_DATALEN_OFFSET + 1]);
-        if (datalen > 0 && rsp != NULL) {
-            memcpy(rsp_buf, rsp + MENDELEEV_DATA_OFFSET, datalen);
+        /* Responses to earlier requests which timed out are dropped */
+        rc = mendeleev_receive_response(ctx, NULL, NULL, rsp_buf, rsp_length);
+        if (rc == -1 && ctx->nb_inflight > 0) {
+            /* The request is still in flight after a receive error (bad CRC,
+               read error), it must not block the next command */
+            int saved_errno = errno;
+            _inflight_clear(ctx);
+            errno = saved_errno;
         }
-        if (rsp_length != NULL) {
-            *rsp_length = datalen;
+        return rc;
+    }
+
+    req_length = _build_request_header(ctx, command, data_length, req);
+
+    /* Suppress any responses when the request was a broadcast or a group
+       request */
+    return send_msg_payload(ctx, req, req_length, data, data_length);
+}
+
+/* Sends a command to the current slave and waits for its response, unless it
+   is a broadcast or a group request. The command is attempted again
+   according to its retry policy, see mendeleev_set_retry_policy(). */
+int mendeleev_send_command(mendeleev_t *ctx, uint8_t command, uint8_t *data, uint16_t data_length, uint8_t *rsp_buf, uint16_t *rsp_length)
+{
+    int rc;
+    int attempt;
+    int64_t deadline = 0;
+    const mendeleev_retry_policy_t *policy;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    policy = _retry_policy(ctx, command);
+    if (policy == NULL || MENDELEEV_IS_MULTICAST_ADDRESS(ctx->slave))
+        return _send_command(ctx, command, data, data_length, rsp_buf, rsp_length);
+
+    if (policy->total_timeout_usec > 0)
+        deadline = _time_us() + policy->total_timeout_usec;
+
+    for (attempt = 1;; attempt++) {
+        int saved_errno;
+        int64_t delay;
+
+        ctx->attempt_timeout = policy->attempt_timeout_usec;
+        ctx->attempt_deadline = deadline;
+        if (policy->attempt_timeout_usec > 0) {
+            int64_t end = _time_us() + policy->attempt_timeout_usec;
+
+            if (deadline == 0 || end < deadline)
+                ctx->attempt_deadline = end;
+        }
+        rc = _send_command(ctx, command, data, data_length, rsp_buf, rsp_length);
+        ctx->attempt_timeout = 0;
+        ctx->attempt_deadline = 0;
+
+        if (rc != -1 || attempt >= policy->max_attempts ||
+            !_retry_is_retryable(policy, errno))
+            return rc;
+
+        delay = _retry_backoff(policy, attempt);
+        if (deadline > 0 && _time_us() + delay >= deadline)
+            return -1;
+
+        saved_errno = errno;
+        if (ctx->debug) {
+            fprintf(stderr, "Attempt %d of command %d failed (%s), retry in %d us\n",
+                    attempt, command, mendeleev_strerror(saved_errno), (int)delay);
         }
+        _sleep_us(delay);
+        ctx->stats.retries++;
+        errno = saved_errno;
     }
+}
 
-    return rc;
+/* Assigns the current slave to the groups of the bit mask, bit n standing for
+   MENDELEEV_GROUP_ADDRESS(n). A mask of 0 removes the slave from all groups. */
+int mendeleev_set_group(mendeleev_t *ctx, uint16_t groups)
+{
+    uint8_t data[2];
+
+    if (ctx == NULL || ctx->slave == -1 || MENDELEEV_IS_MULTICAST_ADDRESS(ctx->slave) ||
+        groups >= (1 << MENDELEEV_MAX_GROUPS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    data[0] = groups >> 8;
+    data[1] = groups & 0x00FF;
+    return mendeleev_send_command(ctx, MENDELEEV_CMD_SET_GROUP, data, sizeof(data),
+                                  NULL, NULL);
+}
+
+/* Sends many commands with as few writes as possible.
+
+   The frames of consecutive commands which expect no response (broadcasts,
+   group requests and commands flagged MENDELEEV_BATCH_NO_RESPONSE) are serialized into one buffer
+   and sent with a single write, and a single RTS assertion. A command which
+   expects a response ends the write, and its response is collected before the
+   next frames are sent so that the slave can answer on a free line.
+
+   Returns the number of successful commands, the result of each command is
+   stored in it, or -1 if the batch couldn't be sent at all. */
+int mendeleev_send_batch(mendeleev_t *ctx, mendeleev_cmd_t *cmds, int nb)
+{
+    int i;
+    int rc;
+    int first;
+    int saved_slave;
+    int succeeded = 0;
+    size_t buffer_size = 0;
+    uint8_t *buffer;
+
+    if (ctx == NULL || cmds == NULL || nb < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The response of a pipelined request would be consumed here */
+    if (ctx->nb_inflight > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    for (i = 0; i < nb; i++) {
+        cmds[i].rc = -1;
+        cmds[i].error = 0;
+        cmds[i].rsp_length = 0;
+        buffer_size += MENDELEEV_MSG_OVERHEAD + cmds[i].data_length;
+    }
+
+    buffer = (uint8_t *)malloc(buffer_size);
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    saved_slave = ctx->slave;
+    first = 0;
+    while (first < nb) {
+        int last;
+        int with_response = FALSE;
+        int length = 0;
+        int last_offset = 0;
+        int nb_frames = 0;
+        struct iovec iov;
+
+        /* Serializes the frames up to the first one expecting a response */
+        for (last = first; last < nb; last++) {
+            mendeleev_cmd_t *cmd = &cmds[last];
+            int frame_length;
+
+            if (cmd->slave < 1 || cmd->slave > 255 ||
+                cmd->data_length > (MAX_MESSAGE_LENGTH - MENDELEEV_MSG_OVERHEAD)) {
+                cmd->error = EINVAL;
+                continue;
+            }
+
+            if (ctx->breaker != NULL && !MENDELEEV_IS_MULTICAST_ADDRESS(cmd->slave) &&
+                _breaker_check(ctx, cmd->slave) == -1) {
+                cmd->error = errno;
+                continue;
+            }
+
+            ctx->slave = cmd->slave;
+            frame_length = _build_request_header(ctx, cmd->command, cmd->data_length,
+                                                 buffer + length);
+            if (cmd->data_length > 0)
+                memcpy(buffer + length + frame_length, cmd->data, cmd->data_length);
+            frame_length = ctx->backend->send_msg_pre(buffer + length,
+                                                      frame_length + cmd->data_length);
+            last_offset = length;
+            length += frame_length;
+            nb_frames++;
+
+            if (!MENDELEEV_IS_MULTICAST_ADDRESS(cmd->slave) &&
+                !(cmd->flags & MENDELEEV_BATCH_NO_RESPONSE)) {
+                with_response = TRUE;
+                break;
+            }
+        }
+        if (last == nb)
+            last--;
+
+        if (with_response && ctx->nb_inflight >= ctx->max_inflight) {
+            /* Without a slot, the response couldn't be matched, e.g. after
+               a mendeleev_submit() from a breaker callback */
+            errno = EBUSY;
+            rc = -1;
+        } else if (length > 0) {
+            iov.iov_base = buffer;
+            iov.iov_len = length;
+            rc = _send_iov(ctx, &iov, 1);
+            if (rc != -1)
+                ctx->stats.frames_sent += nb_frames;
+        } else {
+            rc = 0;
+        }
+        if (rc == -1) {
+            int saved_errno = errno;
+
+            for (i = first; i <= last; i++) {
+                if (cmds[i].error == 0)
+                    cmds[i].error = saved_errno;
+            }
+            ctx->slave = saved_slave;
+            free(buffer);
+            errno = saved_errno;
+            return -1;
+        }
+
+        for (i = first; i <= last; i++) {
+            if (cmds[i].error == 0 && (i != last || !with_response)) {
+                cmds[i].rc = 1;
+                succeeded++;
+            }
+        }
+
+        if (with_response) {
+            mendeleev_cmd_t *cmd = &cmds[last];
+
+            if (_inflight_add(ctx, buffer + last_offset, NULL, NULL) == -1)
+                rc = -1;
+            else
+                rc = mendeleev_receive_response(ctx, NULL, NULL, cmd->rsp_buf,
+                                                &cmd->rsp_length);
+            if (rc == -1) {
+                cmd->error = errno;
+                /* A request still in flight after a receive error can't be
+                   answered anymore */
+                _inflight_clear(ctx);
+            } else {
+                cmd->rc = rc;
+                succeeded++;
+            }
+        }
+
+        first = last + 1;
+    }
+
+    ctx->slave = saved_slave;
+    free(buffer);
+
+    return succeeded;
+}
+
+/* Sends the submitted requests while there is room in the in-flight table */
+static void _send_pending(mendeleev_t *ctx)
+{
+    mendeleev_pending_t *pending;
+
+    _send_probes(ctx);
+
+    while ((pending = ctx->pending_head) != NULL) {
+        int rc;
+        int saved_slave;
+
+        if (!MENDELEEV_IS_MULTICAST_ADDRESS(pending->slave) &&
+            ctx->nb_inflight >= ctx->max_inflight)
+            break;
+
+        ctx->pending_head = pending->next;
+        if (ctx->pending_head == NULL)
+            ctx->pending_tail = NULL;
+
+        saved_slave = ctx->slave;
+        ctx->slave = pending->slave;
+        rc = _send_request(ctx, pending->command, pending->data,
+                           pending->data_length, pending->callback,
+                           pending->user_data);
+        ctx->slave = saved_slave;
+
+        /* Broadcasts, group and failed requests are completed right away */
+        if ((rc == -1 || MENDELEEV_IS_MULTICAST_ADDRESS(pending->slave)) &&
+            pending->callback != NULL) {
+            int saved_errno = errno;
+            mendeleev_completion_t completion;
+
+            completion.slave = pending->slave;
+            completion.seqnr = (rc == -1) ? 0 : rc;
+            completion.command = pending->command;
+            completion.rc = (rc == -1) ? -1 : 1;
+            completion.error = (rc == -1) ? saved_errno : 0;
+            completion.data = NULL;
+            completion.data_length = 0;
+            pending->callback(ctx, &completion, pending->user_data);
+            errno = saved_errno;
+        }
+        free(pending);
+    }
+}
+
+static void _pending_clear(mendeleev_t *ctx)
+{
+    mendeleev_pending_t *pending;
+
+    while ((pending = ctx->pending_head) != NULL) {
+        ctx->pending_head = pending->next;
+        free(pending);
+    }
+    ctx->pending_tail = NULL;
+}
+
+/* Completes the requests in flight and the submitted ones with error, when
+   the descriptor of the context is lost */
+void _requests_abort(mendeleev_t *ctx, int error)
+{
+    int i;
+    mendeleev_pending_t *pending;
+    mendeleev_completion_t completion;
+
+    memset(&completion, 0, sizeof(completion));
+    completion.rc = -1;
+    completion.error = error;
+
+    for (i = 0; i < MENDELEEV_MAX_INFLIGHT; i++) {
+        mendeleev_request_t request = ctx->inflight[i];
+
+        if (!request.in_use)
+            continue;
+        _inflight_remove(ctx, i);
+        if (request.callback != NULL) {
+            completion.slave = request.slave;
+            completion.seqnr = request.seqnr;
+            completion.command = request.header[MENDELEEV_CMD_OFFSET];
+            request.callback(ctx, &completion, request.user_data);
+        }
+    }
+
+    while ((pending = ctx->pending_head) != NULL) {
+        ctx->pending_head = pending->next;
+        if (ctx->pending_head == NULL)
+            ctx->pending_tail = NULL;
+        if (pending->callback != NULL) {
+            completion.slave = pending->slave;
+            completion.seqnr = 0;
+            completion.command = pending->command;
+            pending->callback(ctx, &completion, pending->user_data);
+        }
+        free(pending);
+    }
+
+    errno = error;
+}
+
+/* Queues a request to the current slave without waiting for its response.
+
+   The request is sent right away when the in-flight table has room, otherwise
+   when an earlier request completes in mendeleev_on_readable() or
+   mendeleev_on_timeout(). The callback is called once with the response or the
+   error of the request. */
+int mendeleev_submit(mendeleev_t *ctx, uint8_t command, const uint8_t *data,
+                     uint16_t data_length, mendeleev_completion_cb callback,
+                     void *user_data)
+{
+    mendeleev_pending_t *pending;
+
+    if (ctx == NULL || ctx->slave == -1 ||
+        data_length > (MAX_MESSAGE_LENGTH - MENDELEEV_MSG_OVERHEAD)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pending = (mendeleev_pending_t *)malloc(sizeof(mendeleev_pending_t) + data_length);
+    if (pending == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pending->next = NULL;
+    pending->slave = ctx->slave;
+    pending->command = command;
+    pending->data_length = data_length;
+    pending->callback = callback;
+    pending->user_data = user_data;
+    if (data_length > 0)
+        memcpy(pending->data, data, data_length);
+
+    if (ctx->pending_tail != NULL)
+        ctx->pending_tail->next = pending;
+    else
+        ctx->pending_head = pending;
+    ctx->pending_tail = pending;
+
+    _send_pending(ctx);
+
+    return 0;
+}
+
+/* Parses the complete frames of the receive buffer and returns the number of
+   completed requests */
+static int _parse_frames(mendeleev_t *ctx)
+{
+    int rc;
+    int completed = 0;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    while ((rc = _ring_extract_frame(ctx, rsp)) > 0) {
+        int slot = _inflight_match(ctx, rsp);
+
+        if (slot == -1) {
+            if (ctx->debug) {
+                fprintf(stderr, "Late or duplicate response of slave %d dropped\n",
+                        rsp[MENDELEEV_SRC_OFFSET]);
+            }
+            continue;
+        }
+
+        _inflight_complete(ctx, slot, rsp, rc);
+        completed++;
+    }
+
+    return completed;
+}
+
+/* To call when the socket of the context is readable. Reads the available
+   bytes without blocking, completes the answered requests and sends the
+   submitted requests which were waiting for room in the in-flight table.
+   Returns the number of completed requests. */
+int mendeleev_on_readable(mendeleev_t *ctx)
+{
+    int rc;
+    int completed = 0;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        rc = _ring_fill(ctx);
+        if (rc == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            _error_print(ctx, "read");
+            return -1;
+        }
+        if (rc == 0)
+            break;
+
+        if (ctx->debug)
+            printf("\n");
+
+        completed += _parse_frames(ctx);
+    }
+
+    _send_pending(ctx);
+    _schedule_wakeup(ctx);
+
+    return completed;
+}
+
+/* To call when the delay returned by mendeleev_next_timeout() has elapsed.
+   Completes the expired requests with ETIMEDOUT and returns their number. */
+int mendeleev_on_timeout(mendeleev_t *ctx)
+{
+    int slot;
+    int expired = 0;
+    int64_t now;
+    int64_t expiry;
+    int64_t gap;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    now = _time_us();
+    gap = _frame_gap(ctx);
+    if (gap > 0 && _ring_length(&ctx->rx) > 0 && ctx->last_byte_at + gap <= now) {
+        /* The partial frame is over */
+        if (ctx->debug) {
+            fprintf(stderr, "Frame gap, %u bytes dropped\n",
+                    _ring_length(&ctx->rx));
+        }
+        ctx->stats.frame_gaps++;
+        _ring_reset(&ctx->rx);
+    }
+
+    while ((slot = _inflight_next_expiry(ctx, &expiry)) != -1 && expiry <= now) {
+        _inflight_complete(ctx, slot, NULL, 0);
+        expired++;
+    }
+
+    /* A partial frame can't be completed anymore */
+    if (expired > 0 && ctx->nb_inflight == 0)
+        _ring_reset(&ctx->rx);
+
+    _send_pending(ctx);
+    _schedule_wakeup(ctx);
+
+    return expired;
+}
+
+/* Returns the delay in milliseconds before the next call to
+   mendeleev_on_timeout(), or -1 when no request is waiting for a response,
+   nor a partial frame for its end, nor an open breaker for its probe.
+   The value can be given as is to poll(). */
+int mendeleev_next_timeout(mendeleev_t *ctx)
+{
+    int64_t wakeup;
+    int64_t remaining;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    wakeup = _next_wakeup(ctx);
+    if (wakeup == -1)
+        return -1;
+
+    remaining = wakeup - _time_us();
+    if (remaining <= 0)
+        return 0;
+
+    /* Rounded up to not wake up before the deadline */
+    return (int)((remaining + 999) / 1000);
+}
+
+/* Returns the number of submitted requests which are not completed yet */
+int mendeleev_get_pending(mendeleev_t *ctx)
+{
+    int nb = 0;
+    mendeleev_pending_t *pending;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (pending = ctx->pending_head; pending != NULL; pending = pending->next)
+        nb++;
+
+    return nb + ctx->nb_inflight;
 }
 
 void _init_common(mendeleev_t *ctx)
@@ -490,6 +1809,40 @@ void _init_common(mendeleev_t *ctx)
 
     ctx->byte_timeout.tv_sec = 0;
     ctx->byte_timeout.tv_usec = _BYTE_TIMEOUT;
+
+    ctx->first_byte_timeout.tv_sec = 0;
+    ctx->first_byte_timeout.tv_usec = 0;
+    ctx->frame_gap = FALSE;
+    ctx->tx_end = 0;
+    ctx->last_byte_at = 0;
+
+    ctx->rtt = NULL;
+    ctx->adaptive_timeout_min = _ADAPTIVE_TIMEOUT_MIN;
+    ctx->adaptive_timeout_max = _ADAPTIVE_TIMEOUT_MAX;
+
+    memset(ctx->retry, 0, sizeof(ctx->retry));
+    ctx->attempt_timeout = 0;
+    ctx->attempt_deadline = 0;
+
+    ctx->breaker = NULL;
+    ctx->breaker_backoff_min = _BREAKER_BACKOFF_MIN;
+    ctx->breaker_backoff_max = _BREAKER_BACKOFF_MAX;
+    ctx->breaker_callback = NULL;
+    ctx->breaker_user_data = NULL;
+
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->latency = NULL;
+
+    memset(ctx->seqnr, 0, sizeof(ctx->seqnr));
+    ctx->max_inflight = 1;
+    ctx->nb_inflight = 0;
+    memset(ctx->inflight, 0, sizeof(ctx->inflight));
+
+    ctx->pending_head = NULL;
+    ctx->pending_tail = NULL;
+    _ring_reset(&ctx->rx);
+    ctx->reactor = NULL;
+    ctx->reactor_timer = -1;
 }
 
 /* Define the slave number */
@@ -526,6 +1879,29 @@ int mendeleev_set_error_recovery(mendeleev_t *ctx,
     return 0;
 }
 
+/* Define the number of requests which can wait for a response at the same
+   time, 1 (the default) disables pipelining */
+int mendeleev_set_max_inflight(mendeleev_t *ctx, int max_inflight)
+{
+    if (ctx == NULL || max_inflight < 1 || max_inflight > MENDELEEV_MAX_INFLIGHT) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->max_inflight = max_inflight;
+    return 0;
+}
+
+int mendeleev_get_max_inflight(mendeleev_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->max_inflight;
+}
+
 int mendeleev_set_socket(mendeleev_t *ctx, int s)
 {
     if (ctx == NULL) {
@@ -599,6 +1975,60 @@ int mendeleev_set_byte_timeout(mendeleev_t *ctx, uint32_t to_sec, uint32_t to_us
     return 0;
 }
 
+/* Get the silence after the transmission of a request which times it out */
+int mendeleev_get_first_byte_timeout(mendeleev_t *ctx, uint32_t *to_sec, uint32_t *to_usec)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *to_sec = ctx->first_byte_timeout.tv_sec;
+    *to_usec = ctx->first_byte_timeout.tv_usec;
+    return 0;
+}
+
+/* A node which doesn't answer then costs this timeout instead of the response
+   timeout, which still bounds the whole response. It should be a few
+   characters longer than the turnaround of the nodes. Disabled when both
+   values are zero (default). */
+int mendeleev_set_first_byte_timeout(mendeleev_t *ctx, uint32_t to_sec, uint32_t to_usec)
+{
+    if (ctx == NULL || to_usec > 999999) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->first_byte_timeout.tv_sec = to_sec;
+    ctx->first_byte_timeout.tv_usec = to_usec;
+    return 0;
+}
+
+/* Ends a partial frame when the line is idle for 3.5 characters (1.75 ms at
+   least), so that its bytes are dropped without waiting for the byte
+   timeout. Disabled by default. */
+int mendeleev_set_frame_gap(mendeleev_t *ctx, int enable)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->frame_gap = enable ? TRUE : FALSE;
+    return 0;
+}
+
+/* Returns the time in microseconds to transmit length bytes on the line */
+int64_t mendeleev_get_wire_time(mendeleev_t *ctx, int length)
+{
+    if (ctx == NULL || length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->backend->wire_time(ctx, length);
+}
+
 int mendeleev_connect(mendeleev_t *ctx)
 {
     if (ctx == NULL) {
@@ -622,6 +2052,12 @@ void mendeleev_free(mendeleev_t *ctx)
     if (ctx == NULL)
         return;
 
+    if (ctx->reactor != NULL)
+        mendeleev_reactor_remove(ctx->reactor, ctx);
+    _pending_clear(ctx);
+    _rtt_free(ctx);
+    _breaker_free(ctx);
+    _stats_free(ctx);
     ctx->backend->free(ctx);
 }
 
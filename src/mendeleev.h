@@ -39,9 +39,24 @@ MENDELEEV_BEGIN_DECLS
 #define MENDELEEV_CMD_GET_VERSION 0x03
 #define MENDELEEV_CMD_SET_OUTPUT  0x04
 #define MENDELEEV_CMD_REBOOT      0x05
+#define MENDELEEV_CMD_SET_COLOR_TABLE 0x06
+#define MENDELEEV_CMD_SET_GROUP   0x07
 
 #define MENDELEEV_BROADCAST_ADDRESS    0xFF
 
+/* Group addresses, a node is a member of the groups assigned to it with
+ * mendeleev_set_group(). Like broadcasts, requests to a group get no response. */
+#define MENDELEEV_GROUP_ADDRESS_BASE   0xF0
+#define MENDELEEV_MAX_GROUPS           15
+#define MENDELEEV_GROUP_ADDRESS(group) (MENDELEEV_GROUP_ADDRESS_BASE + (group))
+#define MENDELEEV_IS_GROUP_ADDRESS(addr) \
+    ((addr) >= MENDELEEV_GROUP_ADDRESS_BASE && (addr) < MENDELEEV_BROADCAST_ADDRESS)
+#define MENDELEEV_IS_MULTICAST_ADDRESS(addr) \
+    ((addr) == MENDELEEV_BROADCAST_ADDRESS || MENDELEEV_IS_GROUP_ADDRESS(addr))
+
+/* Maximum number of pipelined requests waiting for a response */
+#define MENDELEEV_MAX_INFLIGHT   32
+
 /* Random number to avoid errno conflicts */
 #define MENDELEEV_ENOBASE 112345678
 
@@ -79,6 +94,8 @@ enum {
 #define EMBUNKEXC  (EMBXGTAR + 4)
 #define EMBMDATA   (EMBXGTAR + 5)
 #define EMBBADSLAVE (EMBXGTAR + 6)
+#define EMBOTAFAIL (EMBXGTAR + 7)
+#define EMBDOWN    (EMBXGTAR + 8)
 
 #define MENDELEEV_PREAMBLE_LENGTH    8
 #define MENDELEEV_ADDR_LENGTH        1
@@ -101,17 +118,57 @@ enum {
 #define MENDELEEV_CHECKSUM_LENGTH    2
 #define MENDELEEV_MSG_OVERHEAD       (MENDELEEV_HEADER_LENGTH + MENDELEEV_CMD_LENGTH + MENDELEEV_DATALEN_LENGTH + MENDELEEV_CHECKSUM_LENGTH)
 
+/* Max payload of a message, large enough for a colour table of all slaves */
+#define MENDELEEV_MAX_DATA_LENGTH    1024
+#define MENDELEEV_MAX_MESSAGE_LENGTH (MENDELEEV_MSG_OVERHEAD + MENDELEEV_MAX_DATA_LENGTH)
+
 extern const unsigned int libmendeleev_version_major;
 extern const unsigned int libmendeleev_version_minor;
 extern const unsigned int libmendeleev_version_micro;
 
 typedef struct _mendeleev mendeleev_t;
 
+/* Result of a request given to the completion callback of mendeleev_submit().
+   rc is 1 on success, -1 on failure with the errno value in error. */
+typedef struct _mendeleev_completion {
+    int slave;
+    uint16_t seqnr;
+    uint8_t command;
+    int rc;
+    int error;
+    const uint8_t *data;
+    uint16_t data_length;
+} mendeleev_completion_t;
+
+/* Command of a batch for mendeleev_send_batch(). The last four fields are
+   set by the library: rc is 1 on success, -1 on failure with the errno value
+   in error. */
+#define MENDELEEV_BATCH_NO_RESPONSE  (1<<0)
+
+typedef struct _mendeleev_cmd {
+    int slave;
+    uint8_t command;
+    const uint8_t *data;
+    uint16_t data_length;
+    int flags;
+    uint8_t *rsp_buf;
+    uint16_t rsp_length;
+    int rc;
+    int error;
+} mendeleev_cmd_t;
+
+typedef void (*mendeleev_completion_cb)(mendeleev_t *ctx,
+                                        const mendeleev_completion_t *completion,
+                                        void *user_data);
+
 typedef enum
 {
     MENDELEEV_ERROR_RECOVERY_NONE          = 0,
     MENDELEEV_ERROR_RECOVERY_LINK          = (1<<1),
-    MENDELEEV_ERROR_RECOVERY_PROTOCOL      = (1<<2)
+    MENDELEEV_ERROR_RECOVERY_PROTOCOL      = (1<<2),
+    /* Recovers by draining the line until it is idle instead of sleeping the
+       response timeout before a flush */
+    MENDELEEV_ERROR_RECOVERY_DRAIN         = (1<<3)
 } error_recovery_mode;
 
 MENDELEEV_API int mendeleev_set_slave(mendeleev_t* ctx, int slave);
@@ -126,23 +183,103 @@ MENDELEEV_API int mendeleev_set_response_timeout(mendeleev_t *ctx, uint32_t to_s
 MENDELEEV_API int mendeleev_get_byte_timeout(mendeleev_t *ctx, uint32_t *to_sec, uint32_t *to_usec);
 MENDELEEV_API int mendeleev_set_byte_timeout(mendeleev_t *ctx, uint32_t to_sec, uint32_t to_usec);
 
+MENDELEEV_API int mendeleev_get_first_byte_timeout(mendeleev_t *ctx, uint32_t *to_sec, uint32_t *to_usec);
+MENDELEEV_API int mendeleev_set_first_byte_timeout(mendeleev_t *ctx, uint32_t to_sec, uint32_t to_usec);
+MENDELEEV_API int mendeleev_set_frame_gap(mendeleev_t *ctx, int enable);
+
+MENDELEEV_API int mendeleev_set_adaptive_timeout(mendeleev_t *ctx, int enable);
+MENDELEEV_API int mendeleev_set_adaptive_timeout_bounds(mendeleev_t *ctx, uint32_t min_usec, uint32_t max_usec);
+MENDELEEV_API int64_t mendeleev_get_adaptive_timeout(mendeleev_t *ctx, int slave, uint8_t command, uint16_t data_length);
+
+/* Errors retried by a retry policy */
+#define MENDELEEV_RETRY_TIMEOUT  (1<<0)  /* ETIMEDOUT */
+#define MENDELEEV_RETRY_BADCRC   (1<<1)  /* EMBBADCRC */
+#define MENDELEEV_RETRY_BADDATA  (1<<2)  /* EMBBADDATA, EMBBADSLAVE */
+#define MENDELEEV_RETRY_NACK     (1<<3)  /* EMBXNACK */
+#define MENDELEEV_RETRY_BUSY     (1<<4)  /* EMBXSBUSY */
+
+/* Retries of the commands sent by mendeleev_send_command(). The attempt n + 1
+ * follows the attempt n after backoff_usec * backoff_factor^(n - 1)
+ * microseconds, backoff_max_usec at most. No attempt starts past the total
+ * timeout counted from the first one. A zero timeout stands for the response
+ * timeout of the context for an attempt, and for no limit for the total. */
+typedef struct _mendeleev_retry_policy {
+    int max_attempts;
+    uint32_t backoff_usec;
+    uint32_t backoff_max_usec;
+    int backoff_factor;
+    uint32_t attempt_timeout_usec;
+    uint32_t total_timeout_usec;
+    int retry_on;
+} mendeleev_retry_policy_t;
+
+MENDELEEV_API int mendeleev_set_retry_policy(mendeleev_t *ctx, int command, const mendeleev_retry_policy_t *policy);
+MENDELEEV_API int mendeleev_get_retry_policy(mendeleev_t *ctx, int command, mendeleev_retry_policy_t *policy);
+
+/* State of the circuit breaker of a slave */
+typedef enum
+{
+    MENDELEEV_BREAKER_CLOSED    = 0,
+    MENDELEEV_BREAKER_OPEN      = 1,
+    MENDELEEV_BREAKER_HALF_OPEN = 2
+} mendeleev_breaker_state;
+
+typedef void (*mendeleev_breaker_cb)(mendeleev_t *ctx, int slave,
+                                     mendeleev_breaker_state from,
+                                     mendeleev_breaker_state to,
+                                     void *user_data);
+
+MENDELEEV_API int mendeleev_set_breaker(mendeleev_t *ctx, int threshold);
+MENDELEEV_API int mendeleev_set_breaker_backoff(mendeleev_t *ctx, uint32_t min_usec, uint32_t max_usec);
+MENDELEEV_API int mendeleev_set_breaker_callback(mendeleev_t *ctx, mendeleev_breaker_cb callback, void *user_data);
+MENDELEEV_API int mendeleev_get_breaker_state(mendeleev_t *ctx, int slave);
+MENDELEEV_API int mendeleev_reset_breaker(mendeleev_t *ctx, int slave);
+
+MENDELEEV_API int64_t mendeleev_get_wire_time(mendeleev_t *ctx, int length);
+
 MENDELEEV_API int mendeleev_connect(mendeleev_t *ctx);
 MENDELEEV_API void mendeleev_close(mendeleev_t *ctx);
 
 MENDELEEV_API void mendeleev_free(mendeleev_t *ctx);
 
 MENDELEEV_API int mendeleev_flush(mendeleev_t *ctx);
+MENDELEEV_API int mendeleev_drain(mendeleev_t *ctx);
 MENDELEEV_API int mendeleev_set_debug(mendeleev_t *ctx, int flag);
 
 MENDELEEV_API const char *mendeleev_strerror(int errnum);
 
 MENDELEEV_API int mendeleev_send_command(mendeleev_t *ctx, uint8_t command, uint8_t *data, uint16_t data_length, uint8_t *rsp_buf, uint16_t *rsp_length);
 
+MENDELEEV_API int mendeleev_set_group(mendeleev_t *ctx, uint16_t groups);
+
+MENDELEEV_API int mendeleev_send_batch(mendeleev_t *ctx, mendeleev_cmd_t *cmds, int nb);
+
+MENDELEEV_API int mendeleev_set_max_inflight(mendeleev_t *ctx, int max_inflight);
+MENDELEEV_API int mendeleev_get_max_inflight(mendeleev_t *ctx);
+MENDELEEV_API int mendeleev_send_request(mendeleev_t *ctx, uint8_t command, uint8_t *data, uint16_t data_length);
+MENDELEEV_API int mendeleev_receive_response(mendeleev_t *ctx, int *slave, uint16_t *seqnr, uint8_t *rsp_buf, uint16_t *rsp_length);
+
+MENDELEEV_API int mendeleev_submit(mendeleev_t *ctx, uint8_t command, const uint8_t *data, uint16_t data_length, mendeleev_completion_cb callback, void *user_data);
+MENDELEEV_API int mendeleev_on_readable(mendeleev_t *ctx);
+MENDELEEV_API int mendeleev_on_timeout(mendeleev_t *ctx);
+MENDELEEV_API int mendeleev_next_timeout(mendeleev_t *ctx);
+MENDELEEV_API int mendeleev_get_pending(mendeleev_t *ctx);
+
 MENDELEEV_API int mendeleev_receive(mendeleev_t *ctx, uint8_t *req);
 
 MENDELEEV_API int mendeleev_receive_confirmation(mendeleev_t *ctx, uint8_t *rsp);
 
 #include "mendeleev-rtu.h"
+#include "mendeleev-reactor.h"
+#include "mendeleev-color.h"
+#include "mendeleev-crc.h"
+#include "mendeleev-framebuffer.h"
+#include "mendeleev-animation.h"
+#include "mendeleev-store.h"
+#include "mendeleev-delta.h"
+#include "mendeleev-lz4.h"
+#include "mendeleev-ota.h"
+#include "mendeleev-stats.h"
 
 MENDELEEV_END_DECLS
 
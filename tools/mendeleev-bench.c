@@ -0,0 +1,346 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+
+/* End-to-end benchmark of mendeleev_send_command() against the simulator or
+ * against a device given on the command line */
+
+#define MAX_MIX 8
+
+typedef struct _bench_cmd {
+    const char *name;
+    uint8_t command;
+    /* Smallest payload accepted by the nodes */
+    int min_length;
+    int weight;
+} bench_cmd_t;
+
+static bench_cmd_t commands[] = {
+    { "color",   MENDELEEV_CMD_SET_COLOR,   MENDELEEV_COLOR_LENGTH, 0 },
+    { "mode",    MENDELEEV_CMD_SET_MODE,    1, 0 },
+    { "output",  MENDELEEV_CMD_SET_OUTPUT,  1, 0 },
+    { "version", MENDELEEV_CMD_GET_VERSION, 0, 0 },
+    /* A STATUS operation, which leaves the transfer state of the nodes alone */
+    { "ota",     MENDELEEV_CMD_OTA,         1, 0 },
+};
+
+#define NB_COMMANDS (int)(sizeof(commands) / sizeof(commands[0]))
+
+static int64_t _now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t _cpu_ns(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return ((int64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+        ((int64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+/* Waits of the library, which /proc/self/io doesn't count */
+static long nb_polls = 0;
+
+/* The waits of the library are routed through these, which count them and
+   make the system call as the C library would */
+static int _ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout)
+{
+    struct timespec ts;
+
+    nb_polls++;
+    /* The kernel writes the time left back */
+    if (timeout != NULL)
+        ts = *timeout;
+    return syscall(SYS_ppoll, fds, nfds, timeout != NULL ? &ts : NULL, NULL, _NSIG / 8);
+}
+
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout,
+          const sigset_t *sigmask)
+{
+    (void)sigmask;
+    return _ppoll(fds, nfds, timeout);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout_ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    return _ppoll(fds, nfds, timeout_ms < 0 ? NULL : &ts);
+}
+
+/* Read, write and poll system calls made so far by the process */
+static long _syscalls(void)
+{
+    FILE *f;
+    char line[128];
+    long value;
+    long total = 0;
+
+    f = fopen("/proc/self/io", "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "syscr: %ld", &value) == 1 ||
+            sscanf(line, "syscw: %ld", &value) == 1)
+            total += value;
+    }
+    fclose(f);
+
+    return total + nb_polls;
+}
+
+static int _compare(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double _percentile(const int64_t *sorted, int nb, double p)
+{
+    int i = (int)(p * (nb - 1) + 0.5);
+
+    return sorted[i] / 1000.0;
+}
+
+/* Parses "color=8,version=1" into the weights of the commands */
+static int _parse_mix(const char *spec)
+{
+    char *copy = strdup(spec);
+    char *token;
+    char *saveptr;
+    int total = 0;
+    int i;
+
+    for (i = 0; i < NB_COMMANDS; i++)
+        commands[i].weight = 0;
+
+    for (token = strtok_r(copy, ",", &saveptr); token != NULL;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(token, '=');
+        int weight = 1;
+
+        if (eq != NULL) {
+            *eq = '\0';
+            weight = atoi(eq + 1);
+        }
+        for (i = 0; i < NB_COMMANDS; i++) {
+            if (strcmp(token, commands[i].name) == 0) {
+                commands[i].weight = weight;
+                total += weight;
+                break;
+            }
+        }
+        if (i == NB_COMMANDS) {
+            fprintf(stderr, "Unknown command '%s'\n", token);
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+
+    return total;
+}
+
+static bench_cmd_t *_pick(unsigned int *seed, int total)
+{
+    int r = rand_r(seed) % total;
+    int i;
+
+    for (i = 0; i < NB_COMMANDS; i++) {
+        if (r < commands[i].weight)
+            return &commands[i];
+        r -= commands[i].weight;
+    }
+
+    return &commands[0];
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -D DEVICE   serial device of a real bus, instead of the simulator\n"
+            "  -b BAUD     line rate (115200)\n"
+            "  -u          don't pace the simulator at the line rate\n"
+            "  -n NODES    number of addressed nodes (16)\n"
+            "  -c COUNT    number of measured commands (10000)\n"
+            "  -w COUNT    number of warm-up commands (100)\n"
+            "  -s SIZE     payload size, at least what the command needs (3)\n"
+            "  -m MIX      weighted command mix, e.g. color=8,version=1 (color)\n"
+            "              among color, mode, output, version and ota\n"
+            "  -l US       simulated reply latency in microseconds (200)\n"
+            "  -v          debug output of the library\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    const char *device = NULL;
+    int baud = 115200;
+    int paced = 1;
+    int nb_nodes = 16;
+    int count = 10000;
+    int warmup = 100;
+    int size = MENDELEEV_COLOR_LENGTH;
+    const char *mix = "color";
+    int latency_us = 200;
+    int debug = 0;
+    int total_weight;
+    sim_t *sim = NULL;
+    pid_t pid = -1;
+    mendeleev_t *ctx;
+    uint8_t payload[MENDELEEV_MAX_DATA_LENGTH];
+    uint8_t ota_status = MENDELEEV_OTA_STATUS;
+    uint8_t rsp[MENDELEEV_MAX_MESSAGE_LENGTH];
+    uint16_t rsp_length;
+    int64_t *latencies;
+    int64_t start = 0, elapsed, cpu = 0;
+    long syscalls = 0;
+    unsigned int seed = 1;
+    int nb_errors = 0;
+    int i;
+
+    while ((opt = getopt(argc, argv, "D:b:un:c:w:s:m:l:vh")) != -1) {
+        switch (opt) {
+        case 'D': device = optarg; break;
+        case 'b': baud = atoi(optarg); break;
+        case 'u': paced = 0; break;
+        case 'n': nb_nodes = atoi(optarg); break;
+        case 'c': count = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'm': mix = optarg; break;
+        case 'l': latency_us = atoi(optarg); break;
+        case 'v': debug = 1; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    total_weight = _parse_mix(mix);
+    if (total_weight <= 0 || count <= 0 || nb_nodes <= 0 ||
+        size < 0 || size > MENDELEEV_MAX_DATA_LENGTH) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (device == NULL) {
+        sim_config_t config;
+
+        sim_config_init(&config);
+        config.nb_nodes = nb_nodes;
+        config.latency_us = latency_us;
+        config.baud = paced ? baud : 0;
+        sim = sim_new(&config);
+        if (sim == NULL) {
+            perror("sim_new");
+            return 1;
+        }
+        pid = sim_fork(sim);
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        device = sim_get_device(sim);
+    }
+
+    ctx = mendeleev_new_rtu(device, baud, 'N', 8, 1);
+    if (ctx == NULL || mendeleev_connect(ctx) == -1) {
+        fprintf(stderr, "Connection to %s failed: %s\n", device,
+                mendeleev_strerror(errno));
+        return 1;
+    }
+    mendeleev_set_debug(ctx, debug);
+    mendeleev_set_response_timeout(ctx, 1, 0);
+
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = i;
+
+    latencies = (int64_t *)malloc(count * sizeof(int64_t));
+    if (latencies == NULL)
+        return 1;
+
+    for (i = -warmup; i < count; i++) {
+        bench_cmd_t *cmd = _pick(&seed, total_weight);
+        uint8_t *data = payload;
+        int length = size > cmd->min_length ? size : cmd->min_length;
+        int64_t t0;
+        int rc;
+
+        if (i == 0) {
+            syscalls = _syscalls();
+            cpu = _cpu_ns();
+            start = _now_ns();
+        }
+
+        if (cmd->command == MENDELEEV_CMD_GET_VERSION) {
+            length = 0;
+        } else if (cmd->command == MENDELEEV_CMD_OTA) {
+            data = &ota_status;
+            length = 1;
+        }
+        mendeleev_set_slave(ctx, 1 + (i + warmup) % nb_nodes);
+        t0 = _now_ns();
+        rc = mendeleev_send_command(ctx, cmd->command, data, length,
+                                    rsp, &rsp_length);
+        if (i >= 0) {
+            latencies[i] = _now_ns() - t0;
+            if (rc == -1)
+                nb_errors++;
+        }
+    }
+
+    elapsed = _now_ns() - start;
+    cpu = _cpu_ns() - cpu;
+    syscalls = _syscalls() - syscalls;
+
+    qsort(latencies, count, sizeof(int64_t), _compare);
+
+    printf("device:        %s%s\n", device, sim != NULL ? " (simulator)" : "");
+    printf("baud:          %d%s\n", baud, (sim != NULL && !paced) ? " (unpaced)" : "");
+    printf("mix:           %s, payload %d bytes, %d nodes\n", mix, size, nb_nodes);
+    printf("commands:      %d, %d errors\n", count, nb_errors);
+    printf("commands/s:    %.1f\n", count / (elapsed / 1e9));
+    printf("latency (us):  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           _percentile(latencies, count, 0.50), _percentile(latencies, count, 0.99),
+           _percentile(latencies, count, 0.999), latencies[count - 1] / 1000.0);
+    printf("syscalls/cmd:  %.2f (read, write and poll)\n", (double)syscalls / count);
+    printf("cpu/cmd (us):  %.2f\n", cpu / 1000.0 / count);
+
+    free(latencies);
+    mendeleev_close(ctx);
+    mendeleev_free(ctx);
+
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    sim_free(sim);
+
+    return nb_errors == 0 ? 0 : 1;
+}
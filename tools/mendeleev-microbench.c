@@ -0,0 +1,243 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "mendeleev-private.h"
+
+/* Microbenchmarks of the CPU-bound paths of the library, fed from memory:
+ * CRC, request framing, integrity check and frame extraction from the receive
+ * buffer. The private header gives access to the backend of a context that is
+ * never connected. */
+
+static const int payload_sizes[] = { 0, 1, 3, 8, 16, 32, 64, 128, 255, 1024 };
+
+#define NB_SIZES (int)(sizeof(payload_sizes) / sizeof(payload_sizes[0]))
+
+typedef struct _measure {
+    int64_t ns;
+    uint64_t cycles;
+} measure_t;
+
+/* Keeps the compiler from dropping the measured work */
+static volatile unsigned int sink;
+
+static int64_t _now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t _cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void _start(measure_t *m)
+{
+    m->ns = _now_ns();
+    m->cycles = _cycles();
+}
+
+static void _stop(measure_t *m)
+{
+    m->cycles = _cycles() - m->cycles;
+    m->ns = _now_ns() - m->ns;
+}
+
+static void _report(const char *name, int payload, int frame_length,
+                    const measure_t *m, long iterations)
+{
+    printf("%-16s %5d %6d %10.1f", name, payload, frame_length,
+           (double)m->ns / iterations);
+    if (m->cycles > 0) {
+        printf(" %10.1f %8.3f\n", (double)m->cycles / iterations,
+               (double)frame_length * iterations / m->cycles);
+    } else {
+        printf(" %10s %8s\n", "-", "-");
+    }
+}
+
+/* Builds a response frame of slave with payload bytes of data */
+static int _build_response(int slave, uint8_t *msg, int payload)
+{
+    int length = 0;
+    int i;
+    uint16_t crc;
+
+    for (i = 0; i < MENDELEEV_PREAMBLE_LENGTH; i++)
+        msg[length++] = PREAMBLE;
+    msg[length++] = 0;
+    msg[length++] = slave;
+    msg[length++] = 0;
+    msg[length++] = 1;
+    msg[length++] = MENDELEEV_CMD_GET_VERSION;
+    msg[length++] = payload >> 8;
+    msg[length++] = payload & 0xFF;
+    for (i = 0; i < payload; i++)
+        msg[length++] = i;
+    crc = mendeleev_crc16(msg + MENDELEEV_DEST_OFFSET, length - MENDELEEV_PREAMBLE_LENGTH);
+    msg[length++] = crc >> 8;
+    msg[length++] = crc & 0xFF;
+
+    return length;
+}
+
+static void bench_crc(int payload, long iterations)
+{
+    uint8_t msg[MAX_MESSAGE_LENGTH];
+    int length = _build_response(1, msg, payload);
+    int crc_length = length - MENDELEEV_PREAMBLE_LENGTH - MENDELEEV_CHECKSUM_LENGTH;
+    measure_t m;
+    long i;
+
+    _start(&m);
+    for (i = 0; i < iterations; i++) {
+        msg[MENDELEEV_DEST_OFFSET] = i;
+        sink += mendeleev_crc16(msg + MENDELEEV_DEST_OFFSET, crc_length);
+    }
+    _stop(&m);
+
+    _report("crc16", payload, crc_length, &m, iterations);
+}
+
+static void bench_build(mendeleev_t *ctx, int payload, long iterations)
+{
+    uint8_t req[MAX_MESSAGE_LENGTH];
+    uint8_t data[MENDELEEV_MAX_DATA_LENGTH];
+    int length = 0;
+    measure_t m;
+    long i;
+
+    memset(data, 0x5A, sizeof(data));
+
+    _start(&m);
+    for (i = 0; i < iterations; i++) {
+        length = ctx->backend->build_request_basis(ctx, MENDELEEV_CMD_SET_COLOR, req);
+        req[length++] = payload >> 8;
+        req[length++] = payload & 0xFF;
+        memcpy(req + length, data, payload);
+        length += payload;
+        length = ctx->backend->send_msg_pre(req, length);
+        sink += req[length - 1];
+    }
+    _stop(&m);
+
+    _report("build+pre", payload, length, &m, iterations);
+}
+
+static void bench_check_integrity(mendeleev_t *ctx, int payload, long iterations)
+{
+    uint8_t msg[MAX_MESSAGE_LENGTH];
+    int length = _build_response(ctx->slave, msg, payload);
+    measure_t m;
+    long i;
+
+    _start(&m);
+    for (i = 0; i < iterations; i++)
+        sink += ctx->backend->check_integrity(ctx, msg, length);
+    _stop(&m);
+
+    _report("check_integrity", payload, length, &m, iterations);
+}
+
+/* Frame extraction from the receive buffer: preamble hunt, bounds of the data
+   length, CRC and copy out of the ring */
+static void bench_parse(mendeleev_t *ctx, int payload, long iterations)
+{
+    uint8_t frame[MAX_MESSAGE_LENGTH];
+    uint8_t msg[MAX_MESSAGE_LENGTH];
+    int length = _build_response(ctx->slave, frame, payload);
+    mendeleev_ring_t *ring = &ctx->rx;
+    measure_t m;
+    long i;
+
+    _start(&m);
+    for (i = 0; i < iterations; i++) {
+        /* Start of the ring so the frame is contiguous, as after a read */
+        ring->head = 0;
+        ring->tail = length;
+        memcpy(ring->buf, frame, length);
+        sink += _ring_extract_frame(ctx, msg);
+    }
+    _stop(&m);
+
+    _report("parse", payload, length, &m, iterations);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -i ITERATIONS  iterations per measure (200000)\n"
+            "  -e ENGINE      CRC engine: table, slice8 or clmul (best available)\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    long iterations = 200000;
+    const char *engine = NULL;
+    mendeleev_t *ctx;
+    int i;
+
+    while ((opt = getopt(argc, argv, "i:e:h")) != -1) {
+        switch (opt) {
+        case 'i': iterations = atol(optarg); break;
+        case 'e': engine = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (iterations <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Never connected, only the framing functions of the backend are used */
+    ctx = mendeleev_new_rtu("/dev/null", 115200, 'N', 8, 1);
+    if (ctx == NULL) {
+        perror("mendeleev_new_rtu");
+        return 1;
+    }
+    mendeleev_set_slave(ctx, 1);
+
+    if (_crc16_set_engine(engine) == -1) {
+        fprintf(stderr, "CRC engine %s: %s\n", engine, mendeleev_strerror(errno));
+        return 1;
+    }
+    printf("CRC engine: %s\n", _crc16_get_engine());
+
+    printf("%-16s %5s %6s %10s %10s %8s\n",
+           "path", "data", "bytes", "ns/frame", "cyc/frame", "B/cycle");
+    for (i = 0; i < NB_SIZES; i++)
+        bench_crc(payload_sizes[i], iterations);
+    for (i = 0; i < NB_SIZES; i++)
+        bench_build(ctx, payload_sizes[i], iterations);
+    for (i = 0; i < NB_SIZES; i++)
+        bench_check_integrity(ctx, payload_sizes[i], iterations);
+    for (i = 0; i < NB_SIZES; i++)
+        bench_parse(ctx, payload_sizes[i], iterations);
+
+    mendeleev_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+static volatile int stop = 0;
+
+static void _on_signal(int signum)
+{
+    (void)signum;
+    stop = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Emulates Mendeleev nodes behind a pseudo-terminal whose path is\n"
+            "printed on stdout, to give to mendeleev_new_rtu().\n\n"
+            "  -f ADDRESS  address of the first node (1)\n"
+            "  -n NODES    number of nodes (118)\n"
+            "  -l US       reply latency in microseconds (200)\n"
+            "  -j US       reply jitter in microseconds (0)\n"
+            "  -d RATE     probability of a lost reply (0)\n"
+            "  -c RATE     probability of a corrupted reply (0)\n"
+            "  -z RATE     probability of noise before a reply (0)\n"
+            "  -L RATE     probability that a node misses a request (0)\n"
+            "  -b BAUD     emulated line rate, 0 for none (0)\n"
+            "  -s SEED     random seed (1)\n"
+            "  -V VERSION  firmware version reported by the nodes (1.0.0)\n"
+            "  -S STORE    store of firmware images, the nodes run the one of VERSION\n"
+            "  -v          print the received commands\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    sim_t *sim;
+    sim_config_t config;
+    const sim_stats_t *stats;
+
+    sim_config_init(&config);
+    while ((opt = getopt(argc, argv, "f:n:l:j:d:c:z:L:b:s:V:S:vh")) != -1) {
+        switch (opt) {
+        case 'f': config.first_node = atoi(optarg); break;
+        case 'n': config.nb_nodes = atoi(optarg); break;
+        case 'l': config.latency_us = atoi(optarg); break;
+        case 'j': config.jitter_us = atoi(optarg); break;
+        case 'd': config.drop_rate = atof(optarg); break;
+        case 'c': config.corrupt_rate = atof(optarg); break;
+        case 'z': config.noise_rate = atof(optarg); break;
+        case 'L': config.loss_rate = atof(optarg); break;
+        case 'b': config.baud = atoi(optarg); break;
+        case 's': config.seed = strtoul(optarg, NULL, 0); break;
+        case 'V':
+            snprintf(config.version, sizeof(config.version), "%s", optarg);
+            break;
+        case 'S': config.store = optarg; break;
+        case 'v': config.debug = 1; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    sim = sim_new(&config);
+    if (sim == NULL) {
+        perror("sim_new");
+        return 1;
+    }
+
+    printf("%s\n", sim_get_device(sim));
+    fflush(stdout);
+
+    signal(SIGINT, _on_signal);
+    signal(SIGTERM, _on_signal);
+    sim_run(sim, &stop);
+
+    stats = sim_get_stats(sim);
+    fprintf(stderr, "%lu frames, %lu replies, %lu bad CRC, %lu bytes skipped, "
+            "%lu dropped, %lu corrupted, %lu lost\n",
+            stats->frames, stats->replies, stats->bad_crc, stats->bytes_skipped,
+            stats->dropped, stats->corrupted, stats->lost);
+
+    sim_free(sim);
+    return 0;
+}
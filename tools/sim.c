@@ -0,0 +1,694 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define SIM_BUFFER_SIZE 8192
+#define SIM_FRAME_MIN (MENDELEEV_MSG_OVERHEAD)
+
+struct _sim {
+    sim_config_t config;
+    int master;
+    /* Kept open so the master doesn't see a hangup between two clients */
+    int slave;
+    char device[64];
+    sim_node_t nodes[256];
+    uint8_t present[256];
+    sim_stats_t stats;
+    uint8_t buf[SIM_BUFFER_SIZE];
+    int length;
+    /* Emulated time at which the line becomes idle */
+    int64_t line_free;
+    unsigned int seed;
+    mendeleev_store_t *store;
+};
+
+static int64_t _now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void _sleep_until(int64_t t)
+{
+    int64_t remaining = t - _now_us();
+
+    if (remaining > 0) {
+        struct timespec ts;
+
+        ts.tv_sec = remaining / 1000000;
+        ts.tv_nsec = (remaining % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+/* Time on the wire in microseconds, 8N1 */
+static int64_t _wire_time(sim_t *sim, int nb_bytes)
+{
+    if (sim->config.baud <= 0)
+        return 0;
+    return (int64_t)nb_bytes * 10 * 1000000 / sim->config.baud;
+}
+
+static double _random(sim_t *sim)
+{
+    return (double)rand_r(&sim->seed) / ((double)RAND_MAX + 1.0);
+}
+
+void sim_config_init(sim_config_t *config)
+{
+    memset(config, 0, sizeof(sim_config_t));
+    config->first_node = 1;
+    config->nb_nodes = 118;
+    config->latency_us = 200;
+    config->seed = 1;
+    strcpy(config->version, "1.0.0");
+}
+
+sim_t *sim_new(const sim_config_t *config)
+{
+    int i;
+    sim_t *sim;
+    struct termios tios;
+    const char *name;
+
+    if (config->first_node < 1 || config->nb_nodes < 0 ||
+        config->first_node + config->nb_nodes > MENDELEEV_GROUP_ADDRESS_BASE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sim = (sim_t *)calloc(1, sizeof(sim_t));
+    if (sim == NULL)
+        return NULL;
+    sim->config = *config;
+    sim->seed = config->seed;
+    sim->slave = -1;
+
+    sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->master == -1 || grantpt(sim->master) == -1 ||
+        unlockpt(sim->master) == -1 || (name = ptsname(sim->master)) == NULL) {
+        sim_free(sim);
+        return NULL;
+    }
+    snprintf(sim->device, sizeof(sim->device), "%s", name);
+
+    sim->slave = open(sim->device, O_RDWR | O_NOCTTY);
+    if (sim->slave == -1) {
+        sim_free(sim);
+        return NULL;
+    }
+    /* Raw line until a client configures it */
+    tcgetattr(sim->slave, &tios);
+    cfmakeraw(&tios);
+    tcsetattr(sim->slave, TCSANOW, &tios);
+
+    if (config->store != NULL) {
+        sim->store = mendeleev_store_open(config->store);
+        if (sim->store == NULL) {
+            sim_free(sim);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < config->nb_nodes; i++) {
+        int address = config->first_node + i;
+        sim_node_t *node = &sim->nodes[address];
+
+        node->address = address;
+        strcpy(node->version, config->version);
+        sim->present[address] = 1;
+
+        /* Without its image, a node can't apply a delta */
+        if (sim->store != NULL &&
+            mendeleev_store_load(sim->store, config->version, &node->firmware,
+                                 &node->firmware_size) == -1 && config->debug)
+            fprintf(stderr, "sim: no image of version %s\n", config->version);
+    }
+
+    return sim;
+}
+
+static void _ota_reset(sim_ota_t *ota)
+{
+    free(ota->image);
+    free(ota->received);
+    memset(ota, 0, sizeof(sim_ota_t));
+}
+
+void sim_free(sim_t *sim)
+{
+    int i;
+
+    if (sim == NULL)
+        return;
+    for (i = 0; i < 256; i++) {
+        _ota_reset(&sim->nodes[i].ota);
+        free(sim->nodes[i].firmware);
+    }
+    mendeleev_store_close(sim->store);
+    if (sim->slave != -1)
+        close(sim->slave);
+    if (sim->master != -1)
+        close(sim->master);
+    free(sim);
+}
+
+const char *sim_get_device(sim_t *sim)
+{
+    return sim->device;
+}
+
+sim_node_t *sim_get_node(sim_t *sim, int address)
+{
+    if (address < 0 || address > 255 || !sim->present[address])
+        return NULL;
+    return &sim->nodes[address];
+}
+
+const sim_stats_t *sim_get_stats(sim_t *sim)
+{
+    return &sim->stats;
+}
+
+static void _reply(sim_t *sim, const uint8_t *req, int64_t reply_at,
+                   uint8_t command, const uint8_t *data, int data_length)
+{
+    uint8_t rsp[MENDELEEV_MAX_MESSAGE_LENGTH + 16];
+    int length = 0;
+    int i;
+    uint16_t crc;
+    int64_t reply_end;
+
+    if (_random(sim) < sim->config.drop_rate) {
+        sim->stats.dropped++;
+        sim->line_free = reply_at;
+        return;
+    }
+
+    if (_random(sim) < sim->config.noise_rate) {
+        int nb = 1 + rand_r(&sim->seed) % 4;
+        for (i = 0; i < nb; i++)
+            rsp[length++] = (i % 2) ? rand_r(&sim->seed) & 0xFF : PREAMBLE;
+    }
+
+    {
+        int start = length;
+
+        for (i = 0; i < MENDELEEV_PREAMBLE_LENGTH; i++)
+            rsp[length++] = PREAMBLE;
+        rsp[length++] = req[MENDELEEV_SRC_OFFSET];
+        rsp[length++] = req[MENDELEEV_DEST_OFFSET];
+        rsp[length++] = req[MENDELEEV_SEQNR_OFFSET];
+        rsp[length++] = req[MENDELEEV_SEQNR_OFFSET + 1];
+        rsp[length++] = command;
+        rsp[length++] = data_length >> 8;
+        rsp[length++] = data_length & 0xFF;
+        if (data_length > 0)
+            memcpy(rsp + length, data, data_length);
+        length += data_length;
+        crc = mendeleev_crc16(rsp + start + MENDELEEV_DEST_OFFSET,
+                              length - start - MENDELEEV_PREAMBLE_LENGTH);
+        rsp[length++] = crc >> 8;
+        rsp[length++] = crc & 0xFF;
+
+        if (_random(sim) < sim->config.corrupt_rate) {
+            int offset = start + MENDELEEV_DEST_OFFSET +
+                rand_r(&sim->seed) % (length - start - MENDELEEV_DEST_OFFSET);
+            rsp[offset] ^= 1 << (rand_r(&sim->seed) % 8);
+            sim->stats.corrupted++;
+        }
+    }
+
+    reply_end = reply_at + _wire_time(sim, length);
+    _sleep_until(reply_end);
+    sim->line_free = reply_end;
+
+    if (write(sim->master, rsp, length) != length && sim->config.debug)
+        fprintf(stderr, "sim: short write\n");
+    sim->stats.replies++;
+}
+
+static void _apply_color_table(sim_t *sim, const uint8_t *data, int data_length,
+                               int dest)
+{
+    int i;
+
+    if (data_length < 1)
+        return;
+
+    if (data[0] == MENDELEEV_COLOR_TABLE_DENSE && data_length >= MENDELEEV_COLOR_TABLE_HEADER_DENSE) {
+        int first = data[1];
+        int nb = (data_length - MENDELEEV_COLOR_TABLE_HEADER_DENSE) / MENDELEEV_COLOR_LENGTH;
+
+        for (i = 0; i < nb && first + i < 256; i++) {
+            const uint8_t *entry = data + MENDELEEV_COLOR_TABLE_HEADER_DENSE + i * MENDELEEV_COLOR_LENGTH;
+            int address = first + i;
+
+            if (!sim->present[address])
+                continue;
+            if (dest != MENDELEEV_BROADCAST_ADDRESS &&
+                !(sim->nodes[address].groups & (1 << (dest - MENDELEEV_GROUP_ADDRESS_BASE))))
+                continue;
+            sim->nodes[address].color.r = entry[0];
+            sim->nodes[address].color.g = entry[1];
+            sim->nodes[address].color.b = entry[2];
+        }
+    } else if (data[0] == MENDELEEV_COLOR_TABLE_SPARSE) {
+        int nb = (data_length - MENDELEEV_COLOR_TABLE_HEADER_SPARSE) /
+            (MENDELEEV_ADDR_LENGTH + MENDELEEV_COLOR_LENGTH);
+
+        for (i = 0; i < nb; i++) {
+            const uint8_t *entry = data + MENDELEEV_COLOR_TABLE_HEADER_SPARSE +
+                i * (MENDELEEV_ADDR_LENGTH + MENDELEEV_COLOR_LENGTH);
+            int address = entry[0];
+
+            if (!sim->present[address])
+                continue;
+            if (dest != MENDELEEV_BROADCAST_ADDRESS &&
+                !(sim->nodes[address].groups & (1 << (dest - MENDELEEV_GROUP_ADDRESS_BASE))))
+                continue;
+            sim->nodes[address].color.r = entry[1];
+            sim->nodes[address].color.g = entry[2];
+            sim->nodes[address].color.b = entry[3];
+        }
+    }
+}
+
+static uint32_t _get_be32(const uint8_t *src)
+{
+    return ((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+}
+
+static void _put_be32(uint8_t *dest, uint32_t value)
+{
+    dest[0] = value >> 24;
+    dest[1] = value >> 16;
+    dest[2] = value >> 8;
+    dest[3] = value;
+}
+
+/* Replaces the firmware of node by the received image, or the image rebuilt
+   from the received delta. Returns the status of END. */
+static int _ota_install(sim_t *sim, sim_node_t *node)
+{
+    sim_ota_t *ota = &node->ota;
+    uint8_t *firmware;
+    size_t size;
+    char version[SIM_VERSION_LENGTH];
+
+    if (mendeleev_crc16_update(MENDELEEV_CRC16_INIT, ota->image, ota->size) != ota->crc)
+        return MENDELEEV_OTA_STATUS_BAD_CRC;
+
+    if (ota->delta) {
+        size = ota->target_size;
+        firmware = malloc(size);
+        if (firmware == NULL ||
+            mendeleev_delta_apply(node->firmware, node->firmware_size, ota->image, ota->size,
+                                  firmware, size) == -1 ||
+            mendeleev_crc16_update(MENDELEEV_CRC16_INIT, firmware, size) != ota->target_crc) {
+            free(firmware);
+            return MENDELEEV_OTA_STATUS_BAD_DELTA;
+        }
+    } else {
+        size = ota->size;
+        firmware = ota->image;
+        ota->image = NULL;
+    }
+
+    free(node->firmware);
+    node->firmware = firmware;
+    node->firmware_size = size;
+
+    if (sim->store != NULL &&
+        mendeleev_store_find(sim->store, firmware, size, version, sizeof(version)) == 0)
+        strcpy(node->version, version);
+
+    return MENDELEEV_OTA_STATUS_OK;
+}
+
+/* Runs an OTA operation, returns the length of the response data or -1 */
+static int _node_ota(sim_t *sim, sim_node_t *node, const uint8_t *data, int data_length,
+                     uint8_t *rsp_data)
+{
+    sim_ota_t *ota = &node->ota;
+
+    if (data_length < 1)
+        return -1;
+    rsp_data[0] = data[0];
+
+    switch (data[0]) {
+    case MENDELEEV_OTA_BEGIN: {
+        uint32_t size;
+        uint16_t chunk_size;
+        uint16_t crc;
+        int delta = (data[1] & MENDELEEV_OTA_FLAG_DELTA) != 0;
+        uint32_t target_size = 0;
+        uint16_t target_crc = 0;
+        int nb_chunks;
+
+        if (data_length < (delta ? MENDELEEV_OTA_BEGIN_DELTA_LENGTH : MENDELEEV_OTA_BEGIN_LENGTH))
+            return -1;
+        size = _get_be32(data + 2);
+        chunk_size = (data[6] << 8) | data[7];
+        crc = (data[8] << 8) | data[9];
+        if (size == 0 || chunk_size == 0 || chunk_size > MENDELEEV_OTA_MAX_CHUNK)
+            return -1;
+
+        if (delta) {
+            uint16_t base_crc = (data[16] << 8) | data[17];
+
+            /* Not the base of the delta */
+            if (node->firmware == NULL ||
+                mendeleev_crc16_update(MENDELEEV_CRC16_INIT, node->firmware,
+                                       node->firmware_size) != base_crc)
+                return -1;
+            target_size = _get_be32(data + 10);
+            target_crc = (data[14] << 8) | data[15];
+        }
+
+        /* Resumes the same image */
+        if (!(data[1] & MENDELEEV_OTA_FLAG_RESUME) || ota->state != MENDELEEV_OTA_STATE_RECEIVING ||
+            ota->size != size || ota->chunk_size != chunk_size || ota->crc != crc ||
+            ota->delta != delta || ota->target_crc != target_crc) {
+            _ota_reset(ota);
+            nb_chunks = (size + chunk_size - 1) / chunk_size;
+            ota->image = malloc(size);
+            ota->received = calloc(nb_chunks, 1);
+            if (ota->image == NULL || ota->received == NULL) {
+                _ota_reset(ota);
+                return -1;
+            }
+            ota->state = MENDELEEV_OTA_STATE_RECEIVING;
+            ota->size = size;
+            ota->chunk_size = chunk_size;
+            ota->crc = crc;
+            ota->delta = delta;
+            ota->target_size = target_size;
+            ota->target_crc = target_crc;
+        }
+        _put_be32(rsp_data + 1, ota->offset);
+        return 5;
+    }
+    case MENDELEEV_OTA_DATA:
+    case MENDELEEV_OTA_DATA_LZ4: {
+        uint32_t offset;
+        uint32_t chunk;
+        uint32_t length;
+        int rc;
+
+        if (data_length < MENDELEEV_OTA_DATA_HEADER || ota->state != MENDELEEV_OTA_STATE_RECEIVING)
+            return -1;
+        offset = _get_be32(data + 1);
+        if (offset % ota->chunk_size != 0 || offset >= ota->size)
+            return -1;
+        length = ota->size - offset < ota->chunk_size ? ota->size - offset : ota->chunk_size;
+
+        if (data[0] == MENDELEEV_OTA_DATA_LZ4) {
+            rc = mendeleev_lz4_decompress(data + MENDELEEV_OTA_DATA_HEADER,
+                                          data_length - MENDELEEV_OTA_DATA_HEADER,
+                                          ota->image + offset, length);
+        } else {
+            rc = data_length - MENDELEEV_OTA_DATA_HEADER;
+            if ((uint32_t)rc == length)
+                memcpy(ota->image + offset, data + MENDELEEV_OTA_DATA_HEADER, length);
+        }
+        if (rc == -1 || (uint32_t)rc != length)
+            return -1;
+
+        chunk = offset / ota->chunk_size;
+        ota->received[chunk] = 1;
+        while (ota->offset < ota->size && ota->received[ota->offset / ota->chunk_size]) {
+            ota->offset += ota->chunk_size;
+            if (ota->offset > ota->size)
+                ota->offset = ota->size;
+        }
+        _put_be32(rsp_data + 1, offset);
+        return 5;
+    }
+    case MENDELEEV_OTA_END:
+        if (ota->state == MENDELEEV_OTA_STATE_COMPLETE) {
+            /* The response to the previous END was lost */
+            rsp_data[1] = MENDELEEV_OTA_STATUS_OK;
+        } else if (ota->state != MENDELEEV_OTA_STATE_RECEIVING || ota->offset != ota->size) {
+            rsp_data[1] = MENDELEEV_OTA_STATUS_INCOMPLETE;
+        } else {
+            rsp_data[1] = _ota_install(sim, node);
+            ota->state = rsp_data[1] == MENDELEEV_OTA_STATUS_OK ?
+                MENDELEEV_OTA_STATE_COMPLETE : MENDELEEV_OTA_STATE_FAILED;
+        }
+        return 2;
+    case MENDELEEV_OTA_ABORT:
+        if (ota->state == MENDELEEV_OTA_STATE_RECEIVING)
+            _ota_reset(ota);
+        return 1;
+    case MENDELEEV_OTA_STATUS:
+        rsp_data[1] = ota->state;
+        _put_be32(rsp_data + 2, ota->offset);
+        _put_be32(rsp_data + 6, ota->size);
+        return 10;
+    case MENDELEEV_OTA_MISSING: {
+        uint32_t first;
+        uint32_t nb_chunks;
+        uint32_t nb;
+        uint32_t i;
+
+        if (data_length < 5 || ota->state != MENDELEEV_OTA_STATE_RECEIVING)
+            return -1;
+        nb_chunks = (ota->size + ota->chunk_size - 1) / ota->chunk_size;
+        first = ((uint32_t)data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
+        if (first >= nb_chunks)
+            return -1;
+
+        nb = nb_chunks - first;
+        if (nb > (MENDELEEV_MAX_DATA_LENGTH - MENDELEEV_OTA_MISSING_HEADER) * 8)
+            nb = (MENDELEEV_MAX_DATA_LENGTH - MENDELEEV_OTA_MISSING_HEADER) * 8;
+        _put_be32(rsp_data + 1, first);
+        rsp_data[5] = nb >> 8;
+        rsp_data[6] = nb & 0xFF;
+        memset(rsp_data + MENDELEEV_OTA_MISSING_HEADER, 0, (nb + 7) / 8);
+        for (i = 0; i < nb; i++) {
+            if (!ota->received[first + i])
+                rsp_data[MENDELEEV_OTA_MISSING_HEADER + i / 8] |= 1 << (i % 8);
+        }
+        return MENDELEEV_OTA_MISSING_HEADER + (nb + 7) / 8;
+    }
+    default:
+        return -1;
+    }
+}
+
+/* Runs a command on one node, returns the length of the response data or -1
+   for a negative acknowledge */
+static int _node_command(sim_t *sim, sim_node_t *node, uint8_t command,
+                         const uint8_t *data, int data_length, uint8_t *rsp_data)
+{
+    switch (command) {
+    case MENDELEEV_CMD_SET_COLOR:
+        if (data_length < MENDELEEV_COLOR_LENGTH)
+            return -1;
+        node->color.r = data[0];
+        node->color.g = data[1];
+        node->color.b = data[2];
+        return 0;
+    case MENDELEEV_CMD_SET_MODE:
+        if (data_length < 1)
+            return -1;
+        node->mode = data[0];
+        return 0;
+    case MENDELEEV_CMD_SET_OUTPUT:
+        if (data_length < 1)
+            return -1;
+        node->output = data[0];
+        return 0;
+    case MENDELEEV_CMD_GET_VERSION:
+        memcpy(rsp_data, node->version, strlen(node->version));
+        return strlen(node->version);
+    case MENDELEEV_CMD_SET_GROUP:
+        if (data_length < 2)
+            return -1;
+        node->groups = (data[0] << 8) | data[1];
+        return 0;
+    case MENDELEEV_CMD_OTA:
+        return _node_ota(sim, node, data, data_length, rsp_data);
+    case MENDELEEV_CMD_REBOOT:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void _handle_frame(sim_t *sim, const uint8_t *req, int req_length,
+                          int64_t received_at)
+{
+    int dest = req[MENDELEEV_DEST_OFFSET];
+    uint8_t command = req[MENDELEEV_CMD_OFFSET];
+    const uint8_t *data = req + MENDELEEV_DATA_OFFSET;
+    int data_length = req_length - MENDELEEV_MSG_OVERHEAD;
+    uint8_t rsp_data[MENDELEEV_MAX_DATA_LENGTH];
+    int64_t start;
+    int64_t request_end;
+    int rc;
+
+    sim->stats.frames++;
+
+    start = received_at > sim->line_free ? received_at : sim->line_free;
+    request_end = start + _wire_time(sim, req_length);
+    sim->line_free = request_end;
+
+    if (sim->config.debug) {
+        fprintf(stderr, "sim: command 0x%.2X to %d (%d bytes)\n",
+                command, dest, data_length);
+    }
+
+    if (MENDELEEV_IS_MULTICAST_ADDRESS(dest)) {
+        int address;
+
+        if (command == MENDELEEV_CMD_SET_COLOR_TABLE) {
+            _apply_color_table(sim, data, data_length, dest);
+            return;
+        }
+
+        for (address = 1; address < MENDELEEV_GROUP_ADDRESS_BASE; address++) {
+            if (!sim->present[address])
+                continue;
+            if (dest != MENDELEEV_BROADCAST_ADDRESS &&
+                !(sim->nodes[address].groups & (1 << (dest - MENDELEEV_GROUP_ADDRESS_BASE))))
+                continue;
+            if (_random(sim) < sim->config.loss_rate) {
+                sim->stats.lost++;
+                continue;
+            }
+            _node_command(sim, &sim->nodes[address], command, data, data_length,
+                          rsp_data);
+        }
+        return;
+    }
+
+    if (!sim->present[dest])
+        return;
+    if (_random(sim) < sim->config.loss_rate) {
+        sim->stats.lost++;
+        return;
+    }
+
+    rc = _node_command(sim, &sim->nodes[dest], command, data, data_length, rsp_data);
+    {
+        int64_t reply_at = request_end + sim->config.latency_us;
+
+        if (sim->config.jitter_us > 0)
+            reply_at += rand_r(&sim->seed) % sim->config.jitter_us;
+
+        if (rc == -1)
+            _reply(sim, req, reply_at, (uint8_t)~command, NULL, 0);
+        else
+            _reply(sim, req, reply_at, command, rsp_data, rc);
+    }
+}
+
+/* Parses the frames of the buffer, resynchronising on the preamble like the
+   library does */
+static void _parse(sim_t *sim, int64_t received_at)
+{
+    int offset = 0;
+
+    while (sim->length - offset >= SIM_FRAME_MIN) {
+        int i;
+        int frame_length;
+        uint16_t datalen;
+        uint16_t crc;
+        const uint8_t *frame = sim->buf + offset;
+
+        for (i = 0; i < MENDELEEV_PREAMBLE_LENGTH && frame[i] == PREAMBLE; i++)
+            ;
+        datalen = (frame[MENDELEEV_DATALEN_OFFSET] << 8) | frame[MENDELEEV_DATALEN_OFFSET + 1];
+        if (i < MENDELEEV_PREAMBLE_LENGTH || datalen > MENDELEEV_MAX_DATA_LENGTH) {
+            offset++;
+            sim->stats.bytes_skipped++;
+            continue;
+        }
+
+        frame_length = MENDELEEV_MSG_OVERHEAD + datalen;
+        if (sim->length - offset < frame_length)
+            break;
+
+        crc = mendeleev_crc16(frame + MENDELEEV_DEST_OFFSET,
+                              frame_length - MENDELEEV_PREAMBLE_LENGTH - MENDELEEV_CHECKSUM_LENGTH);
+        if (crc != ((frame[frame_length - 2] << 8) | frame[frame_length - 1])) {
+            sim->stats.bad_crc++;
+            offset++;
+            sim->stats.bytes_skipped++;
+            continue;
+        }
+
+        _handle_frame(sim, frame, frame_length, received_at);
+        offset += frame_length;
+    }
+
+    memmove(sim->buf, sim->buf + offset, sim->length - offset);
+    sim->length -= offset;
+}
+
+/* Serves the requests until *stop becomes non zero */
+int sim_run(sim_t *sim, volatile int *stop)
+{
+    while (stop == NULL || !*stop) {
+        struct pollfd pfd;
+        int rc;
+
+        pfd.fd = sim->master;
+        pfd.events = POLLIN;
+        rc = poll(&pfd, 1, 100);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            continue;
+
+        rc = read(sim->master, sim->buf + sim->length, SIM_BUFFER_SIZE - sim->length);
+        if (rc == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        sim->length += rc;
+        _parse(sim, _now_us());
+
+        /* Garbage without any frame */
+        if (sim->length == SIM_BUFFER_SIZE)
+            sim->length = 0;
+    }
+
+    return 0;
+}
+
+/* Serves the requests in a child process, to be stopped with SIGTERM */
+pid_t sim_fork(sim_t *sim)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        sim_run(sim, NULL);
+        _exit(0);
+    }
+
+    return pid;
+}
@@ -0,0 +1,94 @@
+/*
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mendeleev.h"
+
+/* Virtual Mendeleev bus: a pseudo-terminal pair whose master side emulates
+ * nodes, the slave side is given to mendeleev_new_rtu() */
+
+#define SIM_VERSION_LENGTH 32
+
+typedef struct _sim_config {
+    /* Addresses of the emulated nodes */
+    int first_node;
+    int nb_nodes;
+    /* Turnaround before a node replies, plus a random jitter */
+    int latency_us;
+    int jitter_us;
+    /* Probabilities that a reply is lost, corrupted or preceded by noise */
+    double drop_rate;
+    double corrupt_rate;
+    double noise_rate;
+    /* Probability that a node misses a request, broadcasts included */
+    double loss_rate;
+    /* Emulated line rate, 0 for no pacing */
+    int baud;
+    unsigned int seed;
+    char version[SIM_VERSION_LENGTH];
+    /* Store of firmware images (or NULL): the nodes run the image of version
+       and report the version of the image they accept */
+    const char *store;
+    int debug;
+} sim_config_t;
+
+/* Firmware transfer of MENDELEEV_CMD_OTA */
+typedef struct _sim_ota {
+    int state;
+    uint32_t size;
+    uint16_t chunk_size;
+    uint16_t crc;
+    /* The image is a delta to the target */
+    int delta;
+    uint32_t target_size;
+    uint16_t target_crc;
+    uint8_t *image;
+    /* One byte per chunk, set when received */
+    uint8_t *received;
+    /* Length received without gap */
+    uint32_t offset;
+} sim_ota_t;
+
+typedef struct _sim_node {
+    int address;
+    mendeleev_color_t color;
+    uint8_t mode;
+    uint8_t output;
+    uint16_t groups;
+    char version[SIM_VERSION_LENGTH];
+    /* Running firmware, NULL when unknown */
+    uint8_t *firmware;
+    size_t firmware_size;
+    sim_ota_t ota;
+} sim_node_t;
+
+typedef struct _sim_stats {
+    unsigned long frames;
+    unsigned long bad_crc;
+    unsigned long bytes_skipped;
+    unsigned long replies;
+    unsigned long dropped;
+    unsigned long corrupted;
+    unsigned long lost;
+} sim_stats_t;
+
+typedef struct _sim sim_t;
+
+void sim_config_init(sim_config_t *config);
+sim_t *sim_new(const sim_config_t *config);
+void sim_free(sim_t *sim);
+
+const char *sim_get_device(sim_t *sim);
+sim_node_t *sim_get_node(sim_t *sim, int address);
+const sim_stats_t *sim_get_stats(sim_t *sim);
+
+int sim_run(sim_t *sim, volatile int *stop);
+pid_t sim_fork(sim_t *sim);
+
+#endif /* SIM_H */